@@ -93,11 +93,8 @@ private:
       
     // check evaluation of Cost Function (on random points)
     std::cout << "Evaluating Cost Function on " << cfEvaluations << " random points in the PQ profile...";
-    dummy = 0;
-    for (auto i = 0; i < cfEvaluations; ++i) {
-      dummy += evalCostFuncOnRandomPoint();
-      // prevent compiler from optimizing away unused results
-    }
+    dummy = evalCostFuncOnRandomPoints().sum();
+    // prevent compiler from optimizing away unused results
     std::cout << "done" << std::endl;
 
     std::cout << "Evaluating Belief Function on " << bfEvaluations
@@ -122,15 +119,21 @@ private:
     if (iSP.size() != 2) throw UninitializedImplementedSetpoint{};
   }
 
-  double evalCostFuncOnRandomPoint() {
-    // Evaluate cost function on a random point in the PQ profile
+  Eigen::VectorXd evalCostFuncOnRandomPoints() {
+    // Evaluate cost function on cfEvaluations random points in the PQ profile
+    // (in one batch)
 
-      Eigen::VectorXd randomPoint(2);
-      
-      randomPoint = sampleSetpoint();
-    // sample random point in the PQ profile
+    Eigen::VectorXd P(cfEvaluations), Q(cfEvaluations), values(cfEvaluations);
+    for (auto i = 0; i < cfEvaluations; ++i) {
+      Eigen::VectorXd randomPoint(sampleSetpoint());
+      // sample random point in the PQ profile
+      P[i] = randomPoint[0];
+      Q[i] = randomPoint[1];
+    }
 
-    return interpreter.evaluate(_adv.getCostFunction(), {{"P", randomPoint[0]}, {"Q", randomPoint[1]}});
+    interpreter.evaluateBatch(interpreter.costFunction(), P.data(), Q.data(),
+                              cfEvaluations, values.data());
+    return values;
   }
 
   Eigen::AlignedBoxXd evalBeliefBoxOnRandomPoint() {
@@ -0,0 +1,482 @@
+// The MIT License (MIT)
+// 
+// Copyright (c) 2015 Niek J. Bouman
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+// 
+#include "simplify.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace msg;
+
+namespace {
+
+bool evaluateConstant(RealExpr::Reader expr, double &value);
+
+bool isConstant(RealExpr::Reader expr, double &value) {
+  // an unnamed expression whose value does not depend on any variable or
+  // reference
+  return !expr.hasName() && evaluateConstant(expr, value);
+}
+
+double sign(double x) { return (0.0 < x) - (x < 0.0); }
+
+bool applyUnary(UnaryOperation::Operation::Which op, double x,
+                double &value) {
+  // the same arithmetic as the interpreter
+  switch (op) {
+  case UnaryOperation::Operation::NEGATE:
+    value = -x;
+    return true;
+  case UnaryOperation::Operation::ABS:
+    value = std::abs(x);
+    return true;
+  case UnaryOperation::Operation::SIGN:
+    value = sign(x);
+    return true;
+  case UnaryOperation::Operation::MULT_INV:
+    value = 1.0 / x;
+    return true;
+  case UnaryOperation::Operation::SQUARE:
+    value = x * x;
+    return true;
+  case UnaryOperation::Operation::SQRT:
+    value = std::sqrt(x);
+    return true;
+  case UnaryOperation::Operation::SIN:
+    value = std::sin(x);
+    return true;
+  case UnaryOperation::Operation::COS:
+    value = std::cos(x);
+    return true;
+  case UnaryOperation::Operation::TAN:
+    value = std::tan(x);
+    return true;
+  case UnaryOperation::Operation::EXP:
+    value = std::exp(x);
+    return true;
+  case UnaryOperation::Operation::LN:
+    value = std::log(x);
+    return true;
+  case UnaryOperation::Operation::LOG10:
+    value = std::log10(x);
+    return true;
+  case UnaryOperation::Operation::ROUND:
+    value = std::round(x);
+    return true;
+  case UnaryOperation::Operation::FLOOR:
+    value = std::floor(x);
+    return true;
+  case UnaryOperation::Operation::CEIL:
+    value = std::ceil(x);
+    return true;
+  }
+  return false;
+}
+
+bool applyBinary(BinaryOperation::Operation::Which op, double a, double b,
+                 double &value) {
+  switch (op) {
+  case BinaryOperation::Operation::SUM:
+    value = a + b;
+    return true;
+  case BinaryOperation::Operation::PROD:
+    value = a * b;
+    return true;
+  case BinaryOperation::Operation::POW:
+    value = std::pow(a, b);
+    return true;
+  case BinaryOperation::Operation::MIN:
+    value = std::min(a, b);
+    return true;
+  case BinaryOperation::Operation::MAX:
+    value = std::max(a, b);
+    return true;
+  case BinaryOperation::Operation::LESS_EQ_THAN:
+    value = (a <= b) ? 1.0 : 0.0;
+    return true;
+  case BinaryOperation::Operation::GREATER_THAN:
+    value = (a > b) ? 1.0 : 0.0;
+    return true;
+  }
+  return false;
+}
+
+bool evaluateConstant(RealExpr::Reader expr, double &value) {
+  // (the name of expr itself does not matter)
+  switch (expr.which()) {
+  case RealExpr::REAL:
+    value = expr.getReal();
+    return true;
+  case RealExpr::UNARY_OPERATION: {
+    auto op = expr.getUnaryOperation();
+    double x;
+    return isConstant(op.getArg(), x) &&
+           applyUnary(op.getOperation().which(), x, value);
+  }
+  case RealExpr::BINARY_OPERATION: {
+    auto op = expr.getBinaryOperation();
+    double a, b;
+    return isConstant(op.getArgA(), a) && isConstant(op.getArgB(), b) &&
+           applyBinary(op.getOperation().which(), a, b, value);
+  }
+  case RealExpr::LIST_OPERATION: {
+    auto op = expr.getListOperation();
+    bool sum = op.getOperation().which() == ListOperation::Operation::SUM;
+    value = sum ? 0.0 : 1.0;
+    for (auto arg : op.getArgs()) {
+      double x;
+      if (!isConstant(arg, x))
+        return false;
+      value = sum ? value + x : value * x;
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+enum class Associative { None, Sum, Prod };
+
+Associative associativeOperation(RealExpr::Reader expr) {
+  switch (expr.which()) {
+  case RealExpr::BINARY_OPERATION:
+    switch (expr.getBinaryOperation().getOperation().which()) {
+    case BinaryOperation::Operation::SUM:
+      return Associative::Sum;
+    case BinaryOperation::Operation::PROD:
+      return Associative::Prod;
+    default:
+      return Associative::None;
+    }
+  case RealExpr::LIST_OPERATION:
+    if (expr.getListOperation().getArgs().size() == 0)
+      return Associative::None;
+    switch (expr.getListOperation().getOperation().which()) {
+    case ListOperation::Operation::SUM:
+      return Associative::Sum;
+    case ListOperation::Operation::PROD:
+      return Associative::Prod;
+    }
+    return Associative::None;
+  default:
+    return Associative::None;
+  }
+}
+
+void collectOperands(RealExpr::Reader expr, Associative op,
+                     std::vector<RealExpr::Reader> &operands) {
+  // Flattens left-nested sums (products) into a list of operands. As the
+  // operands are accumulated in their original order, the flattened
+  // expression evaluates to the same value. (A constant first operand is
+  // kept as a whole, such that it is folded into a single number.)
+  auto collectFirst = [&](RealExpr::Reader first) {
+    double value;
+    if (!first.hasName() && associativeOperation(first) == op &&
+        !evaluateConstant(first, value))
+      collectOperands(first, op, operands);
+    else
+      operands.push_back(first);
+  };
+
+  if (expr.which() == RealExpr::BINARY_OPERATION) {
+    auto binop = expr.getBinaryOperation();
+    collectFirst(binop.getArgA());
+    operands.push_back(binop.getArgB());
+  } else {
+    auto args = expr.getListOperation().getArgs();
+    collectFirst(args[0]);
+    for (unsigned i = 1; i < args.size(); ++i)
+      operands.push_back(args[i]);
+  }
+}
+
+void setOperation(UnaryOperation::Operation::Which op,
+                  UnaryOperation::Operation::Builder out) {
+  switch (op) {
+  case UnaryOperation::Operation::NEGATE:
+    out.setNegate();
+    return;
+  case UnaryOperation::Operation::ABS:
+    out.setAbs();
+    return;
+  case UnaryOperation::Operation::SIGN:
+    out.setSign();
+    return;
+  case UnaryOperation::Operation::MULT_INV:
+    out.setMultInv();
+    return;
+  case UnaryOperation::Operation::SQUARE:
+    out.setSquare();
+    return;
+  case UnaryOperation::Operation::SQRT:
+    out.setSqrt();
+    return;
+  case UnaryOperation::Operation::SIN:
+    out.setSin();
+    return;
+  case UnaryOperation::Operation::COS:
+    out.setCos();
+    return;
+  case UnaryOperation::Operation::TAN:
+    out.setTan();
+    return;
+  case UnaryOperation::Operation::EXP:
+    out.setExp();
+    return;
+  case UnaryOperation::Operation::LN:
+    out.setLn();
+    return;
+  case UnaryOperation::Operation::LOG10:
+    out.setLog10();
+    return;
+  case UnaryOperation::Operation::ROUND:
+    out.setRound();
+    return;
+  case UnaryOperation::Operation::FLOOR:
+    out.setFloor();
+    return;
+  case UnaryOperation::Operation::CEIL:
+    out.setCeil();
+    return;
+  }
+}
+
+void setOperation(BinaryOperation::Operation::Which op,
+                  BinaryOperation::Operation::Builder out) {
+  switch (op) {
+  case BinaryOperation::Operation::SUM:
+    out.setSum();
+    return;
+  case BinaryOperation::Operation::PROD:
+    out.setProd();
+    return;
+  case BinaryOperation::Operation::POW:
+    out.setPow();
+    return;
+  case BinaryOperation::Operation::MIN:
+    out.setMin();
+    return;
+  case BinaryOperation::Operation::MAX:
+    out.setMax();
+    return;
+  case BinaryOperation::Operation::LESS_EQ_THAN:
+    out.setLessEqThan();
+    return;
+  case BinaryOperation::Operation::GREATER_THAN:
+    out.setGreaterThan();
+    return;
+  }
+}
+
+void simplifyAssociative(RealExpr::Reader expr, Associative op,
+                         RealExpr::Builder out) {
+  std::vector<RealExpr::Reader> operands;
+  collectOperands(expr, op, operands);
+
+  // remove the neutral operands, x+0 and x*1
+  double neutral = (op == Associative::Sum) ? 0.0 : 1.0;
+  operands.erase(std::remove_if(operands.begin(), operands.end(),
+                                [neutral](RealExpr::Reader operand) {
+                                  double value;
+                                  return isConstant(operand, value) &&
+                                         value == neutral;
+                                }),
+                 operands.end());
+
+  if (operands.size() == 1 &&
+      !(expr.hasName() && operands[0].hasName())) {
+    // (the operand replaces the expression, unless both have a name)
+    cv::simplify(operands[0], out);
+    return;
+  }
+  if (operands.size() == 2) {
+    auto binop = out.initBinaryOperation();
+    if (op == Associative::Sum)
+      binop.initOperation().setSum();
+    else
+      binop.initOperation().setProd();
+    cv::simplify(operands[0], binop.initArgA());
+    cv::simplify(operands[1], binop.initArgB());
+    return;
+  }
+  auto listop = out.initListOperation();
+  if (op == Associative::Sum)
+    listop.initOperation().setSum();
+  else
+    listop.initOperation().setProd();
+  auto args = listop.initArgs(operands.size());
+  for (unsigned i = 0; i < operands.size(); ++i)
+    cv::simplify(operands[i], args[i]);
+}
+
+void simplify(::capnp::List<RealExpr>::Reader exprs,
+              ::capnp::List<RealExpr>::Builder out) {
+  for (unsigned i = 0; i < exprs.size(); ++i)
+    cv::simplify(exprs[i], out[i]);
+}
+
+} // namespace
+
+void cv::simplify(RealExpr::Reader expr, RealExpr::Builder out) {
+  if (expr.hasName())
+    out.setName(expr.getName());
+
+  double value;
+  if (evaluateConstant(expr, value)) {
+    out.setReal(value);
+    return;
+  }
+
+  auto op = associativeOperation(expr);
+  if (op != Associative::None) {
+    simplifyAssociative(expr, op, out);
+    return;
+  }
+
+  switch (expr.which()) {
+  case RealExpr::REAL:
+  case RealExpr::LIST_OPERATION:
+    // (handled above)
+    return;
+  case RealExpr::POLYNOMIAL:
+    out.setPolynomial(expr.getPolynomial());
+    return;
+  case RealExpr::UNARY_OPERATION: {
+    auto in = expr.getUnaryOperation();
+    auto unaryop = out.initUnaryOperation();
+    setOperation(in.getOperation().which(), unaryop.initOperation());
+    simplify(in.getArg(), unaryop.initArg());
+    return;
+  }
+  case RealExpr::BINARY_OPERATION: {
+    auto in = expr.getBinaryOperation();
+    auto binop = out.initBinaryOperation();
+    setOperation(in.getOperation().which(), binop.initOperation());
+    simplify(in.getArgA(), binop.initArgA());
+    simplify(in.getArgB(), binop.initArgB());
+    return;
+  }
+  case RealExpr::CASE_DISTINCTION: {
+    auto in = expr.getCaseDistinction();
+    auto casedist = out.initCaseDistinction();
+    auto inVariables = in.getVariables();
+    auto variables = casedist.initVariables(inVariables.size());
+    for (unsigned i = 0; i < inVariables.size(); ++i)
+      variables.set(i, inVariables[i]);
+    auto inCases = in.getCases();
+    auto cases = casedist.initCases(inCases.size());
+    for (unsigned i = 0; i < inCases.size(); ++i) {
+      simplify(inCases[i].getSet(), cases[i].initSet());
+      simplify(inCases[i].getExpression(), cases[i].initExpression());
+    }
+    return;
+  }
+  case RealExpr::REFERENCE:
+    out.setReference(expr.getReference());
+    return;
+  case RealExpr::VARIABLE:
+    out.setVariable(expr.getVariable());
+    return;
+  }
+}
+
+void cv::simplify(SetExpr::Reader set, SetExpr::Builder out) {
+  if (set.hasName())
+    out.setName(set.getName());
+
+  switch (set.which()) {
+  case SetExpr::SINGLETON: {
+    auto in = set.getSingleton();
+    ::simplify(in, out.initSingleton(in.size()));
+    return;
+  }
+  case SetExpr::BALL: {
+    auto in = set.getBall();
+    auto ball = out.initBall();
+    ::simplify(in.getCenter(), ball.initCenter(in.getCenter().size()));
+    simplify(in.getRadius(), ball.initRadius());
+    return;
+  }
+  case SetExpr::RECTANGLE: {
+    auto in = set.getRectangle();
+    auto rectangle = out.initRectangle(in.size());
+    for (unsigned i = 0; i < in.size(); ++i) {
+      simplify(in[i].getBoundA(), rectangle[i].initBoundA());
+      simplify(in[i].getBoundB(), rectangle[i].initBoundB());
+    }
+    return;
+  }
+  case SetExpr::CONVEX_POLYTOPE: {
+    auto in = set.getConvexPolytope();
+    auto poly = out.initConvexPolytope();
+    auto inA = in.getA();
+    auto A = poly.initA(inA.size());
+    for (unsigned i = 0; i < inA.size(); ++i)
+      ::simplify(inA[i], A.init(i, inA[i].size()));
+    ::simplify(in.getB(), poly.initB(in.getB().size()));
+    return;
+  }
+  case SetExpr::INTERSECTION: {
+    auto in = set.getIntersection();
+    auto intersection = out.initIntersection(in.size());
+    for (unsigned i = 0; i < in.size(); ++i)
+      simplify(in[i], intersection[i]);
+    return;
+  }
+  case SetExpr::CASE_DISTINCTION: {
+    auto in = set.getCaseDistinction();
+    auto casedist = out.initCaseDistinction();
+    auto inVariables = in.getVariables();
+    auto variables = casedist.initVariables(inVariables.size());
+    for (unsigned i = 0; i < inVariables.size(); ++i)
+      variables.set(i, inVariables[i]);
+    auto inCases = in.getCases();
+    auto cases = casedist.initCases(inCases.size());
+    for (unsigned i = 0; i < inCases.size(); ++i) {
+      simplify(inCases[i].getSet(), cases[i].initSet());
+      simplify(inCases[i].getExpression(), cases[i].initExpression());
+    }
+    return;
+  }
+  case SetExpr::REFERENCE:
+    out.setReference(set.getReference());
+    return;
+  }
+}
+
+void cv::simplifyAdvertisement(Advertisement::Builder adv) {
+  // The original expressions are copied into a scratch message, and the
+  // simplified ones are written in their place. (Cap'n Proto zeroes the
+  // objects that are replaced; zeroes take hardly any space once the message
+  // is packed.)
+  ::capnp::MallocMessageBuilder scratch;
+  scratch.setRoot(adv.asReader());
+  auto original = scratch.getRoot<Advertisement>().asReader();
+
+  if (original.hasCostFunction())
+    simplify(original.getCostFunction(), adv.initCostFunction());
+  if (original.hasPQProfile())
+    simplify(original.getPQProfile(), adv.initPQProfile());
+  if (original.hasBeliefFunction())
+    simplify(original.getBeliefFunction(), adv.initBeliefFunction());
+}
@@ -0,0 +1,75 @@
+// The MIT License (MIT)
+// 
+// Copyright (c) 2015 Niek J. Bouman
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+// 
+/*! \file
+ * \brief Simplification of the real expressions in a Commelec Advertisement
+ * before it is sent
+ *
+ * Advertisements that are generated programmatically tend to contain
+ * subexpressions that do not depend on any variable (e.g., products of device
+ * parameters), neutral operands (x*1, x+0) and nested sums and products. The
+ * functions in this file rewrite an advertisement into an equivalent, smaller
+ * one, which is cheaper to send and to evaluate.
+ *
+ * Named expressions are preserved (they may be referenced), hence a
+ * subexpression that has a name is never merged into its parent. References,
+ * variables, polynomials and case distinctions are not folded.
+*/
+
+#ifndef SIMPLIFY_HPP
+#define SIMPLIFY_HPP
+
+#include <capnp/message.h>
+#include "schema.capnp.h"
+
+namespace cv {
+
+/**
+Writes a simplified copy of `expr` into `out`: every subexpression that does
+not depend on a variable or a reference is replaced by its value, neutral
+operands of sums and products are removed and nested sums (products) are
+flattened into a single ListOperation.
+*/
+void simplify(msg::RealExpr::Reader expr, msg::RealExpr::Builder out);
+
+/**
+Writes a copy of `set` into `out`, in which all real expressions are
+simplified.
+*/
+void simplify(msg::SetExpr::Reader set, msg::SetExpr::Builder out);
+
+/**
+Simplifies the cost function, PQ profile and belief function of an
+advertisement in place, before it is packed and sent.
+
+Example:
+~~~~{.cpp}
+::capnp::MallocMessageBuilder builder;
+auto msg = builder.initRoot<msg::Message>();
+auto adv = msg.initAdvertisement();
+// ... build the advertisement ...
+cv::simplifyAdvertisement(adv);
+~~~~
+*/
+void simplifyAdvertisement(msg::Advertisement::Builder adv);
+}
+#endif
@@ -0,0 +1,53 @@
+#include <commelec-interpreter/adv-cache.hpp>
+
+using namespace msg;
+
+AdvCache::AdvCache(size_t capacity)
+    : _capacity(std::max(capacity, size_t(1))), _uses(0), _hits(0),
+      _misses(0) {}
+
+AdvCache::Entry *AdvCache::find(const AdvStructure &structure) {
+  auto candidates = _entries.equal_range(structure.hash);
+  for (auto candidate = candidates.first; candidate != candidates.second;
+       ++candidate)
+    if (candidate->second->signature == structure.signature)
+      return candidate->second.get();
+  return nullptr;
+}
+
+void AdvCache::evict() {
+  // (a linear scan; the capacity is small)
+  while (_entries.size() > _capacity) {
+    auto oldest = _entries.begin();
+    for (auto entry = _entries.begin(); entry != _entries.end(); ++entry)
+      if (entry->second->lastUse < oldest->second->lastUse)
+        oldest = entry;
+    _entries.erase(oldest);
+  }
+}
+
+std::shared_ptr<const AdvModel> AdvCache::model(Advertisement::Reader adv) {
+  auto structure = structureOf(adv);
+  auto entry = find(structure);
+  if (entry) {
+    ++_hits;
+  } else {
+    ++_misses;
+    std::unique_ptr<Entry> compiled(new Entry());
+    compiled->signature = structure.signature;
+    compiled->message.setRoot(adv);
+    compiled->interpreter.setAdv(
+        compiled->message.getRoot<Advertisement>().asReader(), true);
+    entry = compiled.get();
+    _entries.emplace(structure.hash, std::move(compiled));
+  }
+  entry->lastUse = ++_uses;
+
+  AdvFunc result(entry->interpreter.model());
+  result.rebind(adv, structure);
+  // (also on a miss: the model of the cache refers to its own copy of adv)
+  evict();
+  return result.model();
+}
+
+void AdvCache::clear() { _entries.clear(); }
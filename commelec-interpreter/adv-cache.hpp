@@ -0,0 +1,58 @@
+// Cache of compiled advertisements, by structure
+//
+// Resource agents send a new advertisement every cycle, which usually has the
+// same structure as the previous one (see adv-structure.hpp), with new
+// literals only (the implemented setpoint, a new bound on P, ...). An
+// AdvCache keeps a parametric model (see AdvFunc::setAdv) per structure that
+// it has seen, keyed by the hash of the signature. The model of an
+// advertisement of a known structure is a copy of the compiled program with
+// the constants bound to the literals of the advertisement (see
+// AdvFunc::rebind); the advertisement is compiled only when its structure is
+// new. The least recently used structures are evicted beyond the capacity.
+//
+// An AdvCache must not be used by several threads at once; the models it
+// returns can be shared (see AdvFunc::context).
+
+#ifndef ADVCACHE_HPP
+#define ADVCACHE_HPP
+
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <commelec-interpreter/adv-structure.hpp>
+
+#include <memory>
+
+class AdvCache {
+public:
+  explicit AdvCache(size_t capacity = 64);
+
+  std::shared_ptr<const AdvModel> model(msg::Advertisement::Reader adv);
+  // The model refers to adv, which must outlive it (as for AdvFunc). Throws
+  // as the constructor of AdvFunc.
+  AdvFunc interpreter(msg::Advertisement::Reader adv) {
+    return AdvFunc(model(adv));
+  }
+
+  size_t size() const { return _entries.size(); }
+  size_t hits() const { return _hits; }
+  size_t misses() const { return _misses; }
+  void clear();
+
+private:
+  struct Entry {
+    std::string signature; // (see AdvStructure)
+    capnp::MallocMessageBuilder message; // the advertisement compiled
+    AdvFunc interpreter; // (parametric)
+    uint64_t lastUse;
+  };
+
+  Entry *find(const AdvStructure &structure);
+  void evict();
+
+  size_t _capacity;
+  std::unordered_multimap<uint64_t, std::unique_ptr<Entry>> _entries;
+  uint64_t _uses;
+  size_t _hits;
+  size_t _misses;
+};
+
+#endif
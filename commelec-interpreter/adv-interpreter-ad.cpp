@@ -0,0 +1,411 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <cmath>
+#include <algorithm>
+
+// Forward-mode automatic differentiation of compiled programs
+//
+// The AD executor runs the same instructions as run(), but on "jets": the
+// value of a subexpression followed by its partial derivatives with respect
+// to the variables in the first _jet_dim slots. Every instruction combines
+// the jets of its operands by the chain rule, so the value and the complete
+// gradient are obtained in a single pass, without re-evaluating subexpressions.
+// For evaluateWithHessian, the jets also carry the matrix of second partial
+// derivatives (stored row-major after the gradient), which is propagated by
+// the second-order chain rule (forward-over-forward).
+//
+// As in the tree-walking evaluator (evalPartialDerivative), rounding
+// operations are treated as the identity when differentiating.
+
+using namespace msg;
+
+namespace {
+
+struct JetShape {
+  size_t dim;   // number of first-order partial derivatives
+  bool hessian; // whether the jet also contains the (dim x dim) Hessian
+};
+
+void jetUnary(double *a, const JetShape &shape, double f, double fa,
+              double faa) {
+  // a := f(a), where f' = fa and f'' = faa
+  const auto dim = shape.dim;
+  double *g = a + 1;
+  if (shape.hessian) {
+    // (second partial derivatives of a that vanish contribute nothing, also
+    // where f' or f'' is infinite, as for sqrt at 0)
+    auto times = [](double c, double x) { return (x == 0) ? 0.0 : c * x; };
+    double *H = g + dim;
+    for (size_t i = 0; i < dim; ++i)
+      for (size_t j = 0; j < dim; ++j)
+        H[i * dim + j] = times(fa, H[i * dim + j]) + times(faa, g[i] * g[j]);
+  }
+  a[0] = f;
+  for (size_t i = 0; i < dim; ++i)
+    g[i] *= fa;
+}
+
+void jetBinary(double *a, const double *b, const JetShape &shape, double f,
+               double fa, double fb, double faa, double fab, double fbb) {
+  // a := f(a,b), where fa, fb, faa, fab and fbb are the first- and
+  // second-order partial derivatives of f
+  const auto dim = shape.dim;
+  double *ga = a + 1;
+  const double *gb = b + 1;
+  if (shape.hessian) {
+    double *Ha = ga + dim;
+    const double *Hb = gb + dim;
+    for (size_t i = 0; i < dim; ++i)
+      for (size_t j = 0; j < dim; ++j) {
+        auto k = i * dim + j;
+        Ha[k] = fa * Ha[k] + fb * Hb[k] + faa * ga[i] * ga[j] +
+                fab * (ga[i] * gb[j] + gb[i] * ga[j]) + fbb * gb[i] * gb[j];
+      }
+  }
+  a[0] = f;
+  for (size_t i = 0; i < dim; ++i)
+    ga[i] = fa * ga[i] + fb * gb[i];
+}
+
+bool jetIsConstant(const double *a, size_t width) {
+  for (size_t i = 1; i < width; ++i)
+    if (a[i] != 0)
+      return false;
+  return true;
+}
+
+void jetUnaryOp(OpCode op, double *a, const JetShape &shape) {
+  double x = a[0];
+  switch (op) {
+  case OpCode::Negate:
+    jetUnary(a, shape, -x, -1.0, 0.0);
+    break;
+  case OpCode::Abs:
+    jetUnary(a, shape, std::abs(x), sgn(x), 0.0);
+    break;
+  case OpCode::Sign:
+    jetUnary(a, shape, sgn(x), 0.0, 0.0);
+    break;
+  case OpCode::MultInv:
+    jetUnary(a, shape, 1.0 / x, -1.0 / (x * x), 2.0 / (x * x * x));
+    break;
+  case OpCode::Square:
+    jetUnary(a, shape, x * x, 2.0 * x, 2.0);
+    break;
+  case OpCode::Sqrt: {
+    auto f = std::sqrt(x);
+    jetUnary(a, shape, f, 0.5 / f, -0.25 / (f * x));
+    break;
+  }
+  case OpCode::Sin: {
+    auto f = std::sin(x);
+    jetUnary(a, shape, f, std::cos(x), -f);
+    break;
+  }
+  case OpCode::Cos: {
+    auto f = std::cos(x);
+    jetUnary(a, shape, f, -std::sin(x), -f);
+    break;
+  }
+  case OpCode::Tan: {
+    auto f = std::tan(x);
+    auto c = std::cos(x);
+    jetUnary(a, shape, f, 1.0 / (c * c), 2.0 * f / (c * c));
+    break;
+  }
+  case OpCode::Exp: {
+    auto f = std::exp(x);
+    jetUnary(a, shape, f, f, f);
+    break;
+  }
+  case OpCode::Ln:
+    jetUnary(a, shape, std::log(x), 1.0 / x, -1.0 / (x * x));
+    break;
+  case OpCode::Log10:
+    jetUnary(a, shape, std::log10(x), M_LOG10E / x, -M_LOG10E / (x * x));
+    break;
+  case OpCode::Round:
+    jetUnary(a, shape, std::round(x), 1.0, 0.0);
+    break;
+  case OpCode::Floor:
+    jetUnary(a, shape, std::floor(x), 1.0, 0.0);
+    break;
+  case OpCode::Ceil:
+    jetUnary(a, shape, std::ceil(x), 1.0, 0.0);
+    break;
+  default:
+    assert(false);
+  }
+}
+
+void jetBinaryOp(OpCode op, double *a, const double *b, const JetShape &shape,
+                 size_t width) {
+  double u = a[0], v = b[0];
+  switch (op) {
+  case OpCode::Sum:
+    jetBinary(a, b, shape, u + v, 1.0, 1.0, 0.0, 0.0, 0.0);
+    break;
+  case OpCode::Prod:
+    jetBinary(a, b, shape, u * v, v, u, 0.0, 1.0, 0.0);
+    break;
+  case OpCode::Pow: {
+    // d/dx u^v = v u^(v-1) u' + u^v log(u) v'
+    // (the terms with log(u) are omitted if v is constant, such that negative
+    // bases can be used; as for polynomials, the derivatives of u^v that
+    // vanish for an integer v are zero, also at u = 0)
+    auto f = std::pow(u, v);
+    auto fa = (v == 0) ? 0.0 : v * std::pow(u, v - 1.0);
+    auto faa = (v == 0 || v == 1) ? 0.0 : v * (v - 1.0) * std::pow(u, v - 2.0);
+    if (jetIsConstant(b, width))
+      jetBinary(a, b, shape, f, fa, 0.0, faa, 0.0, 0.0);
+    else {
+      auto logu = std::log(u);
+      jetBinary(a, b, shape, f, fa, f * logu, faa,
+                std::pow(u, v - 1.0) * (1.0 + v * logu), f * logu * logu);
+    }
+    break;
+  }
+  case OpCode::Min:
+    // same choice as std::min and std::max
+    if (v < u)
+      std::copy(b, b + width, a);
+    break;
+  case OpCode::Max:
+    if (u < v)
+      std::copy(b, b + width, a);
+    break;
+  case OpCode::LessEqThan:
+    jetBinary(a, b, shape, (u <= v) ? 1.0 : 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+    break;
+  case OpCode::GreaterThan:
+    jetBinary(a, b, shape, (u > v) ? 1.0 : 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+    break;
+  default:
+    assert(false);
+  }
+}
+
+} // namespace
+
+double AdvFunc::evaluateWithGradient(CompiledExpr expr, const double *values,
+                                     size_t num_values, double *gradient) {
+  assert(_advValid && expr.valid());
+  bindJets(values, num_values, false);
+  double *result = _jsp;
+  runJet(expr.entry);
+  std::copy(result + 1, result + 1 + _jet_dim, gradient);
+  return result[0];
+}
+
+double AdvFunc::evaluateWithHessian(CompiledExpr expr, const double *values,
+                                    size_t num_values, double *gradient,
+                                    double *hessian) {
+  assert(_advValid && expr.valid());
+  bindJets(values, num_values, true);
+  double *result = _jsp;
+  runJet(expr.entry);
+  std::copy(result + 1, result + 1 + _jet_dim, gradient);
+  // (the gradient is followed by the Hessian)
+  std::copy(result + 1 + _jet_dim, result + _jet_width, hessian);
+  return result[0];
+}
+
+void AdvFunc::bindJets(const double *values, size_t num_values, bool hessian) {
+  bindVariables(values, num_values);
+  // (the scalar executor is used for the membership tests of case
+  // distinctions)
+  _jet_dim = num_values;
+  _jet_hessian = hessian;
+  _jet_width = 1 + _jet_dim + (hessian ? _jet_dim * _jet_dim : 0);
+  _jet_stack.resize(_model->program.stackSize * _jet_width);
+  _jet_memo.resize(_model->program.references.size() * _jet_width);
+  _jet_memo_valid.assign(_model->program.references.size(), 0);
+  _jsp = _jet_stack.data();
+}
+
+void AdvFunc::runJet(uint32_t pc) {
+  // Execute the routine with entry point pc on jets. The resulting jet is
+  // stored at _jsp.
+  const Instruction *code = _model->program.code.data();
+  const double *constants = _model->program.constants.data();
+  const auto W = _jet_width;
+  const auto dim = _jet_dim;
+  const JetShape shape{_jet_dim, _jet_hessian};
+  double *base = _jsp;
+  double *sp = base;
+  // sp points to the first free jet
+
+  for (;;) {
+    const Instruction ins = code[pc++];
+    switch (ins.op) {
+    case OpCode::Const:
+      std::fill(sp, sp + W, 0.0);
+      sp[0] = constants[ins.arg];
+      sp += W;
+      break;
+    case OpCode::Variable:
+      std::fill(sp, sp + W, 0.0);
+      sp[0] = loadVariable(ins.arg);
+      if (ins.arg < dim)
+        sp[1 + ins.arg] = 1.0;
+      sp += W;
+      break;
+    case OpCode::Call: {
+      double *memo = _jet_memo.data() + ins.arg * W;
+      if (!_jet_memo_valid[ins.arg]) {
+        _jsp = sp;
+        runJet(_model->program.references[ins.arg]);
+        std::copy(sp, sp + W, memo);
+        _jet_memo_valid[ins.arg] = 1;
+      } else
+        std::copy(memo, memo + W, sp);
+      sp += W;
+      break;
+    }
+    case OpCode::Throw:
+      throwDiagnostic(ins.arg);
+
+    case OpCode::Negate:
+    case OpCode::Abs:
+    case OpCode::Sign:
+    case OpCode::MultInv:
+    case OpCode::Square:
+    case OpCode::Sqrt:
+    case OpCode::Sin:
+    case OpCode::Cos:
+    case OpCode::Tan:
+    case OpCode::Exp:
+    case OpCode::Ln:
+    case OpCode::Log10:
+    case OpCode::Round:
+    case OpCode::Floor:
+    case OpCode::Ceil:
+      jetUnaryOp(ins.op, sp - W, shape);
+      break;
+
+    case OpCode::Sum:
+    case OpCode::Prod:
+    case OpCode::Pow:
+    case OpCode::Min:
+    case OpCode::Max:
+    case OpCode::LessEqThan:
+    case OpCode::GreaterThan:
+      sp -= W;
+      jetBinaryOp(ins.op, sp - W, sp, shape, W);
+      break;
+
+    case OpCode::SumList:
+    case OpCode::ProdList: {
+      bool sum = (ins.op == OpCode::SumList);
+      if (ins.arg == 0) {
+        std::fill(sp, sp + W, 0.0);
+        sp[0] = sum ? 0.0 : 1.0;
+        sp += W;
+        break;
+      }
+      sp -= (ins.arg - 1) * W;
+      double *a = sp - W;
+      for (uint32_t k = 0; k + 1 < ins.arg; ++k) {
+        const double *b = sp + k * W;
+        if (sum)
+          jetBinary(a, b, shape, a[0] + b[0], 1.0, 1.0, 0.0, 0.0, 0.0);
+        else
+          jetBinary(a, b, shape, a[0] * b[0], b[0], a[0], 0.0, 1.0, 0.0);
+      }
+      break;
+    }
+
+    case OpCode::Polynomial:
+      evalPolynomialJet(_model->program.polynomials[ins.arg], sp);
+      sp += W;
+      break;
+
+    case OpCode::CaseDistinction: {
+      // determine the active case with the scalar executor, the evaluation
+      // point is stored at the bottom of its stack
+      const auto &casedist = _model->program.cases[ins.arg];
+      auto pointDim = casedist.variables.size();
+      double *point = _stack.data();
+      for (size_t i = 0; i < pointDim; ++i) {
+        if (casedist.isFixed(i)) {
+          point[i] = _model->program.constants[casedist.fixed[i]];
+          continue;
+        }
+        auto slot = casedist.variables[i];
+        if (!_var_bound[slot])
+          throw EvaluationError("Variable specified in CaseDistinction not "
+                                "found in VariableMap bound_vars.");
+        point[i] = _var_values[slot];
+      }
+
+      auto cases = casedist.sets.size();
+      size_t k = 0;
+      for (; k < cases; ++k) {
+        _sp = point + pointDim;
+        if (member(casedist.sets[k], point, pointDim))
+          break;
+      }
+      if (k == cases)
+        throw EvaluationError("Unhandled case in CaseDistinction");
+
+      _jsp = sp;
+      runJet(casedist.routines[k]);
+      sp += W;
+      break;
+    }
+
+    case OpCode::Return:
+      if (sp - W != base)
+        std::copy(sp - W, sp, base);
+      _jsp = base;
+      return;
+    }
+  }
+}
+
+void AdvFunc::evalPolynomialJet(const PolynomialData &poly, double *out) {
+  const auto dim = _jet_dim;
+  auto sz = poly.variables.size();
+
+  std::fill(out, out + _jet_width, 0.0);
+  double *g = out + 1;
+  double *H = g + dim;
+  _partials.resize(sz);
+  out[0] = evalPolynomial(poly, _partials.data());
+  for (size_t k = 0; k < sz; ++k)
+    if (poly.variables[k] < dim)
+      g[poly.variables[k]] += _partials[k];
+  if (!_jet_hessian)
+    return;
+
+  // second partial derivatives, from the table of powers that evalPolynomial
+  // has filled in: (d/dx)^n x^e = e (e-1) ... (e-n+1) x^(e-n)
+  const double *powers = _powers.data();
+  const uint32_t *index = poly.powerIndex.data();
+  const uint32_t *exps = poly.exponents.data();
+  for (uint32_t t = 0; t < poly.terms; ++t, exps += sz) {
+    double coeff = _model->program.constants[poly.firstCoeff + t];
+    for (size_t k = 0; k < sz; ++k) {
+      auto slotK = poly.variables[k];
+      if (slotK >= dim || exps[k] == 0)
+        continue;
+      for (size_t l = 0; l < sz; ++l) {
+        auto slotL = poly.variables[l];
+        if (slotL >= dim)
+          continue;
+        double partial = coeff;
+        for (size_t var = 0; var < sz && partial != 0; ++var) {
+          uint32_t e = exps[var];
+          uint32_t n = (var == k) + (var == l);
+          if (e < n) {
+            partial = 0;
+            break;
+          }
+          for (uint32_t i = 0; i < n; ++i)
+            partial *= e - i;
+          partial *= powers[index[var] + e - n];
+        }
+        H[slotK * dim + slotL] += partial;
+      }
+    }
+  }
+}
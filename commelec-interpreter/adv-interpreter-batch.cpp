@@ -0,0 +1,483 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <cmath>
+#include <algorithm>
+
+// Batch executor for compiled programs
+//
+// Instead of a stack of doubles, the batch executor operates on a stack of
+// blocks of BATCH_BLOCK doubles (one per point, "lanes"), so that every
+// instruction is dispatched once per block rather than once per point. The
+// arithmetic is expressed with Eigen arrays, which Eigen vectorizes.
+//
+// Case distinctions are evaluated by masking: for every case, we compute the
+// lanes that lie in its set (and not in the set of an earlier case), evaluate
+// the case's expression (only if some lane selected it), and blend the result
+// into the output block. The expression of a case is evaluated on all lanes,
+// but only the lanes it selected are active: a nested case distinction need
+// not cover the other lanes, and leaves their result at zero.
+//
+// The lanes may also have constants of their own: a Const instruction then
+// loads a block rather than broadcasting the constant. This evaluates a
+// parametric program (see AdvFunc::setAdv) for a whole fleet of
+// advertisements of the same structure, one advertisement per lane.
+
+using namespace msg;
+
+using Lanes = Eigen::Map<Eigen::ArrayXd, Eigen::Aligned>;
+using ConstLanes = Eigen::Map<const Eigen::ArrayXd>;
+
+void AdvFunc::evaluateBatch(CompiledExpr expr, const double *P,
+                            const double *Q, size_t n, double *out) {
+  const double *values[] = {P, Q};
+  // P and Q occupy slots P_SLOT and Q_SLOT
+  evaluateBatch(expr, values, 2, n, out);
+}
+
+void AdvFunc::evaluateBatch(CompiledExpr expr, const double *const *values,
+                            size_t num_values, size_t n, double *out) {
+  evaluateBatch(expr, values, num_values, nullptr, n, out);
+}
+
+void AdvFunc::evaluateBatch(CompiledExpr expr, const double *const *values,
+                            size_t num_values, const double *const *constants,
+                            size_t n, double *out) {
+  assert(_advValid && expr.valid());
+  for (size_t offset = 0; offset < n; offset += BATCH_BLOCK) {
+    auto len = std::min(BATCH_BLOCK, n - offset);
+    bindBatch(values, num_values, constants, offset, len);
+    double *result = _bsp;
+    runBlock(expr.entry);
+    std::copy(result, result + len, out + offset);
+  }
+}
+
+void AdvFunc::testMembershipBatch(CompiledSet set, const double *P,
+                                  const double *Q, size_t n, bool *out) {
+  testMembershipBatch(set, P, Q, nullptr, n, out);
+}
+
+void AdvFunc::testMembershipBatch(CompiledSet set, const double *P,
+                                  const double *Q,
+                                  const double *const *constants, size_t n,
+                                  bool *out) {
+  assert(_advValid && set.valid());
+  const double *values[] = {P, Q};
+  for (size_t offset = 0; offset < n; offset += BATCH_BLOCK) {
+    auto len = std::min(BATCH_BLOCK, n - offset);
+    bindBatch(values, 2, constants, offset, len);
+
+    // the point is stored in the first two blocks, the mask in the third
+    double *point = _bsp;
+    double *mask = point + 2 * BATCH_BLOCK;
+    std::copy(P + offset, P + offset + len, point);
+    std::copy(Q + offset, Q + offset + len, point + BATCH_BLOCK);
+    _bsp = mask + BATCH_BLOCK;
+    memberBlock(set.node, point, 2, mask);
+    for (size_t i = 0; i < len; ++i)
+      out[offset + i] = (mask[i] != 0);
+  }
+}
+
+void AdvFunc::bindBatch(const double *const *values, size_t num_values,
+                        const double *const *constants, size_t offset,
+                        size_t len) {
+  auto sz = _model->program.variables.size();
+  _batch_vars.resize(sz);
+  for (size_t slot = 0; slot < sz; ++slot)
+    _batch_vars[slot] =
+        (slot < num_values && values[slot]) ? values[slot] + offset : nullptr;
+  _batch_len = len;
+  _batch_offset = offset;
+  _batch_constants = constants;
+  _batch_active = nullptr;
+
+  // Upper bound on the number of blocks: on top of the stack usage of the
+  // scalar executor, a case distinction needs three more blocks (the mask of
+  // the pending lanes, the mask of the current case and its result) and one
+  // per coordinate of the point, every set three scratch blocks, and every
+  // polynomial one; finally three blocks for the point and mask of
+  // testMembershipBatch
+  auto blocks = _model->program.stackSize + 3 * _model->program.sets.size() +
+                _model->program.polynomials.size() + 3;
+  for (const auto &casedist : _model->program.cases)
+    blocks += 3 + casedist.variables.size();
+  _batch_stack.resize(blocks * BATCH_BLOCK);
+  _bsp = _batch_stack.data();
+  _batch_memo.resize(_model->program.references.size() * BATCH_BLOCK);
+  _batch_memo_valid.assign(_model->program.references.size(), 0);
+}
+
+void AdvFunc::runBlock(uint32_t pc) {
+  // Execute the routine with entry point pc on the current block of points.
+  // The result is stored in the block at _bsp.
+  const Instruction *code = _model->program.code.data();
+  const auto B = BATCH_BLOCK;
+  const auto len = _batch_len;
+  double *base = _bsp;
+  double *sp = base;
+  // sp points to the first free block
+
+  for (;;) {
+    const Instruction ins = code[pc++];
+    auto top = [&]() { return Lanes(sp - B, len); };
+    switch (ins.op) {
+    case OpCode::Const:
+      constantBlock(ins.arg, sp);
+      sp += B;
+      break;
+    case OpCode::Variable: {
+      auto values = _batch_vars[ins.arg];
+      if (!values)
+        throwUnknownVariable(ins.arg);
+      std::copy(values, values + len, sp);
+      sp += B;
+      break;
+    }
+    case OpCode::Call: {
+      // (all lanes are evaluated, also in case distinctions; but the result
+      // is only memoized if all lanes are active, as a nested case
+      // distinction leaves the inactive ones at zero)
+      double *memo = _batch_memo.data() + ins.arg * B;
+      if (!_batch_memo_valid[ins.arg]) {
+        _bsp = sp;
+        runBlock(_model->program.references[ins.arg]);
+        if (!_batch_active) {
+          std::copy(sp, sp + len, memo);
+          _batch_memo_valid[ins.arg] = 1;
+        }
+      } else
+        std::copy(memo, memo + len, sp);
+      sp += B;
+      break;
+    }
+    case OpCode::Throw:
+      throwDiagnostic(ins.arg);
+
+    case OpCode::Negate:
+      top() = -top();
+      break;
+    case OpCode::Abs:
+      top() = top().abs();
+      break;
+    case OpCode::Sign:
+      top() = top().unaryExpr([](double x) { return double(sgn(x)); });
+      break;
+    case OpCode::MultInv:
+      top() = top().inverse();
+      break;
+    case OpCode::Square:
+      top() = top().square();
+      break;
+    case OpCode::Sqrt:
+      top() = top().sqrt();
+      break;
+    case OpCode::Sin:
+      top() = top().sin();
+      break;
+    case OpCode::Cos:
+      top() = top().cos();
+      break;
+    case OpCode::Tan:
+      top() = top().unaryExpr([](double x) { return std::tan(x); });
+      break;
+    case OpCode::Exp:
+      top() = top().exp();
+      break;
+    case OpCode::Ln:
+      top() = top().log();
+      break;
+    case OpCode::Log10:
+      top() = top().unaryExpr([](double x) { return std::log10(x); });
+      break;
+    case OpCode::Round:
+      top() = top().unaryExpr([](double x) { return std::round(x); });
+      break;
+    case OpCode::Floor:
+      top() = top().unaryExpr([](double x) { return std::floor(x); });
+      break;
+    case OpCode::Ceil:
+      top() = top().unaryExpr([](double x) { return std::ceil(x); });
+      break;
+
+    // for the binary operations, a = (the new) top, b = the popped block
+    case OpCode::Sum:
+      sp -= B;
+      Lanes(sp - B, len) += Lanes(sp, len);
+      break;
+    case OpCode::Prod:
+      sp -= B;
+      Lanes(sp - B, len) *= Lanes(sp, len);
+      break;
+    case OpCode::Pow: {
+      sp -= B;
+      double *a = sp - B, *b = sp;
+      for (size_t i = 0; i < len; ++i)
+        a[i] = std::pow(a[i], b[i]);
+      break;
+    }
+    case OpCode::Min: {
+      // plain loops, to get the same NaN semantics as std::min and std::max
+      sp -= B;
+      double *a = sp - B, *b = sp;
+      for (size_t i = 0; i < len; ++i)
+        a[i] = std::min(a[i], b[i]);
+      break;
+    }
+    case OpCode::Max: {
+      sp -= B;
+      double *a = sp - B, *b = sp;
+      for (size_t i = 0; i < len; ++i)
+        a[i] = std::max(a[i], b[i]);
+      break;
+    }
+    case OpCode::LessEqThan: {
+      sp -= B;
+      double *a = sp - B, *b = sp;
+      for (size_t i = 0; i < len; ++i)
+        a[i] = (a[i] <= b[i]) ? 1.0 : 0.0;
+      break;
+    }
+    case OpCode::GreaterThan: {
+      sp -= B;
+      double *a = sp - B, *b = sp;
+      for (size_t i = 0; i < len; ++i)
+        a[i] = (a[i] > b[i]) ? 1.0 : 0.0;
+      break;
+    }
+
+    case OpCode::SumList:
+    case OpCode::ProdList: {
+      bool sum = (ins.op == OpCode::SumList);
+      if (ins.arg == 0) {
+        Lanes(sp, len).setConstant(sum ? 0.0 : 1.0);
+        sp += B;
+        break;
+      }
+      sp -= (ins.arg - 1) * B;
+      Lanes accum(sp - B, len);
+      for (uint32_t k = 0; k + 1 < ins.arg; ++k) {
+        if (sum)
+          accum += Lanes(sp + k * B, len);
+        else
+          accum *= Lanes(sp + k * B, len);
+      }
+      break;
+    }
+
+    case OpCode::Polynomial:
+      evalPolynomialBlock(_model->program.polynomials[ins.arg], sp);
+      sp += B;
+      break;
+
+    case OpCode::CaseDistinction: {
+      // layout: result, pending lanes, point (dim blocks), mask of the case
+      const auto &casedist = _model->program.cases[ins.arg];
+      auto dim = casedist.variables.size();
+      double *result = sp;
+      double *pending = result + B;
+      double *point = pending + B;
+      double *mask = point + dim * B;
+      double *value = mask + B;
+
+      for (size_t i = 0; i < dim; ++i) {
+        if (casedist.isFixed(i)) {
+          constantBlock(casedist.fixed[i], point + i * B);
+          continue;
+        }
+        auto values = _batch_vars[casedist.variables[i]];
+        if (!values)
+          throw EvaluationError("Variable specified in CaseDistinction not "
+                                "found in VariableMap bound_vars.");
+        std::copy(values, values + len, point + i * B);
+      }
+      Lanes(result, len).setZero();
+      size_t numPending = len;
+      if (_batch_active) {
+        numPending = 0;
+        for (size_t i = 0; i < len; ++i) {
+          pending[i] = _batch_active[i];
+          numPending += (pending[i] != 0);
+        }
+      } else
+        Lanes(pending, len).setOnes();
+
+      auto cases = casedist.sets.size();
+      for (size_t k = 0; k < cases && numPending > 0; ++k) {
+        _bsp = value;
+        memberBlock(casedist.sets[k], point, dim, mask);
+        bool selected = false;
+        for (size_t i = 0; i < len; ++i) {
+          mask[i] = (pending[i] != 0 && mask[i] != 0) ? 1.0 : 0.0;
+          selected = selected || (mask[i] != 0);
+        }
+        if (!selected)
+          continue;
+
+        auto active = _batch_active;
+        _batch_active = mask;
+        _bsp = value;
+        runBlock(casedist.routines[k]);
+        _batch_active = active;
+        for (size_t i = 0; i < len; ++i) {
+          if (mask[i] != 0) {
+            result[i] = value[i];
+            pending[i] = 0;
+            --numPending;
+          }
+        }
+      }
+      if (numPending > 0)
+        throw EvaluationError("Unhandled case in CaseDistinction");
+
+      sp += B;
+      break;
+    }
+
+    case OpCode::Return:
+      if (sp - B != base)
+        std::copy(sp - B, sp - B + len, base);
+      _bsp = base;
+      return;
+    }
+  }
+}
+
+void AdvFunc::constantBlock(uint32_t index, double *out) const {
+  const double *lanes = _batch_constants ? _batch_constants[index] : nullptr;
+  if (lanes)
+    std::copy(lanes + _batch_offset, lanes + _batch_offset + _batch_len, out);
+  else
+    Lanes(out, _batch_len).setConstant(_model->program.constants[index]);
+}
+
+void AdvFunc::evalPolynomialBlock(const PolynomialData &poly, double *out) {
+  const auto len = _batch_len;
+  auto sz = poly.variables.size();
+  const uint32_t *exps = poly.exponents.data();
+
+  Lanes result(out, len);
+  Lanes monom(out + BATCH_BLOCK, len);
+  result.setZero();
+  for (uint32_t t = 0; t < poly.terms; ++t, exps += sz) {
+    constantBlock(poly.firstCoeff + t, monom.data());
+    for (size_t var = 0; var < sz; ++var) {
+      auto rem = exps[var];
+      if (rem == 0)
+        continue;
+      auto values = _batch_vars[poly.variables[var]];
+      if (!values)
+        throwUnknownVariable(poly.variables[var]);
+      ConstLanes x(values, len);
+      for (uint32_t k = 0; k < rem; ++k)
+        monom *= x;
+    }
+    result += monom;
+  }
+}
+
+void AdvFunc::memberBlock(uint32_t index, const double *point, size_t dim,
+                          double *mask) {
+  // Sets mask[i] to 1.0 if the i-th point (the coordinates of which are stored
+  // in the blocks at point, point + BATCH_BLOCK, ...) lies in the set, and to
+  // 0.0 otherwise. Unlike member(), the expressions of all children of an
+  // intersection are evaluated (unless no lane is left).
+  const auto &set = _model->program.sets[index];
+  if (set.error >= 0)
+    throwDiagnostic(set.error);
+
+  const auto B = BATCH_BLOCK;
+  const auto len = _batch_len;
+  double *base = _bsp;
+  double *t0 = base, *t1 = base + B, *t2 = base + 2 * B;
+  // scratch blocks, routines store their result in the block at _bsp
+  Lanes m(mask, len);
+
+  switch (set.type) {
+  case SetExpr::SINGLETON: {
+    checkDimension(set.exprs.size(), dim);
+    // same criterion as Eigen's isApprox (see member())
+    Lanes diff(t0, len), normPoint(t1, len), normSingleton(t2, len);
+    diff.setZero();
+    normPoint.setZero();
+    normSingleton.setZero();
+    for (size_t i = 0; i < dim; ++i) {
+      _bsp = base + 3 * B;
+      runBlock(set.exprs[i]);
+      Lanes x(_bsp, len);
+      ConstLanes p(point + i * B, len);
+      diff += (p - x).square();
+      normPoint += p.square();
+      normSingleton += x.square();
+    }
+    double prec = Eigen::NumTraits<double>::dummy_precision();
+    m = (diff <= prec * prec * normPoint.min(normSingleton)).cast<double>();
+    break;
+  }
+  case SetExpr::BALL: {
+    checkDimension(set.exprs.size() - 1, dim);
+    Lanes dist(t0, len);
+    dist.setZero();
+    _bsp = t1;
+    for (size_t i = 0; i < dim; ++i) {
+      runBlock(set.exprs[i]);
+      dist += (Lanes(t1, len) - ConstLanes(point + i * B, len)).square();
+    }
+    runBlock(set.exprs[dim]);
+    m = (dist <= Lanes(t1, len).square()).cast<double>();
+    break;
+  }
+  case SetExpr::RECTANGLE: {
+    checkDimension(set.exprs.size() / 2, dim);
+    m.setOnes();
+    for (size_t i = 0; i < dim; ++i) {
+      _bsp = t0;
+      runBlock(set.exprs[2 * i]);
+      _bsp = t1;
+      runBlock(set.exprs[2 * i + 1]);
+      const double *p = point + i * B;
+      for (size_t j = 0; j < len; ++j) {
+        auto minVal = std::min(t0[j], t1[j]);
+        auto maxVal = std::max(t0[j], t1[j]);
+        if ((p[j] < minVal) || (p[j] > maxVal))
+          mask[j] = 0;
+      }
+    }
+    break;
+  }
+  case SetExpr::CONVEX_POLYTOPE: {
+    checkDimension(set.cols, dim);
+    const uint32_t *b = set.exprs.data() + set.rows * set.cols;
+    Lanes dot(t0, len);
+    m.setOnes();
+    _bsp = t1;
+    for (uint32_t row = 0; row < set.rows; ++row) {
+      dot.setZero();
+      for (uint32_t col = 0; col < set.cols; ++col) {
+        runBlock(set.exprs[row * set.cols + col]);
+        dot += Lanes(t1, len) * ConstLanes(point + col * B, len);
+      }
+      runBlock(b[row]);
+      for (size_t j = 0; j < len; ++j)
+        if (!(t0[j] <= t1[j]))
+          mask[j] = 0;
+    }
+    break;
+  }
+  case SetExpr::INTERSECTION:
+    m.setOnes();
+    for (auto child : set.children) {
+      _bsp = t1;
+      memberBlock(child, point, dim, t0);
+      m *= Lanes(t0, len);
+      if (m.maxCoeff() == 0)
+        break;
+    }
+    break;
+  case SetExpr::REFERENCE:
+    memberBlock(set.children[0], point, dim, mask);
+    break;
+  default:
+    throw WhichError(int(set.type), "AdvFunc::memberBlock");
+  }
+  _bsp = base;
+}
@@ -0,0 +1,69 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <commelec-interpreter/boundingbox-convexpolygon.hpp>
+
+// Constant polytopes
+//
+// The PQ profiles of most resources are fixed polygons, yet every membership
+// test, projection and hull would evaluate their coefficients again (and
+// check the shape of the matrix). When the advertisement is compiled, a
+// polytope whose coefficients all compile to constants is stored as Eigen
+// matrices instead, keyed by the address of its SetExpr in the message (see
+// AdvFunc::address).
+// In the plane, its vertices are enumerated as well (see
+// convexPolygonVertices); the hull of a bounded polygon is then the hull of
+// its vertices. In other dimensions, the hull is computed once by linear
+// programming.
+// A parametric model also records its polytopes, which AdvFunc::rebind
+// caches again with the literals of the new advertisement.
+
+using namespace msg;
+
+bool AdvFunc::constantRoutine(uint32_t entry, double &value) const {
+  if (_model->program.code[entry].op != OpCode::Const ||
+      _model->program.code[entry + 1].op != OpCode::Return)
+    return false;
+  value = _model->program.constants[_model->program.code[entry].arg];
+  return true;
+}
+
+void AdvFunc::cachePolytope(const void *set, const SetNode &node) {
+  PolytopeCache cache;
+  cache.A.resize(node.rows, node.cols);
+  cache.b.resize(node.rows);
+  cache.bounded = false;
+
+  size_t k = 0;
+  for (uint32_t i = 0; i < node.rows; ++i)
+    for (uint32_t j = 0; j < node.cols; ++j)
+      if (!constantRoutine(node.exprs[k++], cache.A(i, j)))
+        return;
+  for (uint32_t i = 0; i < node.rows; ++i)
+    if (!constantRoutine(node.exprs[k++], cache.b(i)))
+      return;
+
+  if (node.cols == 2) {
+    cache.bounded = convexPolygonVertices(cache.A, cache.b, cache.vertices) ==
+                    PolygonStatus::Bounded;
+    if (cache.bounded) {
+      cache.hull = Eigen::AlignedBoxXd(2);
+      for (const auto &x : cache.vertices)
+        cache.hull.extend(x);
+    }
+  } else {
+    try {
+      cache.hull = boundingBoxLP(cache.A, cache.b);
+      cache.bounded = true;
+    } catch (const std::runtime_error &) {
+      // (an unbounded or empty polytope)
+    }
+  }
+
+  _model->constantPolytopes[set] = std::move(cache);
+}
+
+const PolytopeCache *AdvFunc::cachedPolytope(SetExpr::Reader set) const {
+  if (_model->constantPolytopes.empty())
+    return nullptr;
+  auto cached = _model->constantPolytopes.find(address(set));
+  return (cached != _model->constantPolytopes.end()) ? &cached->second : nullptr;
+}
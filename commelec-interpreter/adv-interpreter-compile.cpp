@@ -0,0 +1,642 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <commelec-interpreter/adv-structure.hpp>
+#include <commelec-api/mathfunctions.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <tuple>
+
+using namespace msg;
+
+struct RoutineBuilder {
+  // collects the instructions of a routine, and keeps track of the stack depth
+  std::vector<Instruction> code;
+  int depth = 0;
+  int maxDepth = 0;
+  std::vector<size_t> operands;
+  // for every value on the stack: the index of the first instruction of the
+  // code that computes it
+
+  void emit(OpCode op, uint32_t arg, int stackEffect, int scratch = 0) {
+    // stackEffect: the net number of values pushed by the instruction
+    // scratch:     the number of values that the instruction temporarily
+    //              pushes on top of the current stack during its execution
+    size_t popped = (op == OpCode::Return) ? 1 : 1 - stackEffect;
+    // (all instructions but Return push one value)
+    size_t start = popped ? operands[operands.size() - popped] : code.size();
+    operands.resize(operands.size() - popped);
+    if (op != OpCode::Return)
+      operands.push_back(start);
+
+    code.push_back(Instruction{op, arg});
+    maxDepth = std::max(maxDepth, depth + scratch);
+    depth += stackEffect;
+    maxDepth = std::max(maxDepth, depth);
+  }
+
+  bool isConstant(size_t k, const std::vector<double> &constants,
+                  double &value) const {
+    // whether the k-th value from the top of the stack is computed by a single
+    // Const instruction
+    size_t i = operands.size() - 1 - k;
+    size_t end = (k == 0) ? code.size() : operands[i + 1];
+    if (end != operands[i] + 1 || code[operands[i]].op != OpCode::Const)
+      return false;
+    value = constants[code[operands[i]].arg];
+    return true;
+  }
+
+  void drop(size_t k) {
+    // removes the code of the k-th value from the top of the stack
+    size_t i = operands.size() - 1 - k;
+    size_t start = operands[i];
+    size_t end = (k == 0) ? code.size() : operands[i + 1];
+    code.erase(code.begin() + start, code.begin() + end);
+    operands.erase(operands.begin() + i);
+    for (; i < operands.size(); ++i)
+      operands[i] -= end - start;
+    --depth;
+  }
+};
+
+double foldConstant(OpCode op, const double *args, uint32_t n) {
+  // the same arithmetic as AdvFunc::run
+  switch (op) {
+  case OpCode::Negate:
+    return -args[0];
+  case OpCode::Abs:
+    return std::abs(args[0]);
+  case OpCode::Sign:
+    return sgn(args[0]);
+  case OpCode::MultInv:
+    return 1.0 / args[0];
+  case OpCode::Square:
+    return args[0] * args[0];
+  case OpCode::Sqrt:
+    return std::sqrt(args[0]);
+  case OpCode::Sin:
+    return std::sin(args[0]);
+  case OpCode::Cos:
+    return std::cos(args[0]);
+  case OpCode::Tan:
+    return std::tan(args[0]);
+  case OpCode::Exp:
+    return std::exp(args[0]);
+  case OpCode::Ln:
+    return std::log(args[0]);
+  case OpCode::Log10:
+    return std::log10(args[0]);
+  case OpCode::Round:
+    return std::round(args[0]);
+  case OpCode::Floor:
+    return std::floor(args[0]);
+  case OpCode::Ceil:
+    return std::ceil(args[0]);
+  case OpCode::Sum:
+    return args[0] + args[1];
+  case OpCode::Prod:
+    return args[0] * args[1];
+  case OpCode::Pow:
+    return std::pow(args[0], args[1]);
+  case OpCode::Min:
+    return std::min(args[0], args[1]);
+  case OpCode::Max:
+    return std::max(args[0], args[1]);
+  case OpCode::LessEqThan:
+    return (args[0] <= args[1]) ? 1.0 : 0.0;
+  case OpCode::GreaterThan:
+    return (args[0] > args[1]) ? 1.0 : 0.0;
+  case OpCode::SumList: {
+    double accum = 0;
+    for (uint32_t i = 0; i < n; ++i)
+      accum += args[i];
+    return accum;
+  }
+  case OpCode::ProdList: {
+    double mult = 1.0;
+    for (uint32_t i = 0; i < n; ++i)
+      mult *= args[i];
+    return mult;
+  }
+  default:
+    assert(false);
+    return 0;
+  }
+}
+
+template <typename StructType>
+std::string whichErrorMessage(const char *function, StructType whichable) {
+  auto type = int(whichable.which());
+  boost::format msg;
+  KJ_IF_MAYBE(fieldname, getUnionFieldName(whichable)) {
+    msg = boost::format("%1% [.which()=%2%,%3%]") % function % type % fieldname;
+  }
+  else
+    msg = boost::format("%1% [.which()=%2%]") % function % type;
+  return msg.str();
+}
+
+OpCode unaryOpCode(UnaryOperation::Operation::Which op) {
+  switch (op) {
+  case UnaryOperation::Operation::NEGATE:
+    return OpCode::Negate;
+  case UnaryOperation::Operation::ABS:
+    return OpCode::Abs;
+  case UnaryOperation::Operation::SIGN:
+    return OpCode::Sign;
+  case UnaryOperation::Operation::MULT_INV:
+    return OpCode::MultInv;
+  case UnaryOperation::Operation::SQUARE:
+    return OpCode::Square;
+  case UnaryOperation::Operation::SQRT:
+    return OpCode::Sqrt;
+  case UnaryOperation::Operation::SIN:
+    return OpCode::Sin;
+  case UnaryOperation::Operation::COS:
+    return OpCode::Cos;
+  case UnaryOperation::Operation::TAN:
+    return OpCode::Tan;
+  case UnaryOperation::Operation::EXP:
+    return OpCode::Exp;
+  case UnaryOperation::Operation::LN:
+    return OpCode::Ln;
+  case UnaryOperation::Operation::LOG10:
+    return OpCode::Log10;
+  case UnaryOperation::Operation::ROUND:
+    return OpCode::Round;
+  case UnaryOperation::Operation::FLOOR:
+    return OpCode::Floor;
+  case UnaryOperation::Operation::CEIL:
+    return OpCode::Ceil;
+  }
+  return OpCode::Throw;
+}
+
+OpCode binaryOpCode(BinaryOperation::Operation::Which op) {
+  switch (op) {
+  case BinaryOperation::Operation::SUM:
+    return OpCode::Sum;
+  case BinaryOperation::Operation::PROD:
+    return OpCode::Prod;
+  case BinaryOperation::Operation::POW:
+    return OpCode::Pow;
+  case BinaryOperation::Operation::MIN:
+    return OpCode::Min;
+  case BinaryOperation::Operation::MAX:
+    return OpCode::Max;
+  case BinaryOperation::Operation::LESS_EQ_THAN:
+    return OpCode::LessEqThan;
+  case BinaryOperation::Operation::GREATER_THAN:
+    return OpCode::GreaterThan;
+  }
+  return OpCode::Throw;
+}
+
+void AdvFunc::compileAdvertisement() {
+  _model->program.clear();
+  _model->specialized = false;
+  _model->costFunction = CompiledExpr();
+  _model->pqProfile = CompiledSet();
+  _model->beliefFunction = CompiledSet();
+  _model->bindings.clear();
+
+  variableSlot("P");
+  variableSlot("Q");
+  // reserve slots P_SLOT and Q_SLOT
+
+  // only the sets of the advertisement itself are cached (sets of other
+  // messages that are compiled later may not outlive this object)
+  _model->constantPolytopes.clear();
+  _model->polytopes.clear();
+  std::unordered_map<const void *, uint32_t> literals, polytopes;
+  if (_model->parametric) {
+    auto structure = structureOf(_model->adv);
+    for (size_t i = 0; i < structure.sources.size(); ++i)
+      literals[structure.sources[i]] = i;
+    for (size_t i = 0; i < structure.polytopes.size(); ++i)
+      polytopes[structure.polytopes[i]] = i;
+    _literals = &literals;
+    _polytopes = &polytopes;
+  }
+  _caching = true;
+  try {
+    if (_model->adv.hasCostFunction())
+      _model->costFunction = compile(_model->adv.getCostFunction());
+    if (_model->adv.hasPQProfile())
+      _model->pqProfile = compile(_model->adv.getPQProfile());
+    if (_model->adv.hasBeliefFunction())
+      _model->beliefFunction = compile(_model->adv.getBeliefFunction());
+  } catch (...) {
+    _caching = false;
+    _literals = nullptr;
+    _polytopes = nullptr;
+    throw;
+  }
+  _caching = false;
+  _literals = nullptr;
+  _polytopes = nullptr;
+}
+
+CompiledExpr AdvFunc::compile(RealExpr::Reader expr) {
+  assert(_advValid);
+  unshare();
+  CompiledExpr result;
+  result.entry = compileRoutine(expr, 0);
+  return result;
+}
+
+CompiledSet AdvFunc::compile(SetExpr::Reader set) {
+  assert(_advValid);
+  unshare();
+  CompiledSet result;
+  result.node = compileSet(set, 0);
+  return result;
+}
+
+uint32_t AdvFunc::compileRoutine(RealExpr::Reader expr, int depth) {
+  RoutineBuilder routine;
+  compileExpr(expr, routine, depth);
+  routine.emit(OpCode::Return, 0, -1);
+
+  // nested routines (of references and case distinctions) have been appended
+  // to the program in the meantime, so we append this routine only now
+  uint32_t entry = _model->program.code.size();
+  _model->program.code.insert(_model->program.code.end(), routine.code.begin(),
+                       routine.code.end());
+  _model->program.stackSize += routine.maxDepth;
+  return entry;
+}
+
+void AdvFunc::compileExpr(RealExpr::Reader expr, RoutineBuilder &routine,
+                          int depth) {
+  if (++depth > MAX_NESTING_DEPTH) {
+    throw EvaluationError("max nesting depth reached");
+  }
+
+  switch (expr.which()) {
+  case RealExpr::REAL:
+    emitConstant(expr.getReal(), routine);
+    bindLiteral(address(expr));
+    return;
+  case RealExpr::VARIABLE:
+    if (_specialization) {
+      double value;
+      if (specializedValue(expr.getVariable(), value)) {
+        emitConstant(value, routine);
+        return;
+      }
+    }
+    routine.emit(OpCode::Variable, variableSlot(expr.getVariable()), 1);
+    return;
+  case RealExpr::REFERENCE:
+    compileRef(expr.getReference(), routine, depth);
+    return;
+  case RealExpr::UNARY_OPERATION: {
+    auto op = expr.getUnaryOperation();
+    compileExpr(op.getArg(), routine, depth);
+    auto opcode = unaryOpCode(op.getOperation().which());
+    if (opcode == OpCode::Throw)
+      routine.emit(opcode, compileDiagnostic(Diagnostic::Kind::WhichError,
+                                             "AdvFunc::compileExpr: unknown "
+                                             "unary operation"),
+                   0);
+    else
+      emitOperation(opcode, 1, routine);
+    return;
+  }
+  case RealExpr::BINARY_OPERATION: {
+    auto op = expr.getBinaryOperation();
+    compileExpr(op.getArgA(), routine, depth);
+    compileExpr(op.getArgB(), routine, depth);
+    auto opcode = binaryOpCode(op.getOperation().which());
+    if (opcode == OpCode::Throw)
+      routine.emit(opcode, compileDiagnostic(Diagnostic::Kind::WhichError,
+                                             "AdvFunc::compileExpr: unknown "
+                                             "binary operation"),
+                   -1);
+    else
+      emitOperation(opcode, 2, routine);
+    return;
+  }
+  case RealExpr::LIST_OPERATION: {
+    auto op = expr.getListOperation();
+    auto args = op.getArgs();
+    for (auto arg : args)
+      compileExpr(arg, routine, depth);
+    int n = args.size();
+    switch (op.getOperation().which()) {
+    case ListOperation::Operation::SUM:
+      emitOperation(OpCode::SumList, n, routine);
+      return;
+    case ListOperation::Operation::PROD:
+      emitOperation(OpCode::ProdList, n, routine);
+      return;
+    }
+    routine.emit(OpCode::Throw,
+                 compileDiagnostic(Diagnostic::Kind::WhichError,
+                                   "AdvFunc::compileExpr: unknown list "
+                                   "operation"),
+                 1 - n);
+    return;
+  }
+  case RealExpr::POLYNOMIAL: {
+    auto poly = expr.getPolynomial();
+    int d = poly.getMaxVarDegree() + 1;
+
+    PolynomialData data;
+    for (auto var : poly.getVariables())
+      data.variables.push_back(variableSlot(var));
+    auto sz = data.variables.size();
+    std::vector<uint32_t> maxExponent(sz, 0);
+    data.firstCoeff = _model->program.constants.size();
+    for (auto coeff : poly.getCoefficients()) {
+      // convert offset value into sequence of powers of the monomial
+      uint32_t offset = coeff.getOffset();
+      for (size_t var = 0; var < sz; ++var) {
+        uint32_t rem = offset % d;
+        offset /= d;
+        data.exponents.push_back(rem);
+        maxExponent[var] = std::max(maxExponent[var], rem);
+      }
+      _model->program.constants.push_back(coeff.getValue());
+      bindLiteral(address(coeff));
+      ++data.terms;
+    }
+    data.powerIndex.push_back(0);
+    for (size_t var = 0; var < sz; ++var)
+      data.powerIndex.push_back(data.powerIndex.back() + maxExponent[var] + 1);
+    if (_specialization && specializePolynomial(data, routine))
+      return;
+    _model->program.polynomials.push_back(std::move(data));
+    routine.emit(OpCode::Polynomial, _model->program.polynomials.size() - 1, 1);
+    return;
+  }
+  case RealExpr::CASE_DISTINCTION: {
+    auto casedist = expr.getCaseDistinction();
+    if (_specialization) {
+      compileSpecializedCases(casedist, routine, depth);
+      return;
+    }
+    CaseDistinctionData data;
+    for (auto var : casedist.getVariables())
+      data.variables.push_back(variableSlot(var));
+    for (auto re_case : casedist.getCases()) {
+      data.sets.push_back(compileSet(re_case.getSet(), depth));
+      data.routines.push_back(compileRoutine(re_case.getExpression(), depth));
+    }
+    int dim = data.variables.size();
+    _model->program.cases.push_back(std::move(data));
+    routine.emit(OpCode::CaseDistinction, _model->program.cases.size() - 1, 1, dim);
+    return;
+  }
+  default:
+    // unknown type of RealExpr; the error is raised when evaluating it
+    routine.emit(OpCode::Throw,
+                 compileDiagnostic(Diagnostic::Kind::WhichError,
+                                   whichErrorMessage("AdvFunc::compileExpr", expr),
+                                   "", int(expr.which())),
+                 1);
+  }
+}
+
+void AdvFunc::emitConstant(double value, RoutineBuilder &routine) {
+  _model->program.constants.push_back(value);
+  routine.emit(OpCode::Const, _model->program.constants.size() - 1, 1);
+}
+
+void AdvFunc::bindLiteral(const void *source) {
+  if (!_literals)
+    return;
+  auto literal = _literals->find(source);
+  if (literal != _literals->end())
+    _model->bindings.emplace_back(_model->program.constants.size() - 1,
+                                  literal->second);
+}
+
+void AdvFunc::emitOperation(OpCode op, uint32_t n, RoutineBuilder &routine) {
+  // Emits an arithmetic instruction on the n values on top of the stack,
+  // simplifying it where this does not change the result: an operation on
+  // constants is folded into a constant, and neutral operands (x*1, x+0) are
+  // dropped. (Not in a parametric model, whose constants may take other
+  // values.)
+  if (_model->parametric) {
+    routine.emit(op, (op == OpCode::SumList || op == OpCode::ProdList) ? n : 0,
+                 1 - int(n));
+    return;
+  }
+  std::vector<double> args(n);
+  bool allConstant = true;
+  for (uint32_t i = 0; i < n; ++i)
+    allConstant = routine.isConstant(n - 1 - i, _model->program.constants, args[i]) &&
+                  allConstant;
+  if (allConstant) {
+    for (uint32_t i = 0; i < n; ++i)
+      routine.drop(0);
+    emitConstant(foldConstant(op, args.data(), n), routine);
+    return;
+  }
+
+  double neutral;
+  switch (op) {
+  case OpCode::Sum:
+  case OpCode::SumList:
+    neutral = 0.0;
+    break;
+  case OpCode::Prod:
+  case OpCode::ProdList:
+    neutral = 1.0;
+    break;
+  default:
+    routine.emit(op, 0, 1 - int(n));
+    return;
+  }
+
+  uint32_t remaining = n;
+  for (uint32_t k = 0; k < n; ++k) {
+    double value;
+    uint32_t fromTop = n - 1 - k;
+    if (routine.isConstant(fromTop, _model->program.constants, value) &&
+        value == neutral && remaining > 1) {
+      routine.drop(fromTop);
+      --remaining;
+    }
+  }
+  if (remaining == 1)
+    return;
+  if (op == OpCode::Sum || op == OpCode::Prod)
+    routine.emit(op, 0, -1);
+  else
+    routine.emit(op, remaining, 1 - int(remaining));
+}
+
+void AdvFunc::compileRef(const kj::StringPtr ref, RoutineBuilder &routine,
+                         int depth) {
+  // A referenced RealExpr is compiled into a routine of its own (once), all
+  // references to it become calls to this routine.
+  std::string name(ref);
+  auto &realExprRefs = compiledRefs(ref, false);
+  // (in a specialized expression, the references that depend on the bound
+  // variables are compiled anew)
+
+  auto compiled = realExprRefs.find(name);
+  if (compiled != realExprRefs.end()) {
+    if (_model->program.references[compiled->second] == CompiledExpr::invalid)
+      // we are still compiling the referenced expression, hence the
+      // reference is part of a cycle
+      routine.emit(OpCode::Throw,
+                   compileDiagnostic(Diagnostic::Kind::EvaluationError,
+                                     "max nesting depth reached"),
+                   1);
+    else
+      emitCall(compiled->second, routine);
+    return;
+  }
+
+  auto referenced_real_expr = _model->realExprRefs.find(name);
+  if (referenced_real_expr == _model->realExprRefs.end()) {
+    // the message refers to some non-existing reference; like the
+    // tree-walking evaluator, we only throw if the reference is evaluated
+    auto msg = boost::format("AdvFunc::compileRef [ref=%1%]") % ref.cStr();
+    routine.emit(OpCode::Throw,
+                 compileDiagnostic(Diagnostic::Kind::UnknownReference,
+                                   str(msg), name),
+                 1);
+    return;
+  }
+
+  auto index = uint32_t(_model->program.references.size());
+  _model->program.references.push_back(uint32_t(CompiledExpr::invalid));
+  realExprRefs[name] = index;
+  auto entry = compileRoutine(referenced_real_expr->second, depth);
+  _model->program.references[index] = entry;
+  emitCall(index, routine);
+}
+
+void AdvFunc::emitCall(uint32_t reference, RoutineBuilder &routine) {
+  // a reference to a constant is replaced by the constant itself
+  auto entry = _model->program.references[reference];
+  if (_model->program.code[entry].op == OpCode::Const &&
+      _model->program.code[entry + 1].op == OpCode::Return)
+    routine.emit(OpCode::Const, _model->program.code[entry].arg, 1);
+  else
+    routine.emit(OpCode::Call, reference, 1);
+}
+
+uint32_t AdvFunc::compileSet(SetExpr::Reader set, int depth) {
+  if (++depth > MAX_NESTING_DEPTH) {
+    throw EvaluationError("max nesting depth reached");
+  }
+
+  SetNode node;
+  node.type = set.which();
+
+  switch (node.type) {
+  case SetExpr::SINGLETON:
+    for (auto expr : set.getSingleton())
+      node.exprs.push_back(compileRoutine(expr, depth));
+    break;
+  case SetExpr::BALL: {
+    auto ball = set.getBall();
+    for (auto expr : ball.getCenter())
+      node.exprs.push_back(compileRoutine(expr, depth));
+    node.exprs.push_back(compileRoutine(ball.getRadius(), depth));
+    break;
+  }
+  case SetExpr::RECTANGLE:
+    for (auto bpair : set.getRectangle()) {
+      node.exprs.push_back(compileRoutine(bpair.getBoundA(), depth));
+      node.exprs.push_back(compileRoutine(bpair.getBoundB(), depth));
+    }
+    break;
+  case SetExpr::CONVEX_POLYTOPE: {
+    auto poly = set.getConvexPolytope();
+    bool error;
+    int rows, cols;
+    std::tie(error, rows, cols) = check_capnp_matrix(poly.getA());
+    if (error || rows != static_cast<int>(poly.getB().size())) {
+      node.error = compileDiagnostic(Diagnostic::Kind::EvaluationError,
+                                     "AdvFunc::compileSet: convex polytope "
+                                     "incorrectly specified");
+      break;
+    }
+    node.rows = rows;
+    node.cols = cols;
+    for (auto row : poly.getA())
+      for (auto expr : row)
+        node.exprs.push_back(compileRoutine(expr, depth));
+    for (auto expr : poly.getB())
+      node.exprs.push_back(compileRoutine(expr, depth));
+    if (_caching)
+      cachePolytope(address(set), node);
+    if (_polytopes) {
+      auto polytope = _polytopes->find(address(set));
+      if (polytope != _polytopes->end())
+        _model->polytopes.emplace_back(_model->program.sets.size(),
+                                       polytope->second);
+      // (the index of node, which is pushed below)
+    }
+    break;
+  }
+  case SetExpr::INTERSECTION:
+    for (auto child_set : set.getIntersection())
+      node.children.push_back(compileSet(child_set, depth));
+    break;
+  case SetExpr::REFERENCE:
+    node.children.push_back(compileSetRef(set.getReference(), depth));
+    break;
+  default:
+    // operations on this type of set are not supported
+    node.error = compileDiagnostic(Diagnostic::Kind::WhichError,
+                                   whichErrorMessage("AdvFunc::compileSet", set),
+                                   "", int(node.type));
+  }
+
+  _model->program.sets.push_back(std::move(node));
+  return _model->program.sets.size() - 1;
+}
+
+uint32_t AdvFunc::compileSetRef(const kj::StringPtr ref, int depth) {
+  std::string name(ref);
+  SetNode errorNode;
+  errorNode.type = SetExpr::REFERENCE;
+  auto &setExprRefs = compiledRefs(ref, true);
+
+  auto compiled = setExprRefs.find(name);
+  if (compiled != setExprRefs.end()) {
+    if (compiled->second != CompiledSet::invalid)
+      return compiled->second;
+    // cycle
+    errorNode.error = compileDiagnostic(Diagnostic::Kind::EvaluationError,
+                                        "max nesting depth reached");
+  } else {
+    auto referenced_set = _model->setExprRefs.find(name);
+    if (referenced_set != _model->setExprRefs.end()) {
+      setExprRefs[name] = CompiledSet::invalid;
+      auto node = compileSet(referenced_set->second, depth);
+      setExprRefs[name] = node;
+      return node;
+    }
+    auto msg = boost::format("AdvFunc::compileSetRef [ref=%1%]") % ref.cStr();
+    errorNode.error = compileDiagnostic(Diagnostic::Kind::UnknownReference,
+                                        str(msg), name);
+  }
+  _model->program.sets.push_back(std::move(errorNode));
+  return _model->program.sets.size() - 1;
+}
+
+uint32_t AdvFunc::compileDiagnostic(Diagnostic::Kind kind,
+                                    const std::string &what,
+                                    const std::string &ref, int which) {
+  _model->program.diagnostics.push_back(Diagnostic{kind, what, ref, which});
+  return _model->program.diagnostics.size() - 1;
+}
+
+uint32_t AdvFunc::variableSlot(const kj::StringPtr var) {
+  std::string name(var);
+  auto slot = _model->program.variableSlots.find(name);
+  if (slot != _model->program.variableSlots.end())
+    return slot->second;
+
+  _model->program.variables.push_back(name);
+  _model->program.variableSlots[name] = _model->program.variables.size() - 1;
+  return _model->program.variables.size() - 1;
+}
@@ -0,0 +1,188 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+
+// Dependency analysis
+//
+// After the advertisement has been compiled (so that all its variables have
+// slots), analyzeDependencies labels every RealExpr and SetExpr in it with
+// the mask of the variables it depends on. The traversal follows references
+// and labels every expression once, so its cost is linear in the size of the
+// message. The labels are keyed by the address of the expression in the
+// message (see address()).
+//
+// Other parts of the interpreter query the labels to cache what does not
+// depend on the variables; for now, the hulls of variable-free sets.
+
+using namespace msg;
+
+void AdvFunc::analyzeDependencies() {
+  _model->dependencies.clear();
+  _hulls.clear();
+  if (_model->adv.hasPQProfile())
+    analyze(_model->adv.getPQProfile(), 0, true);
+  if (_model->adv.hasBeliefFunction())
+    analyze(_model->adv.getBeliefFunction(), 0, true);
+  if (_model->adv.hasCostFunction())
+    analyze(_model->adv.getCostFunction(), 0, true);
+}
+
+AdvFunc::VariableMask AdvFunc::variableMask(const kj::StringPtr var) const {
+  auto slot = _model->program.variableSlots.find(std::string(var));
+  if (slot == _model->program.variableSlots.end())
+    return variableBit(63);
+  // (a variable that does not occur in the advertisement)
+  return variableBit(slot->second);
+}
+
+AdvFunc::VariableMask AdvFunc::dependencies(RealExpr::Reader expr) {
+  assert(_advValid);
+  auto label = _model->dependencies.find(address(expr));
+  if (label != _model->dependencies.end())
+    return label->second;
+  return analyze(expr, 0, false);
+}
+
+AdvFunc::VariableMask AdvFunc::dependencies(SetExpr::Reader set) {
+  assert(_advValid);
+  auto label = _model->dependencies.find(address(set));
+  if (label != _model->dependencies.end())
+    return label->second;
+  return analyze(set, 0, false);
+}
+
+AdvFunc::VariableMask AdvFunc::analyze(RealExpr::Reader expr, int depth,
+                                       bool label) {
+  if (++depth > MAX_NESTING_DEPTH) {
+    throw EvaluationError("max nesting depth reached");
+  }
+  if (label) {
+    auto known = _model->dependencies.find(address(expr));
+    if (known != _model->dependencies.end())
+      return known->second;
+  }
+
+  VariableMask mask = 0;
+  switch (expr.which()) {
+  case RealExpr::REAL:
+    break;
+  case RealExpr::VARIABLE:
+    mask = variableMask(expr.getVariable());
+    break;
+  case RealExpr::POLYNOMIAL:
+    for (auto var : expr.getPolynomial().getVariables())
+      mask |= variableMask(var);
+    break;
+  case RealExpr::UNARY_OPERATION:
+    mask = analyze(expr.getUnaryOperation().getArg(), depth, label);
+    break;
+  case RealExpr::BINARY_OPERATION: {
+    auto binaryop = expr.getBinaryOperation();
+    mask = analyze(binaryop.getArgA(), depth, label) |
+           analyze(binaryop.getArgB(), depth, label);
+    break;
+  }
+  case RealExpr::LIST_OPERATION:
+    for (auto arg : expr.getListOperation().getArgs())
+      mask |= analyze(arg, depth, label);
+    break;
+  case RealExpr::CASE_DISTINCTION: {
+    auto cd = expr.getCaseDistinction();
+    for (auto var : cd.getVariables())
+      mask |= variableMask(var);
+    for (auto cs : cd.getCases())
+      mask |= analyze(cs.getSet(), depth, label) |
+              analyze(cs.getExpression(), depth, label);
+    break;
+  }
+  case RealExpr::REFERENCE: {
+    auto ref = expr.getReference();
+    auto index = linkedRealExpr(ref);
+    if (index >= 0) {
+      mask = analyze(_model->namedRealExprs[index], depth, label);
+    } else {
+      auto referenced = _model->realExprRefs.find(ref);
+      if (referenced != _model->realExprRefs.end())
+        mask = analyze(referenced->second, depth, label);
+      // (otherwise, evaluation throws regardless of the variables)
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (label)
+    _model->dependencies[address(expr)] = mask;
+  return mask;
+}
+
+AdvFunc::VariableMask AdvFunc::analyze(SetExpr::Reader set, int depth,
+                                       bool label) {
+  if (++depth > MAX_NESTING_DEPTH) {
+    throw EvaluationError("max nesting depth reached");
+  }
+  if (label) {
+    auto known = _model->dependencies.find(address(set));
+    if (known != _model->dependencies.end())
+      return known->second;
+  }
+
+  VariableMask mask = 0;
+  switch (set.which()) {
+  case SetExpr::SINGLETON:
+    for (auto expr : set.getSingleton())
+      mask |= analyze(expr, depth, label);
+    break;
+  case SetExpr::BALL: {
+    auto ball = set.getBall();
+    for (auto expr : ball.getCenter())
+      mask |= analyze(expr, depth, label);
+    mask |= analyze(ball.getRadius(), depth, label);
+    break;
+  }
+  case SetExpr::RECTANGLE:
+    for (auto bpair : set.getRectangle())
+      mask |= analyze(bpair.getBoundA(), depth, label) |
+              analyze(bpair.getBoundB(), depth, label);
+    break;
+  case SetExpr::CONVEX_POLYTOPE: {
+    auto poly = set.getConvexPolytope();
+    for (auto row : poly.getA())
+      for (auto expr : row)
+        mask |= analyze(expr, depth, label);
+    for (auto expr : poly.getB())
+      mask |= analyze(expr, depth, label);
+    break;
+  }
+  case SetExpr::INTERSECTION:
+    for (auto child_set : set.getIntersection())
+      mask |= analyze(child_set, depth, label);
+    break;
+  case SetExpr::CASE_DISTINCTION: {
+    auto cd = set.getCaseDistinction();
+    for (auto var : cd.getVariables())
+      mask |= variableMask(var);
+    for (auto cs : cd.getCases())
+      mask |= analyze(cs.getSet(), depth, label) |
+              analyze(cs.getExpression(), depth, label);
+    break;
+  }
+  case SetExpr::REFERENCE: {
+    auto ref = set.getReference();
+    auto referenced = _model->setExprLinks.find(ref.begin());
+    if (referenced != _model->setExprLinks.end()) {
+      mask = analyze(_model->namedSetExprs[referenced->second], depth, label);
+    } else {
+      auto named = _model->setExprRefs.find(ref);
+      if (named != _model->setExprRefs.end())
+        mask = analyze(named->second, depth, label);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (label)
+    _model->dependencies[address(set)] = mask;
+  return mask;
+}
@@ -6,15 +6,13 @@ using namespace msg;
 
 double AdvFunc::evaluate(RealExpr::Reader expr, const ValueMap &bound_vars) {
   assert(_advValid);
-  _bound_vars = &bound_vars;
-  _nesting_depth = 0;
+  beginEvaluation(bound_vars);
   return eval(expr);
 }
 
 double AdvFunc::evalPartialDerivative(RealExpr::Reader expr,std::string diffVariable , const ValueMap &bound_vars) {
   assert(_advValid);
-  _bound_vars = &bound_vars;
-  _nesting_depth = 0;
+  beginEvaluation(bound_vars);
   return evalPartialDerivative(expr, diffVariable);
 }
 
@@ -172,11 +170,15 @@ double AdvFunc::evalPartialDerivative(msg::BinaryOperation::Reader bin_op,
                : evalPartialDerivative(arg2, diffVariable);
   case BinaryOperation::Operation::POW: {
     // d/dx f(x)^{g(x)} = f(x)^{g(x)-1} ( g(x) f'(x) + f(x) \log (f(x)) g'(x) )
+    // (the logarithm is only evaluated if g'(x) is nonzero, such that
+    // negative bases can be used with constant exponents)
     auto base = eval(arg1);
     auto expon = eval(arg2);
-    return std::pow(base, expon - 1.0) *
-           (expon * evalPartialDerivative(arg1, diffVariable) +
-            base * std::log(base) * evalPartialDerivative(arg2, diffVariable));
+    auto dexpon = evalPartialDerivative(arg2, diffVariable);
+    auto result = expon * evalPartialDerivative(arg1, diffVariable);
+    if (dexpon != 0)
+      result += base * std::log(base) * dexpon;
+    return std::pow(base, expon - 1.0) * result;
   }
   }
 }
@@ -295,7 +297,7 @@ double AdvFunc::evalPartialDerivative(msg::UnaryOperation::Reader unop,
     return 1.0 / (x * x) * evalPartialDerivative(arg, diffVariable);
   }
   case UnaryOperation::Operation::SQUARE:
-    return 2.0 * evalPartialDerivative(arg, diffVariable);
+    return 2.0 * eval(arg) * evalPartialDerivative(arg, diffVariable);
   case UnaryOperation::Operation::SQRT:
     return 1.0 / (2.0 * std::sqrt(eval(arg))) * evalPartialDerivative(arg, diffVariable);
   case UnaryOperation::Operation::LOG10:
@@ -320,9 +322,20 @@ double AdvFunc::evalPartialDerivative(msg::UnaryOperation::Reader unop,
 }
 
 double AdvFunc::evalPartialDerivativeRef(const kj::StringPtr ref,const std::string &diffVariable) {
-   auto referenced_real_expr = _real_expr_refs.find(ref);
+  auto index = linkedRealExpr(ref);
+  if (index >= 0) {
+    // (diffVariable is the same throughout one evaluation)
+    if (!_ref_partial_known[index]) {
+      _ref_partials[index] = evalPartialDerivative(_model->namedRealExprs[index], diffVariable);
+      _ref_partial_known[index] = 1;
+    }
+    return _ref_partials[index];
+  }
+
+  // the reference is not part of the advertisement
+  auto referenced_real_expr = _model->realExprRefs.find(ref);
   // try to locate reference in refs
-  if (referenced_real_expr != _real_expr_refs.end()) {
+  if (referenced_real_expr != _model->realExprRefs.end()) {
     // reference found, evaluate it by calling ourselves (will be handled by the
     // method that deals with RealExpr::Reader types
     return evalPartialDerivative(referenced_real_expr->second,diffVariable);
@@ -350,29 +363,34 @@ double AdvFunc::evalPartialDerivativeVar(const kj::StringPtr var,const std::stri
 }
 
 double AdvFunc::eval(Polynomial::Reader poly,int dVar) const {
-  // TODO: use Horner's evaluation method for multivariate polynomials
-  
   // dVar - evaluate partial derivative with respect to variable i 
   // (dVar= -1 means ordinary evaluation of the polynomial itself)
 
-  // evaluate variables
-  std::vector<double> evalpoint;
+  // evaluate variables, and tabulate their powers x^0, x^1, ..., x^(d-1)
+  // (the compiled program decodes the exponents only once, see
+  // AdvFunc::evalPolynomial)
   auto vars = poly.getVariables();
-  for(auto var:vars)
-    evalpoint.push_back(_bound_vars->at(var));
+  int d = poly.getMaxVarDegree()+1;
+  int sz = vars.size();
+  std::vector<double> powers(sz * d);
+  for(int var=0; var<sz; ++var){
+    double x = _bound_vars->at(vars[var]);
+    double *pow = &powers[var * d];
+    pow[0] = 1;
+    for(int k=1; k<d; ++k)
+      pow[k] = pow[k-1] * x;
+  }
 
   // evaluate each monomial
-  int d = poly.getMaxVarDegree()+1;
   double result = 0;
   for (auto coeff: poly.getCoefficients()){
     double monom=1;
-    //int var=0;
     int offset = coeff.getOffset();
 
     // convert offset value into sequence of powers of the monomial
-    int sz = vars.size();
     for(int var=0; var<sz; ++var){
-      int rem = offset / static_cast<int>(std::pow(d,var)+.5) % d;
+      int rem = offset % d;
+      offset /= d;
       if(dVar == var){
         // compute partial derivative
         if (rem == 0){
@@ -380,10 +398,10 @@ double AdvFunc::eval(Polynomial::Reader poly,int dVar) const {
           monom=0;
           break;
         }
-        if (rem > 1) monom *= rem*std::pow(evalpoint[var],rem-1); 
+        monom *= rem * powers[var * d + rem - 1];
       }
       else
-        monom *= std::pow(evalpoint[var],rem); 
+        monom *= powers[var * d + rem];
     }
     result+= coeff.getValue() * monom;
   }
@@ -418,9 +436,20 @@ double AdvFunc::eval(CaseDistinction<RealExpr>::Reader casedist) {
 
 //double AdvFunc::eval(std::string ref) {
 double AdvFunc::evalRef(const kj::StringPtr ref) {
-  auto referenced_real_expr = _real_expr_refs.find(ref);
+  auto index = linkedRealExpr(ref);
+  if (index >= 0) {
+    // every named RealExpr is evaluated at most once per evaluation
+    if (!_ref_value_known[index]) {
+      _ref_values[index] = eval(_model->namedRealExprs[index]);
+      _ref_value_known[index] = 1;
+    }
+    return _ref_values[index];
+  }
+
+  // the reference is not part of the advertisement
+  auto referenced_real_expr = _model->realExprRefs.find(ref);
   // try to locate reference in refs
-  if (referenced_real_expr != _real_expr_refs.end()) {
+  if (referenced_real_expr != _model->realExprRefs.end()) {
     // reference found, evaluate it by calling ourselves (will be handled by the
     // method that deals with RealExpr::Reader types
     return eval(referenced_real_expr->second);
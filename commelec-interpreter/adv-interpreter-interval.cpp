@@ -0,0 +1,489 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+// Interval evaluation of compiled programs
+//
+// The interval executor runs the same instructions as run(), but on intervals
+// [lo,hi]: every instruction computes an interval that contains the result of
+// the operation for all values of its operands in their intervals. The
+// variables range over the sides of a box, so the resulting interval encloses
+// the values of the expression on the box. The bounds are rounded outwards
+// after every inexact operation, such that rounding errors cannot invalidate
+// them.
+//
+// Points at which an operation is undefined (e.g., the square root of a
+// negative number) are disregarded. If an interval lies completely outside
+// the domain of an operation, the result is [NaN,NaN], which propagates.
+//
+// For a case distinction, the result encloses the values of all cases whose
+// sets may contain a point of the box, up to the first case whose set
+// contains the whole box (see classify).
+
+using namespace msg;
+
+namespace {
+
+const double inf = std::numeric_limits<double>::infinity();
+const double nan = std::numeric_limits<double>::quiet_NaN();
+const Interval entire{-inf, inf};
+const Interval undefined{nan, nan};
+
+bool isUndefined(const Interval &a) { return std::isnan(a.lo) || std::isnan(a.hi); }
+
+Interval outward(double lo, double hi) {
+  return Interval{std::nextafter(lo, -inf), std::nextafter(hi, inf)};
+}
+
+Interval hull(const Interval &a, const Interval &b) {
+  if (isUndefined(a) || isUndefined(b))
+    return undefined;
+  return Interval{std::min(a.lo, b.lo), std::max(a.hi, b.hi)};
+}
+
+Interval add(const Interval &a, const Interval &b) {
+  return outward(a.lo + b.lo, a.hi + b.hi);
+}
+
+double product(double x, double y) {
+  // a bound of zero times an infinite bound contributes zero (the infinite
+  // bound itself is never attained)
+  return (x == 0 || y == 0) ? 0.0 : x * y;
+}
+
+Interval mul(const Interval &a, const Interval &b) {
+  double p[] = {product(a.lo, b.lo), product(a.lo, b.hi), product(a.hi, b.lo),
+                product(a.hi, b.hi)};
+  return outward(*std::min_element(p, p + 4), *std::max_element(p, p + 4));
+}
+
+Interval reciprocal(const Interval &a) {
+  if (a.lo > 0 || a.hi < 0)
+    return outward(1.0 / a.hi, 1.0 / a.lo);
+  return entire;
+}
+
+Interval nonNegative(Interval a) {
+  a.lo = std::max(a.lo, 0.0);
+  return a;
+}
+
+Interval power(const Interval &a, uint32_t n) {
+  // a^n for a natural number n
+  if (n == 0)
+    return Interval{1.0, 1.0};
+  if (n == 1)
+    return a;
+  auto p = [n](double x) { return std::pow(x, double(n)); };
+  if (n % 2 == 1)
+    return outward(p(a.lo), p(a.hi));
+  if (a.lo >= 0)
+    return nonNegative(outward(p(a.lo), p(a.hi)));
+  if (a.hi <= 0)
+    return nonNegative(outward(p(a.hi), p(a.lo)));
+  return nonNegative(outward(0.0, p(std::max(-a.lo, a.hi))));
+}
+
+Interval power(const Interval &a, const Interval &b) {
+  if (b.lo == b.hi) {
+    double v = b.lo;
+    if (v == std::floor(v) && std::abs(v) < 1e9) {
+      auto result = power(a, uint32_t(std::abs(v)));
+      return (v < 0) ? reciprocal(result) : result;
+    }
+    // a non-integer exponent is only defined for non-negative bases
+    if (a.hi < 0)
+      return undefined;
+    double lo = std::max(a.lo, 0.0);
+    if (v > 0)
+      return nonNegative(outward(std::pow(lo, v), std::pow(a.hi, v)));
+    return nonNegative(outward(std::pow(a.hi, v), std::pow(lo, v)));
+  }
+  // for non-negative bases, u^v is monotone in u and in v, hence its extremes
+  // are attained at the corners
+  if (a.lo >= 0) {
+    double p[] = {std::pow(a.lo, b.lo), std::pow(a.lo, b.hi),
+                  std::pow(a.hi, b.lo), std::pow(a.hi, b.hi)};
+    return nonNegative(
+        outward(*std::min_element(p, p + 4), *std::max_element(p, p + 4)));
+  }
+  return entire;
+}
+
+bool containsPeriodic(const Interval &a, double x0, double period) {
+  // whether x0 + k * period lies in a for some integer k (the test errs on
+  // the side of true)
+  double eps = 8 * std::numeric_limits<double>::epsilon() *
+               std::max({1.0, std::abs(a.lo), std::abs(a.hi)});
+  double k = std::ceil((a.lo - eps - x0) / period);
+  return x0 + k * period <= a.hi + eps;
+}
+
+Interval periodic(const Interval &a, double (*f)(double), double argMax,
+                  double argMin) {
+  // range of sin or cos, which attain their maximum 1 at argMax + 2k pi and
+  // their minimum -1 at argMin + 2k pi
+  if (!(a.hi - a.lo < 2 * M_PI))
+    return Interval{-1.0, 1.0};
+  auto result = outward(std::min(f(a.lo), f(a.hi)), std::max(f(a.lo), f(a.hi)));
+  result.lo = containsPeriodic(a, argMin, 2 * M_PI) ? -1.0 : std::max(result.lo, -1.0);
+  result.hi = containsPeriodic(a, argMax, 2 * M_PI) ? 1.0 : std::min(result.hi, 1.0);
+  return result;
+}
+
+double sine(double x) { return std::sin(x); }
+double cosine(double x) { return std::cos(x); }
+
+Interval unaryInterval(OpCode op, const Interval &a) {
+  if (isUndefined(a))
+    return undefined;
+  switch (op) {
+  case OpCode::Negate:
+    return Interval{-a.hi, -a.lo};
+  case OpCode::Abs:
+    if (a.lo >= 0)
+      return a;
+    if (a.hi <= 0)
+      return Interval{-a.hi, -a.lo};
+    return Interval{0.0, std::max(-a.lo, a.hi)};
+  case OpCode::Sign:
+    return Interval{double(sgn(a.lo)), double(sgn(a.hi))};
+  case OpCode::MultInv:
+    return reciprocal(a);
+  case OpCode::Square:
+    return power(a, 2);
+  case OpCode::Sqrt:
+    if (a.hi < 0)
+      return undefined;
+    return nonNegative(outward(std::sqrt(std::max(a.lo, 0.0)), std::sqrt(a.hi)));
+  case OpCode::Sin:
+    return periodic(a, sine, M_PI / 2, -M_PI / 2);
+  case OpCode::Cos:
+    return periodic(a, cosine, 0.0, M_PI);
+  case OpCode::Tan:
+    // tan is increasing between its poles at pi/2 + k pi
+    if (!(a.hi - a.lo < M_PI) || containsPeriodic(a, M_PI / 2, M_PI))
+      return entire;
+    return outward(std::tan(a.lo), std::tan(a.hi));
+  case OpCode::Exp:
+    return nonNegative(outward(std::exp(a.lo), std::exp(a.hi)));
+  case OpCode::Ln:
+    if (a.hi < 0)
+      return undefined;
+    return outward(std::log(std::max(a.lo, 0.0)), std::log(a.hi));
+  case OpCode::Log10:
+    if (a.hi < 0)
+      return undefined;
+    return outward(std::log10(std::max(a.lo, 0.0)), std::log10(a.hi));
+  case OpCode::Round:
+    return Interval{std::round(a.lo), std::round(a.hi)};
+  case OpCode::Floor:
+    return Interval{std::floor(a.lo), std::floor(a.hi)};
+  case OpCode::Ceil:
+    return Interval{std::ceil(a.lo), std::ceil(a.hi)};
+  default:
+    assert(false);
+    return undefined;
+  }
+}
+
+Interval binaryInterval(OpCode op, const Interval &a, const Interval &b) {
+  if (isUndefined(a) || isUndefined(b))
+    return undefined;
+  switch (op) {
+  case OpCode::Sum:
+    return add(a, b);
+  case OpCode::Prod:
+    return mul(a, b);
+  case OpCode::Pow:
+    return power(a, b);
+  case OpCode::Min:
+    return Interval{std::min(a.lo, b.lo), std::min(a.hi, b.hi)};
+  case OpCode::Max:
+    return Interval{std::max(a.lo, b.lo), std::max(a.hi, b.hi)};
+  case OpCode::LessEqThan:
+    if (a.hi <= b.lo)
+      return Interval{1.0, 1.0};
+    if (a.lo > b.hi)
+      return Interval{0.0, 0.0};
+    return Interval{0.0, 1.0};
+  case OpCode::GreaterThan:
+    if (a.lo > b.hi)
+      return Interval{1.0, 1.0};
+    if (a.hi <= b.lo)
+      return Interval{0.0, 0.0};
+    return Interval{0.0, 1.0};
+  default:
+    assert(false);
+    return undefined;
+  }
+}
+
+} // namespace
+
+Eigen::AlignedBox1d AdvFunc::evaluateInterval(CompiledExpr expr,
+                                              const Eigen::AlignedBoxXd &box) {
+  assert(_advValid && expr.valid());
+  bindIntervals(box);
+  runInterval(expr.entry);
+  Eigen::AlignedBox1d bounds;
+  bounds.min()(0) = _isp->lo;
+  bounds.max()(0) = _isp->hi;
+  return bounds;
+}
+
+void AdvFunc::bindIntervals(const Eigen::AlignedBoxXd &box) {
+  auto n = std::min(_model->program.variables.size(), size_t(box.dim()));
+  _ival_vars.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    _ival_vars[i] = Interval{box.min()(i), box.max()(i)};
+
+  _ival_stack.resize(_model->program.stackSize);
+  _isp = _ival_stack.data();
+  _ival_memo.resize(_model->program.references.size());
+  _ival_memo_valid.assign(_model->program.references.size(), 0);
+}
+
+Interval AdvFunc::loadInterval(uint32_t slot) const {
+  if (slot < _ival_vars.size())
+    return _ival_vars[slot];
+
+  throwUnknownVariable(slot);
+}
+
+void AdvFunc::runInterval(uint32_t pc) {
+  // Execute the routine with entry point pc on intervals. The resulting
+  // interval is stored at _isp.
+  const Instruction *code = _model->program.code.data();
+  const double *constants = _model->program.constants.data();
+  Interval *base = _isp;
+  Interval *sp = base;
+
+  for (;;) {
+    const Instruction ins = code[pc++];
+    switch (ins.op) {
+    case OpCode::Const:
+      *sp++ = Interval{constants[ins.arg], constants[ins.arg]};
+      break;
+    case OpCode::Variable:
+      *sp++ = loadInterval(ins.arg);
+      break;
+    case OpCode::Call:
+      if (!_ival_memo_valid[ins.arg]) {
+        _isp = sp;
+        runInterval(_model->program.references[ins.arg]);
+        _ival_memo[ins.arg] = *sp;
+        _ival_memo_valid[ins.arg] = 1;
+      }
+      *sp++ = _ival_memo[ins.arg];
+      break;
+    case OpCode::Throw:
+      throwDiagnostic(ins.arg);
+
+    case OpCode::Negate:
+    case OpCode::Abs:
+    case OpCode::Sign:
+    case OpCode::MultInv:
+    case OpCode::Square:
+    case OpCode::Sqrt:
+    case OpCode::Sin:
+    case OpCode::Cos:
+    case OpCode::Tan:
+    case OpCode::Exp:
+    case OpCode::Ln:
+    case OpCode::Log10:
+    case OpCode::Round:
+    case OpCode::Floor:
+    case OpCode::Ceil:
+      sp[-1] = unaryInterval(ins.op, sp[-1]);
+      break;
+
+    case OpCode::Sum:
+    case OpCode::Prod:
+    case OpCode::Pow:
+    case OpCode::Min:
+    case OpCode::Max:
+    case OpCode::LessEqThan:
+    case OpCode::GreaterThan:
+      --sp;
+      sp[-1] = binaryInterval(ins.op, sp[-1], *sp);
+      break;
+
+    case OpCode::SumList:
+    case OpCode::ProdList: {
+      bool sum = (ins.op == OpCode::SumList);
+      sp -= ins.arg;
+      Interval accum{sum ? 0.0 : 1.0, sum ? 0.0 : 1.0};
+      for (uint32_t i = 0; i < ins.arg; ++i)
+        accum = binaryInterval(sum ? OpCode::Sum : OpCode::Prod, accum, sp[i]);
+      *sp++ = accum;
+      break;
+    }
+
+    case OpCode::Polynomial:
+      *sp++ = evalPolynomialInterval(_model->program.polynomials[ins.arg]);
+      break;
+
+    case OpCode::CaseDistinction: {
+      // the box of the evaluation point is stored on top of the stack
+      const auto &casedist = _model->program.cases[ins.arg];
+      auto dim = casedist.variables.size();
+      for (size_t i = 0; i < dim; ++i) {
+        if (casedist.isFixed(i)) {
+          double value = _model->program.constants[casedist.fixed[i]];
+          sp[i] = Interval{value, value};
+          continue;
+        }
+        auto slot = casedist.variables[i];
+        if (slot >= _ival_vars.size())
+          throw EvaluationError("Variable specified in CaseDistinction not "
+                                "found in VariableMap bound_vars.");
+        sp[i] = _ival_vars[slot];
+      }
+
+      // enclose the values of all cases that may be active somewhere in the box
+      auto cases = casedist.sets.size();
+      bool handled = false;
+      Interval result = undefined;
+      for (size_t k = 0; k < cases; ++k) {
+        _isp = sp + dim;
+        auto overlap = classify(casedist.sets[k], sp, dim);
+        if (overlap == Overlap::Outside)
+          continue;
+        _isp = sp + dim;
+        runInterval(casedist.routines[k]);
+        result = handled ? hull(result, sp[dim]) : sp[dim];
+        handled = true;
+        if (overlap == Overlap::Inside)
+          break;
+      }
+      if (!handled)
+        throw EvaluationError("Unhandled case in CaseDistinction");
+
+      *sp++ = result;
+      break;
+    }
+
+    case OpCode::Return:
+      *base = sp[-1];
+      _isp = base;
+      return;
+    }
+  }
+}
+
+Interval AdvFunc::evalPolynomialInterval(const PolynomialData &poly) {
+  // as evalPolynomial, but every power x^k is bounded directly (rather than
+  // as a product of k intervals), which keeps even powers non-negative
+  auto sz = poly.variables.size();
+  _ival_powers.resize(poly.powerIndex.back());
+  for (size_t var = 0; var < sz; ++var) {
+    Interval *pow = _ival_powers.data() + poly.powerIndex[var];
+    auto maxExponent = poly.maxExponent(var);
+    pow[0] = Interval{1.0, 1.0};
+    if (maxExponent == 0)
+      continue; // (the variable need not be bound)
+    auto x = loadInterval(poly.variables[var]);
+    for (uint32_t k = 1; k <= maxExponent; ++k)
+      pow[k] = power(x, k);
+  }
+
+  const Interval *powers = _ival_powers.data();
+  const uint32_t *index = poly.powerIndex.data();
+  const uint32_t *exps = poly.exponents.data();
+  Interval result{0.0, 0.0};
+  for (uint32_t t = 0; t < poly.terms; ++t, exps += sz) {
+    double coeff = _model->program.constants[poly.firstCoeff + t];
+    Interval monom{coeff, coeff};
+    for (size_t var = 0; var < sz; ++var)
+      if (exps[var] > 0)
+        monom = mul(monom, powers[index[var] + exps[var]]);
+    result = add(result, monom);
+  }
+  return result;
+}
+
+AdvFunc::Overlap AdvFunc::classify(uint32_t index, const Interval *box,
+                                   size_t dim) {
+  // The expressions of the set are evaluated on the interval stack from _isp
+  // onwards. The set and the box are treated as independent, hence Inside
+  // and Outside are certain, but Partial may be returned for sets that
+  // actually contain (or miss) the whole box.
+  const auto &set = _model->program.sets[index];
+  if (set.error >= 0)
+    throwDiagnostic(set.error);
+
+  Interval *sp = _isp;
+  auto eval = [&](uint32_t entry) {
+    _isp = sp;
+    runInterval(entry);
+    return *sp;
+  };
+
+  bool inside = true;
+  switch (set.type) {
+  case SetExpr::SINGLETON:
+    // (membership of a singleton is tested up to a relative tolerance)
+    return Overlap::Partial;
+  case SetExpr::BALL: {
+    checkDimension(set.exprs.size() - 1, dim);
+    Interval dist{0.0, 0.0};
+    for (size_t i = 0; i < dim; ++i) {
+      auto center = eval(set.exprs[i]);
+      auto diff = add(box[i], Interval{-center.hi, -center.lo});
+      dist = add(dist, power(diff, 2));
+    }
+    auto r2 = power(eval(set.exprs[dim]), 2);
+    _isp = sp;
+    if (dist.lo > r2.hi)
+      return Overlap::Outside;
+    return (dist.hi <= r2.lo) ? Overlap::Inside : Overlap::Partial;
+  }
+  case SetExpr::RECTANGLE: {
+    checkDimension(set.exprs.size() / 2, dim);
+    for (size_t i = 0; i < dim; ++i) {
+      auto a = eval(set.exprs[2 * i]);
+      auto b = eval(set.exprs[2 * i + 1]);
+      Interval lower{std::min(a.lo, b.lo), std::min(a.hi, b.hi)};
+      Interval upper{std::max(a.lo, b.lo), std::max(a.hi, b.hi)};
+      if (box[i].hi < lower.lo || box[i].lo > upper.hi) {
+        _isp = sp;
+        return Overlap::Outside;
+      }
+      inside = inside && lower.hi <= box[i].lo && box[i].hi <= upper.lo;
+    }
+    _isp = sp;
+    return inside ? Overlap::Inside : Overlap::Partial;
+  }
+  case SetExpr::CONVEX_POLYTOPE: {
+    checkDimension(set.cols, dim);
+    const uint32_t *b = set.exprs.data() + set.rows * set.cols;
+    for (uint32_t row = 0; row < set.rows; ++row) {
+      Interval dot{0.0, 0.0};
+      for (uint32_t col = 0; col < set.cols; ++col)
+        dot = add(dot, mul(eval(set.exprs[row * set.cols + col]), box[col]));
+      auto bound = eval(b[row]);
+      if (dot.lo > bound.hi) {
+        _isp = sp;
+        return Overlap::Outside;
+      }
+      inside = inside && dot.hi <= bound.lo;
+    }
+    _isp = sp;
+    return inside ? Overlap::Inside : Overlap::Partial;
+  }
+  case SetExpr::INTERSECTION:
+    for (auto child : set.children) {
+      auto overlap = classify(child, box, dim);
+      if (overlap == Overlap::Outside)
+        return Overlap::Outside;
+      inside = inside && overlap == Overlap::Inside;
+    }
+    return inside ? Overlap::Inside : Overlap::Partial;
+  case SetExpr::REFERENCE:
+    return classify(set.children[0], box, dim);
+  default:
+    throw WhichError(int(set.type), "AdvFunc::classify");
+  }
+}
@@ -0,0 +1,228 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <boost/format.hpp>
+
+// Link pass
+//
+// After findReferences has collected the named RealExpr'essions and
+// SetExpr'essions, linkReferences traverses the advertisement once more and
+// resolves every reference to the index of the named expression it refers
+// to. A reference is identified by the address of its text in the message,
+// so that the evaluators can follow it without converting or hashing the
+// name. Dangling references and cycles of references are reported here,
+// rather than when (and if) they are evaluated.
+
+using namespace msg;
+
+struct LinkState {
+  enum : char { Unvisited, InProgress, Done };
+  std::unordered_map<std::string, uint32_t> realExprIndex;
+  std::unordered_map<std::string, uint32_t> setExprIndex;
+  std::vector<char> realExprState;
+  std::vector<char> setExprState;
+  // the named expressions that are being traversed are on the path from the
+  // root; reaching such an expression again through a reference closes a cycle
+};
+
+void AdvFunc::linkReferences() {
+  _model->namedRealExprs.clear();
+  _model->namedSetExprs.clear();
+  _model->realExprLinks.clear();
+  _model->setExprLinks.clear();
+
+  LinkState state;
+  for (const auto &ref : _model->realExprRefs) {
+    state.realExprIndex[ref.first] = _model->namedRealExprs.size();
+    _model->namedRealExprs.push_back(ref.second);
+  }
+  for (const auto &ref : _model->setExprRefs) {
+    state.setExprIndex[ref.first] = _model->namedSetExprs.size();
+    _model->namedSetExprs.push_back(ref.second);
+  }
+  state.realExprState.assign(_model->namedRealExprs.size(), LinkState::Unvisited);
+  state.setExprState.assign(_model->namedSetExprs.size(), LinkState::Unvisited);
+
+  _nesting_depth = 0;
+  if (_model->adv.hasPQProfile())
+    linkReferences(_model->adv.getPQProfile(), state);
+  if (_model->adv.hasBeliefFunction())
+    linkReferences(_model->adv.getBeliefFunction(), state);
+  if (_model->adv.hasCostFunction())
+    linkReferences(_model->adv.getCostFunction(), state);
+  _nesting_depth = 0;
+
+  _ref_values.resize(_model->namedRealExprs.size());
+  _ref_partials.resize(_model->namedRealExprs.size());
+  _ref_value_known.assign(_model->namedRealExprs.size(), 0);
+  _ref_partial_known.assign(_model->namedRealExprs.size(), 0);
+}
+
+void AdvFunc::linkReferences(RealExpr::Reader expr, LinkState &state) {
+  // Depth-first traversal that also follows the references; every named
+  // expression is traversed at most once through references (and once where
+  // it is defined), so the cost is linear in the size of the message.
+  ++_nesting_depth;
+  if (_nesting_depth > MAX_NESTING_DEPTH) {
+    throw EvaluationError("max nesting depth reached");
+  }
+
+  char *named = nullptr;
+  if (expr.hasName()) {
+    auto index = state.realExprIndex.find(expr.getName());
+    // (in case of duplicate names, only the expression that is referenced
+    // counts)
+    if (index != state.realExprIndex.end() &&
+        _model->namedRealExprs[index->second].getName().begin() ==
+            expr.getName().begin() &&
+        state.realExprState[index->second] == LinkState::Unvisited) {
+      named = &state.realExprState[index->second];
+      *named = LinkState::InProgress;
+    }
+  }
+
+  switch (expr.which()) {
+  case RealExpr::UNARY_OPERATION:
+    linkReferences(expr.getUnaryOperation().getArg(), state);
+    break;
+  case RealExpr::BINARY_OPERATION: {
+    auto binaryop = expr.getBinaryOperation();
+    linkReferences(binaryop.getArgA(), state);
+    linkReferences(binaryop.getArgB(), state);
+    break;
+  }
+  case RealExpr::LIST_OPERATION:
+    for (auto real_expr : expr.getListOperation().getArgs())
+      linkReferences(real_expr, state);
+    break;
+  case RealExpr::CASE_DISTINCTION:
+    for (auto cs : expr.getCaseDistinction().getCases()) {
+      linkReferences(cs.getSet(), state);
+      linkReferences(cs.getExpression(), state);
+    }
+    break;
+  case RealExpr::REFERENCE: {
+    auto ref = expr.getReference();
+    auto index = state.realExprIndex.find(ref);
+    if (index == state.realExprIndex.end()) {
+      auto msg = boost::format("AdvFunc::linkReferences [ref=%1%]") % ref.cStr();
+      throw UnknownReference(ref, str(msg));
+    }
+    _model->realExprLinks[ref.begin()] = index->second;
+
+    auto &refState = state.realExprState[index->second];
+    if (refState == LinkState::InProgress) {
+      auto msg = boost::format("AdvFunc::linkReferences: cyclic reference "
+                               "[ref=%1%]") % ref.cStr();
+      throw EvaluationError(str(msg));
+    }
+    if (refState == LinkState::Unvisited)
+      linkReferences(_model->namedRealExprs[index->second], state);
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (named)
+    *named = LinkState::Done;
+}
+
+void AdvFunc::linkReferences(SetExpr::Reader set, LinkState &state) {
+  ++_nesting_depth;
+  if (_nesting_depth > MAX_NESTING_DEPTH) {
+    throw EvaluationError("max nesting depth reached");
+  }
+
+  char *named = nullptr;
+  if (set.hasName()) {
+    auto index = state.setExprIndex.find(set.getName());
+    if (index != state.setExprIndex.end() &&
+        _model->namedSetExprs[index->second].getName().begin() ==
+            set.getName().begin() &&
+        state.setExprState[index->second] == LinkState::Unvisited) {
+      named = &state.setExprState[index->second];
+      *named = LinkState::InProgress;
+    }
+  }
+
+  switch (set.which()) {
+  case SetExpr::SINGLETON:
+    for (auto expr : set.getSingleton())
+      linkReferences(expr, state);
+    break;
+  case SetExpr::BALL: {
+    auto ball = set.getBall();
+    for (auto expr : ball.getCenter())
+      linkReferences(expr, state);
+    linkReferences(ball.getRadius(), state);
+    break;
+  }
+  case SetExpr::RECTANGLE:
+    for (auto bpair : set.getRectangle()) {
+      linkReferences(bpair.getBoundA(), state);
+      linkReferences(bpair.getBoundB(), state);
+    }
+    break;
+  case SetExpr::CONVEX_POLYTOPE: {
+    auto poly = set.getConvexPolytope();
+    for (auto list : poly.getA())
+      for (auto expr : list)
+        linkReferences(expr, state);
+    for (auto expr : poly.getB())
+      linkReferences(expr, state);
+    break;
+  }
+  case SetExpr::INTERSECTION:
+    for (auto expr : set.getIntersection())
+      linkReferences(expr, state);
+    break;
+  case SetExpr::CASE_DISTINCTION:
+    for (auto cs : set.getCaseDistinction().getCases()) {
+      linkReferences(cs.getSet(), state);
+      linkReferences(cs.getExpression(), state);
+    }
+    break;
+  case SetExpr::REFERENCE: {
+    auto ref = set.getReference();
+    auto index = state.setExprIndex.find(ref);
+    if (index == state.setExprIndex.end()) {
+      auto msg = boost::format("AdvFunc::linkReferences [ref=%1%]") % ref.cStr();
+      throw UnknownReference(ref, str(msg));
+    }
+    _model->setExprLinks[ref.begin()] = index->second;
+
+    auto &refState = state.setExprState[index->second];
+    if (refState == LinkState::InProgress) {
+      auto msg = boost::format("AdvFunc::linkReferences: cyclic reference "
+                               "[ref=%1%]") % ref.cStr();
+      throw EvaluationError(str(msg));
+    }
+    if (refState == LinkState::Unvisited)
+      linkReferences(_model->namedSetExprs[index->second], state);
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (named)
+    *named = LinkState::Done;
+}
+
+int AdvFunc::linkedRealExpr(const kj::StringPtr ref) const {
+  auto link = _model->realExprLinks.find(ref.begin());
+  return (link != _model->realExprLinks.end()) ? int(link->second) : -1;
+}
+
+SetExpr::Reader AdvFunc::referencedSet(const kj::StringPtr ref) {
+  auto link = _model->setExprLinks.find(ref.begin());
+  if (link != _model->setExprLinks.end())
+    return _model->namedSetExprs[link->second];
+
+  // the reference is not part of the advertisement
+  auto referenced_set = _model->setExprRefs.find(ref);
+  if (referenced_set != _model->setExprRefs.end())
+    return referenced_set->second;
+
+  auto msg = boost::format("AdvFunc::referencedSet [ref=%1%]") % ref.cStr();
+  throw UnknownReference(ref, str(msg));
+}
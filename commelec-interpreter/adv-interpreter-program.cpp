@@ -0,0 +1,404 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <cmath>
+#include <algorithm>
+#include <boost/format.hpp>
+
+using namespace msg;
+
+double AdvFunc::evaluate(CompiledExpr expr, const ValueMap &bound_vars) {
+  assert(_advValid && expr.valid());
+  bindVariables(bound_vars);
+  return run(expr.entry);
+}
+
+bool AdvFunc::testMembership(CompiledSet set, PointTypePP point,
+                             const ValueMap &bound_vars) {
+  assert(_advValid && set.valid());
+  bindVariables(bound_vars);
+  return member(set.node, point.data(), point.size());
+}
+
+double AdvFunc::evaluate(CompiledExpr expr, const double *values,
+                         size_t num_values) {
+  assert(_advValid && expr.valid());
+  bindVariables(values, num_values);
+  return run(expr.entry);
+}
+
+bool AdvFunc::testMembership(CompiledSet set, const double *point, size_t dim,
+                             const double *values, size_t num_values) {
+  assert(_advValid && set.valid());
+  bindVariables(values, num_values);
+  return member(set.node, point, dim);
+}
+
+void AdvProgram::truncate(const Mark &mark) {
+  code.resize(mark.code);
+  constants.resize(mark.constants);
+  polynomials.resize(mark.polynomials);
+  cases.resize(mark.cases);
+  sets.resize(mark.sets);
+  diagnostics.resize(mark.diagnostics);
+  references.resize(mark.references);
+  stackSize = mark.stackSize;
+  for (auto ref = realExprRefs.begin(); ref != realExprRefs.end();)
+    ref = (ref->second >= mark.references) ? realExprRefs.erase(ref) : ++ref;
+  for (auto ref = setExprRefs.begin(); ref != setExprRefs.end();)
+    ref = (ref->second >= mark.sets) ? setExprRefs.erase(ref) : ++ref;
+}
+
+int AdvFunc::slotOf(const std::string &var) const {
+  auto slot = _model->program.variableSlots.find(var);
+  return (slot != _model->program.variableSlots.end()) ? int(slot->second) : -1;
+}
+
+void AdvFunc::bindVariables(const double *values, size_t num_values) {
+  auto sz = _model->program.variables.size();
+  _var_values.resize(sz);
+  _var_bound.resize(sz);
+  // (no-ops, unless more expressions have been compiled in the meantime)
+
+  auto n = std::min(sz, num_values);
+  std::copy(values, values + n, _var_values.begin());
+  std::fill(_var_bound.begin(), _var_bound.begin() + n, 1);
+  std::fill(_var_bound.begin() + n, _var_bound.end(), 0);
+
+  _stack.resize(_model->program.stackSize);
+  _sp = _stack.data();
+  _memo.resize(_model->program.references.size());
+  _memo_valid.assign(_model->program.references.size(), 0);
+}
+
+void AdvFunc::bindVariables(const ValueMap &bound_vars) {
+  // look up every variable of the program once, rather than at every
+  // occurrence in the expressions
+  auto sz = _model->program.variables.size();
+  _var_values.resize(sz);
+  _var_bound.resize(sz);
+  for (size_t i = 0; i < sz; ++i) {
+    auto value_it = bound_vars.find(_model->program.variables[i]);
+    _var_bound[i] = (value_it != bound_vars.end());
+    _var_values[i] = _var_bound[i] ? value_it->second : 0.0;
+  }
+
+  _stack.resize(_model->program.stackSize);
+  _sp = _stack.data();
+  _memo.resize(_model->program.references.size());
+  _memo_valid.assign(_model->program.references.size(), 0);
+}
+
+double AdvFunc::loadVariable(uint32_t slot) const {
+  if (_var_bound[slot])
+    return _var_values[slot];
+
+  throwUnknownVariable(slot);
+}
+
+void AdvFunc::throwUnknownVariable(uint32_t slot) const {
+  // the expression refers to a variable that is not bound
+  auto &var = _model->program.variables[slot];
+  auto msg = boost::format("AdvFunc::loadVariable [var=%1%]") % var;
+  throw UnknownVariable(var, str(msg));
+}
+
+void AdvFunc::checkDimension(size_t set_dim, size_t point_dim) {
+  if (set_dim == point_dim)
+    return;
+  auto msg = boost::format("AdvFunc::membership: point of dimension %1% in a "
+                           "set of dimension %2%") % point_dim % set_dim;
+  throw EvaluationError(str(msg));
+}
+
+double AdvFunc::run(uint32_t pc) {
+  // Execute the routine with entry point pc, using the stack from _sp
+  // onwards. Nested routines (calls and case distinctions) are executed by
+  // recursion, with _sp pointing to the first free stack element. The
+  // results of calls are memoized in _memo until the variables are re-bound.
+  const Instruction *code = _model->program.code.data();
+  const double *constants = _model->program.constants.data();
+  double *base = _sp;
+  double *sp = base;
+
+  for (;;) {
+    const Instruction ins = code[pc++];
+    switch (ins.op) {
+    case OpCode::Const:
+      *sp++ = constants[ins.arg];
+      break;
+    case OpCode::Variable:
+      *sp++ = loadVariable(ins.arg);
+      break;
+    case OpCode::Call:
+      if (!_memo_valid[ins.arg]) {
+        _sp = sp;
+        _memo[ins.arg] = run(_model->program.references[ins.arg]);
+        _memo_valid[ins.arg] = 1;
+      }
+      *sp++ = _memo[ins.arg];
+      break;
+    case OpCode::Throw:
+      throwDiagnostic(ins.arg);
+
+    case OpCode::Negate:
+      sp[-1] = -sp[-1];
+      break;
+    case OpCode::Abs:
+      sp[-1] = std::abs(sp[-1]);
+      break;
+    case OpCode::Sign:
+      sp[-1] = sgn(sp[-1]);
+      break;
+    case OpCode::MultInv:
+      sp[-1] = 1.0 / sp[-1];
+      break;
+    case OpCode::Square:
+      sp[-1] *= sp[-1];
+      break;
+    case OpCode::Sqrt:
+      sp[-1] = std::sqrt(sp[-1]);
+      break;
+    case OpCode::Sin:
+      sp[-1] = std::sin(sp[-1]);
+      break;
+    case OpCode::Cos:
+      sp[-1] = std::cos(sp[-1]);
+      break;
+    case OpCode::Tan:
+      sp[-1] = std::tan(sp[-1]);
+      break;
+    case OpCode::Exp:
+      sp[-1] = std::exp(sp[-1]);
+      break;
+    case OpCode::Ln:
+      sp[-1] = std::log(sp[-1]);
+      break;
+    case OpCode::Log10:
+      sp[-1] = std::log10(sp[-1]);
+      break;
+    case OpCode::Round:
+      sp[-1] = std::round(sp[-1]);
+      break;
+    case OpCode::Floor:
+      sp[-1] = std::floor(sp[-1]);
+      break;
+    case OpCode::Ceil:
+      sp[-1] = std::ceil(sp[-1]);
+      break;
+
+    case OpCode::Sum:
+      --sp;
+      sp[-1] += *sp;
+      break;
+    case OpCode::Prod:
+      --sp;
+      sp[-1] *= *sp;
+      break;
+    case OpCode::Pow:
+      --sp;
+      sp[-1] = std::pow(sp[-1], *sp);
+      break;
+    case OpCode::Min:
+      --sp;
+      sp[-1] = std::min(sp[-1], *sp);
+      break;
+    case OpCode::Max:
+      --sp;
+      sp[-1] = std::max(sp[-1], *sp);
+      break;
+    case OpCode::LessEqThan:
+      --sp;
+      sp[-1] = (sp[-1] <= *sp) ? 1.0 : 0.0;
+      break;
+    case OpCode::GreaterThan:
+      --sp;
+      sp[-1] = (sp[-1] > *sp) ? 1.0 : 0.0;
+      break;
+
+    case OpCode::SumList: {
+      sp -= ins.arg;
+      double accum = 0;
+      for (uint32_t i = 0; i < ins.arg; ++i)
+        accum += sp[i];
+      *sp++ = accum;
+      break;
+    }
+    case OpCode::ProdList: {
+      sp -= ins.arg;
+      double mult = 1.0;
+      for (uint32_t i = 0; i < ins.arg; ++i)
+        mult *= sp[i];
+      *sp++ = mult;
+      break;
+    }
+
+    case OpCode::Polynomial:
+      *sp++ = evalPolynomial(_model->program.polynomials[ins.arg]);
+      break;
+
+    case OpCode::CaseDistinction: {
+      // the evaluation point is stored on top of the stack
+      const auto &casedist = _model->program.cases[ins.arg];
+      auto dim = casedist.variables.size();
+      for (size_t i = 0; i < dim; ++i) {
+        if (casedist.isFixed(i)) {
+          sp[i] = _model->program.constants[casedist.fixed[i]];
+          continue;
+        }
+        auto slot = casedist.variables[i];
+        if (!_var_bound[slot])
+          throw EvaluationError("Variable specified in CaseDistinction not "
+                                "found in VariableMap bound_vars.");
+        sp[i] = _var_values[slot];
+      }
+      _sp = sp + dim;
+
+      // determine which case we need to evaluate
+      auto cases = casedist.sets.size();
+      size_t k = 0;
+      while (k < cases && !member(casedist.sets[k], sp, dim))
+        ++k;
+      if (k == cases)
+        throw EvaluationError("Unhandled case in CaseDistinction");
+
+      *sp = run(casedist.routines[k]);
+      ++sp;
+      break;
+    }
+
+    case OpCode::Return:
+      _sp = base;
+      return sp[-1];
+    }
+  }
+}
+
+const double *AdvFunc::tabulatePowers(const PolynomialData &poly) {
+  // _powers[poly.powerIndex[var] + k] := x^k, for the value x of variable var
+  auto sz = poly.variables.size();
+  _powers.resize(poly.powerIndex.back());
+  for (size_t var = 0; var < sz; ++var) {
+    double *pow = _powers.data() + poly.powerIndex[var];
+    auto maxExponent = poly.maxExponent(var);
+    pow[0] = 1.0;
+    if (maxExponent == 0)
+      continue; // (the variable need not be bound)
+    double x = loadVariable(poly.variables[var]);
+    for (uint32_t k = 1; k <= maxExponent; ++k)
+      pow[k] = pow[k - 1] * x;
+  }
+  return _powers.data();
+}
+
+double AdvFunc::evalPolynomial(const PolynomialData &poly, double *partials) {
+  // Returns the value of the polynomial and, if partials is not null, stores
+  // the partial derivative with respect to its v-th variable in partials[v]
+  const double *powers = tabulatePowers(poly);
+  const uint32_t *index = poly.powerIndex.data();
+  const uint32_t *exps = poly.exponents.data();
+  auto sz = poly.variables.size();
+  if (partials)
+    std::fill(partials, partials + sz, 0.0);
+
+  double result = 0;
+  for (uint32_t t = 0; t < poly.terms; ++t, exps += sz) {
+    double coeff = _model->program.constants[poly.firstCoeff + t];
+    double monom = coeff;
+    for (size_t var = 0; var < sz; ++var)
+      monom *= powers[index[var] + exps[var]];
+    result += monom;
+
+    if (!partials)
+      continue;
+    for (size_t k = 0; k < sz; ++k) {
+      if (exps[k] == 0)
+        continue;
+      // d/dx_k of c x_0^e_0 ... x_k^e_k ... = c e_k x_k^(e_k-1) prod_{j!=k} x_j^e_j
+      double partial = coeff * exps[k] * powers[index[k] + exps[k] - 1];
+      for (size_t var = 0; var < sz; ++var)
+        if (var != k)
+          partial *= powers[index[var] + exps[var]];
+      partials[k] += partial;
+    }
+  }
+  return result;
+}
+
+bool AdvFunc::member(uint32_t index, const double *point, size_t dim) {
+  const auto &set = _model->program.sets[index];
+  if (set.error >= 0)
+    throwDiagnostic(set.error);
+
+  switch (set.type) {
+  case SetExpr::SINGLETON: {
+    checkDimension(set.exprs.size(), dim);
+    // same criterion as Eigen's isApprox, which is used by the tree-walking
+    // evaluator
+    double diff = 0, normPoint = 0, normSingleton = 0;
+    for (size_t i = 0; i < dim; ++i) {
+      double x = run(set.exprs[i]);
+      diff += (point[i] - x) * (point[i] - x);
+      normPoint += point[i] * point[i];
+      normSingleton += x * x;
+    }
+    double prec = Eigen::NumTraits<double>::dummy_precision();
+    return diff <= prec * prec * std::min(normPoint, normSingleton);
+  }
+  case SetExpr::BALL: {
+    checkDimension(set.exprs.size() - 1, dim);
+    double dist = 0;
+    for (size_t i = 0; i < dim; ++i) {
+      double x = run(set.exprs[i]) - point[i];
+      dist += x * x;
+    }
+    double r = run(set.exprs[dim]);
+    return dist <= r * r;
+  }
+  case SetExpr::RECTANGLE: {
+    checkDimension(set.exprs.size() / 2, dim);
+    for (size_t i = 0; i < dim; ++i) {
+      auto val1 = run(set.exprs[2 * i]);
+      auto val2 = run(set.exprs[2 * i + 1]);
+      if ((point[i] < std::min(val1, val2)) || (point[i] > std::max(val1, val2)))
+        return false;
+    }
+    return true;
+  }
+  case SetExpr::CONVEX_POLYTOPE: {
+    checkDimension(set.cols, dim);
+    const uint32_t *b = set.exprs.data() + set.rows * set.cols;
+    for (uint32_t row = 0; row < set.rows; ++row) {
+      double dot = 0;
+      for (uint32_t col = 0; col < set.cols; ++col)
+        dot += run(set.exprs[row * set.cols + col]) * point[col];
+      if (!(dot <= run(b[row])))
+        return false;
+    }
+    return true;
+  }
+  case SetExpr::INTERSECTION:
+    for (auto child : set.children) { // logical and (greedy)
+      if (!member(child, point, dim))
+        return false;
+    }
+    return true;
+  case SetExpr::REFERENCE:
+    return member(set.children[0], point, dim);
+  default:
+    throw WhichError(int(set.type), "AdvFunc::member");
+  }
+}
+
+void AdvFunc::throwDiagnostic(uint32_t index) const {
+  const auto &diag = _model->program.diagnostics[index];
+  switch (diag.kind) {
+  case Diagnostic::Kind::UnknownReference:
+    throw UnknownReference(diag.ref, diag.what);
+  case Diagnostic::Kind::UnknownVariable:
+    throw UnknownVariable(diag.ref, diag.what);
+  case Diagnostic::Kind::WhichError:
+    throw WhichError(diag.which, diag.what);
+  case Diagnostic::Kind::EvaluationError:
+  default:
+    throw EvaluationError(diag.what);
+  }
+}
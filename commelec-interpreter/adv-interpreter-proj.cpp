@@ -5,8 +5,7 @@ using namespace msg;
 PointType AdvFunc::project(SetExpr::Reader set, PointTypePP point, const ValueMap &bound_vars)
 {
   assert(_advValid);
-  _bound_vars = &bound_vars;
-  _nesting_depth = 0;
+  beginEvaluation(bound_vars);
   return proj(set,point);
 }
 
@@ -32,3 +31,94 @@ double AdvFunc::dist(PointTypePP a, PointTypePP b){
   return (aa - bb).norm();
 }
 
+
+Boundary AdvFunc::boundary(SetExpr::Reader set, const ValueMap &bound_vars) {
+  assert(_advValid);
+  beginEvaluation(bound_vars);
+
+  if (set.which() == SetExpr::REFERENCE)
+    return boundary(referencedSet(set.getReference()), bound_vars);
+  if (set.which() == SetExpr::BALL && set.getBall().getCenter().size() == 2) {
+    auto ball = set.getBall();
+    return DiskPolygon(Eigen::Vector2d(evalToVector(ball.getCenter())),
+                       eval(ball.getRadius()))
+        .boundary();
+  }
+  Ball::Reader disk;
+  if (set.which() == SetExpr::INTERSECTION &&
+      isDiskPolygon(set.getIntersection(), disk))
+    return evalDiskPolygon(disk, set.getIntersection()).boundary();
+
+  throw WhichError(int(set.which()),
+                   "AdvFunc::boundary: not a disk, or an intersection of a "
+                   "disk with polygons and rectangles");
+}
+
+bool AdvFunc::isDiskPolygon(capnp::List<SetExpr>::Reader intersection,
+                            Ball::Reader &disk) {
+  bool hasDisk = false;
+  for (auto set : intersection) {
+    if (set.which() == SetExpr::REFERENCE)
+      set = referencedSet(set.getReference());
+    switch (set.which()) {
+    case SetExpr::BALL:
+      if (hasDisk || set.getBall().getCenter().size() != 2)
+        return false;
+      disk = set.getBall();
+      hasDisk = true;
+      break;
+    case SetExpr::RECTANGLE:
+      if (set.getRectangle().size() != 2)
+        return false;
+      break;
+    case SetExpr::CONVEX_POLYTOPE:
+      for (auto row : set.getConvexPolytope().getA())
+        if (row.size() != 2)
+          return false;
+      break;
+    default:
+      return false;
+    }
+  }
+  return hasDisk;
+}
+
+DiskPolygon AdvFunc::evalDiskPolygon(Ball::Reader disk,
+                                     capnp::List<SetExpr>::Reader intersection) {
+  DiskPolygon kernel(Eigen::Vector2d(evalToVector(disk.getCenter())),
+                     eval(disk.getRadius()));
+  for (auto set : intersection)
+    addHalfPlanes(set, kernel);
+  return kernel;
+}
+
+void AdvFunc::addHalfPlanes(SetExpr::Reader set, DiskPolygon &kernel) {
+  switch (set.which()) {
+  case SetExpr::REFERENCE:
+    addHalfPlanes(referencedSet(set.getReference()), kernel);
+    return;
+  case SetExpr::RECTANGLE: {
+    // min <= x_i <= max, as the half-planes x_i <= max and -x_i <= -min
+    int i = 0;
+    for (auto bpair : set.getRectangle()) {
+      auto val1 = eval(bpair.getBoundA());
+      auto val2 = eval(bpair.getBoundB());
+      Eigen::Vector2d unit = Eigen::Vector2d::Unit(i++);
+      kernel.addHalfPlane(unit, std::max(val1, val2));
+      kernel.addHalfPlane(-unit, -std::min(val1, val2));
+    }
+    return;
+  }
+  case SetExpr::CONVEX_POLYTOPE: {
+    if (auto cached = cachedPolytope(set)) {
+      kernel.addHalfPlanes(cached->A, cached->b);
+      return;
+    }
+    auto poly = set.getConvexPolytope();
+    kernel.addHalfPlanes(evalToMatrix(poly.getA()), evalToVector(poly.getB()));
+    return;
+  }
+  default:
+    return; // (the disk)
+  }
+}
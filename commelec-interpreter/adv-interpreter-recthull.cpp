@@ -35,8 +35,12 @@ Eigen::AlignedBoxXd AdvFunc::rectHull(SetExpr::Reader set)
     return rectHull(set.getBall());
   case SetExpr::RECTANGLE:
     return rectHull(set.getRectangle());
-  case SetExpr::CONVEX_POLYTOPE:
+  case SetExpr::CONVEX_POLYTOPE: {
+    auto cached = cachedPolytope(set);
+    if (cached && cached->bounded)
+      return cached->hull;
     return rectHull(set.getConvexPolytope());
+  }
   case SetExpr::INTERSECTION:
     return rectHull(set.getIntersection());
   //case SetExpr::LIST_OPERATION:
@@ -105,10 +109,18 @@ Eigen::AlignedBoxXd AdvFunc::rectHull(ConvexPolytope::Reader poly) {
 
 Eigen::AlignedBoxXd AdvFunc::rectHull(capnp::List<SetExpr>::Reader intersection)
 {
+    // The intersection of a disk with polygons and rectangles in the plane
+    // (the PQ profiles and beliefs built by the high-level API) has an exact
+    // bounding box in closed form (see disk-polygon.hpp).
+    Ball::Reader disk;
+    if (isDiskPolygon(intersection, disk))
+      return evalDiskPolygon(disk, intersection).boundingBox();
+
     // ConvexPolytope might be itself unbounded, which means that we cannot
     // directly find its bounding box. To find the axis-aligned bounding box of
-    // a convex polytope, we solve 2*dim (= 4 in our 2-dimensional case) linear
-    // programs. (Per dimension, one for the minimum and one for the maximum.)
+    // a convex polytope, we enumerate its vertices in the plane, and solve
+    // 2*dim linear programs otherwise. (Per dimension, one for the minimum and
+    // one for the maximum.)
     //
     // Hence, if 'intersection' contains at least on Polytope, we need to take
     // special care.
@@ -141,9 +153,10 @@ Eigen::AlignedBoxXd AdvFunc::rectHull(capnp::List<SetExpr>::Reader intersection)
     for (auto set : intersection) {
       if (set.which() == SetExpr::CONVEX_POLYTOPE) {
         auto pt = set.getConvexPolytope();
+        auto cached = cachedPolytope(set);
 
-        Eigen::VectorXd b(evalToVector(pt.getB()));
-        Eigen::MatrixXd A(evalToMatrix(pt.getA()));
+        Eigen::VectorXd b(cached ? cached->b : evalToVector(pt.getB()));
+        Eigen::MatrixXd A(cached ? cached->A : evalToMatrix(pt.getA()));
 
         if (firstPoly) {
           Merged_A = A;
@@ -151,10 +164,14 @@ Eigen::AlignedBoxXd AdvFunc::rectHull(capnp::List<SetExpr>::Reader intersection)
           firstPoly = false;
         } else {
           // concatenate Merged_A with A, and Merged_b with b
-          Merged_A.resize(Merged_A.rows() + A.rows(), Merged_A.cols());
-          Merged_A << Merged_A, A;
-          Merged_b.resize(Merged_b.size() + b.size());
-          Merged_b << Merged_b, b;
+          if (A.cols() != Merged_A.cols())
+            throw EvaluationError(
+                "Intersection of polytopes of different dimensions");
+          auto rows = Merged_A.rows();
+          Merged_A.conservativeResize(rows + A.rows(), Eigen::NoChange);
+          Merged_A.bottomRows(A.rows()) = A;
+          Merged_b.conservativeResize(rows + b.size());
+          Merged_b.tail(b.size()) = b;
         }
 
       } else // not a convex polytope
@@ -0,0 +1,212 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <cmath>
+#include <map>
+
+// Partial evaluation
+//
+// specialize compiles an expression with the compiler of
+// adv-interpreter-compile.cpp, while some variables are bound: these
+// variables compile to constants, so that constant folding removes
+// everything that depends only on them. Polynomials are reduced to
+// polynomials in the other variables. The cases of a case distinction are
+// tested at compile time where the evaluation point is bound and the set of
+// the case depends on bound variables only (see dependencies()); the
+// coordinates of the evaluation point that are bound are stored in the
+// program otherwise.
+//
+// Named expressions that depend on bound variables are compiled anew for the
+// specialized expression; other references share the routines of the
+// advertisement.
+//
+// Specialized expressions are appended to the program of the advertisement,
+// which would grow without bound if an expression is specialized anew for
+// every value of the bound variables (and with it the stacks of all
+// executors, see AdvProgram::stackSize). The program is therefore marked
+// before the first specialization, and releaseSpecializations truncates it
+// to the mark.
+
+using namespace msg;
+
+struct Specialization {
+  const ValueMap *values;
+  AdvFunc::VariableMask mask; // (of the bound variables)
+  std::unordered_map<std::string, uint32_t> realExprRefs;
+  std::unordered_map<std::string, uint32_t> setExprRefs;
+};
+
+CompiledExpr AdvFunc::specialize(RealExpr::Reader expr,
+                                 const ValueMap &bound_vars) {
+  assert(_advValid);
+  unshare();
+  if (!_model->specialized) {
+    _model->beforeSpecialization = _model->program.mark();
+    _model->specialized = true;
+  }
+  Specialization specialization;
+  specialization.values = &bound_vars;
+  specialization.mask = 0;
+  for (const auto &var : bound_vars) {
+    auto slot = _model->program.variableSlots.find(var.first);
+    if (slot != _model->program.variableSlots.end() && slot->second < 63)
+      specialization.mask |= variableBit(slot->second);
+    // (bit 63 is shared with unbound variables)
+  }
+
+  CompiledExpr result;
+  _specialization = &specialization;
+  try {
+    result.entry = compileRoutine(expr, 0);
+  } catch (...) {
+    _specialization = nullptr;
+    throw;
+  }
+  _specialization = nullptr;
+  return result;
+}
+
+void AdvFunc::releaseSpecializations() {
+  assert(_advValid);
+  if (!_model->specialized)
+    return;
+  unshare();
+  _model->program.truncate(_model->beforeSpecialization);
+  _model->specialized = false;
+}
+
+bool AdvFunc::specializedValue(const std::string &var, double &value) const {
+  auto bound = _specialization->values->find(var);
+  if (bound == _specialization->values->end())
+    return false;
+  value = bound->second;
+  return true;
+}
+
+std::unordered_map<std::string, uint32_t> &
+AdvFunc::compiledRefs(const kj::StringPtr ref, bool set) {
+  if (_specialization) {
+    VariableMask mask = 0;
+    if (set) {
+      auto named = _model->setExprRefs.find(ref);
+      if (named != _model->setExprRefs.end())
+        mask = dependencies(named->second);
+    } else {
+      auto named = _model->realExprRefs.find(ref);
+      if (named != _model->realExprRefs.end())
+        mask = dependencies(named->second);
+    }
+    if (mask & _specialization->mask)
+      return set ? _specialization->setExprRefs : _specialization->realExprRefs;
+  }
+  return set ? _model->program.setExprRefs : _model->program.realExprRefs;
+}
+
+bool AdvFunc::specializePolynomial(const PolynomialData &poly,
+                                   RoutineBuilder &routine) {
+  // Substitutes the bound variables; the monomials that then have the same
+  // exponents are merged. Returns false if no variable of the polynomial is
+  // bound.
+  auto sz = poly.variables.size();
+  std::vector<double> values(sz);
+  std::vector<char> bound(sz);
+  std::vector<uint32_t> remaining;
+  for (size_t var = 0; var < sz; ++var) {
+    bound[var] =
+        specializedValue(_model->program.variables[poly.variables[var]], values[var]);
+    if (!bound[var])
+      remaining.push_back(var);
+  }
+  if (remaining.size() == sz)
+    return false;
+
+  std::map<std::vector<uint32_t>, double> monomials;
+  std::vector<uint32_t> exponents(remaining.size());
+  for (uint32_t t = 0; t < poly.terms; ++t) {
+    const uint32_t *exponent = poly.exponents.data() + t * sz;
+    double coeff = _model->program.constants[poly.firstCoeff + t];
+    for (size_t var = 0; var < sz; ++var)
+      if (bound[var] && exponent[var] > 0)
+        coeff *= std::pow(values[var], double(exponent[var]));
+    for (size_t i = 0; i < remaining.size(); ++i)
+      exponents[i] = exponent[remaining[i]];
+    monomials[exponents] += coeff;
+  }
+
+  if (remaining.empty()) {
+    emitConstant(monomials.empty() ? 0.0 : monomials.begin()->second, routine);
+    return true;
+  }
+
+  PolynomialData residual;
+  std::vector<uint32_t> maxExponent(remaining.size(), 0);
+  for (auto var : remaining)
+    residual.variables.push_back(poly.variables[var]);
+  residual.firstCoeff = _model->program.constants.size();
+  for (const auto &monomial : monomials) {
+    for (size_t i = 0; i < remaining.size(); ++i) {
+      residual.exponents.push_back(monomial.first[i]);
+      maxExponent[i] = std::max(maxExponent[i], monomial.first[i]);
+    }
+    _model->program.constants.push_back(monomial.second);
+    ++residual.terms;
+  }
+  residual.powerIndex.push_back(0);
+  for (size_t i = 0; i < remaining.size(); ++i)
+    residual.powerIndex.push_back(residual.powerIndex.back() + maxExponent[i] + 1);
+  _model->program.polynomials.push_back(std::move(residual));
+  routine.emit(OpCode::Polynomial, _model->program.polynomials.size() - 1, 1);
+  return true;
+}
+
+void AdvFunc::compileSpecializedCases(
+    CaseDistinction<RealExpr>::Reader casedist, RoutineBuilder &routine,
+    int depth) {
+  CaseDistinctionData data;
+  auto variables = casedist.getVariables();
+  Eigen::VectorXd point(variables.size());
+  bool pointBound = true;
+  for (size_t i = 0; i < variables.size(); ++i) {
+    data.variables.push_back(variableSlot(variables[i]));
+    if (specializedValue(variables[i], point(i))) {
+      _model->program.constants.push_back(point(i));
+      data.fixed.push_back(_model->program.constants.size() - 1);
+    } else {
+      data.fixed.push_back(uint32_t(CaseDistinctionData::notFixed));
+      pointBound = false;
+    }
+  }
+
+  for (auto re_case : casedist.getCases()) {
+    auto set = re_case.getSet();
+    int member = -1; // (not known at compile time)
+    if (pointBound && (dependencies(set) & ~_specialization->mask) == 0) {
+      try {
+        beginEvaluation(*_specialization->values);
+        member = membership(set, point) ? 1 : 0;
+      } catch (const std::exception &) {
+        // the set is tested when (and if) the expression is evaluated
+      }
+    }
+    if (member == 0)
+      continue;
+    if (member == 1 && data.sets.empty()) {
+      // the first case that may apply does apply
+      compileExpr(re_case.getExpression(), routine, depth);
+      return;
+    }
+    data.sets.push_back(compileSet(set, depth));
+    data.routines.push_back(compileRoutine(re_case.getExpression(), depth));
+    if (member == 1)
+      break; // (the later cases never apply)
+  }
+
+  if (data.sets.empty()) {
+    routine.emit(OpCode::Throw,
+                 compileDiagnostic(Diagnostic::Kind::EvaluationError,
+                                   "Unhandled case in CaseDistinction"),
+                 1);
+    return;
+  }
+  int dim = data.variables.size();
+  _model->program.cases.push_back(std::move(data));
+  routine.emit(OpCode::CaseDistinction, _model->program.cases.size() - 1, 1, dim);
+}
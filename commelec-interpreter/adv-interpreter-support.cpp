@@ -0,0 +1,410 @@
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <commelec-interpreter/boundingbox-convexpolygon.hpp>
+#include <eigen3/Eigen/QR>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+// Support functions and the GJK algorithm
+//
+// The GJK algorithm (Gilbert, Johnson, Keerthi - A fast procedure for
+// computing the distance between complex objects in three-dimensional space,
+// IEEE Journal on Robotics and Automation 4 (1988) p. 193-203) computes the
+// point of the Minkowski difference A - B nearest to the origin. It maintains
+// a simplex of support points of A - B and the point v of the simplex nearest
+// to the origin, and adds the support point in the direction -v until that
+// point does not get nearer to the origin than v (up to a relative
+// tolerance). The nearest point of a simplex is found by trying the faces
+// that contain the newest vertex, which is cheap in the few dimensions of
+// the PQ plane and of three-phase setpoints.
+
+using namespace msg;
+
+namespace {
+
+const int GJK_MAX_ITERATIONS = 1000;
+const double GJK_TOLERANCE = 1e-10;
+// (relative; the distance is found to within this fraction of itself)
+
+struct SimplexVertex {
+  Eigen::VectorXd w; // w = a - b
+  Eigen::VectorXd a;
+  Eigen::VectorXd b;
+};
+
+using SupportMap = std::function<AdvFunc::Support(const Eigen::VectorXd &)>;
+
+void nearestOnSimplex(std::vector<SimplexVertex> &simplex, Eigen::VectorXd &v,
+                      Eigen::VectorXd &a, Eigen::VectorXd &b) {
+  // Reduces the simplex to the face whose relative interior contains the
+  // point v nearest to the origin, and computes v and the corresponding
+  // points of A and B. The newest vertex (the last one) belongs to that face.
+  auto newest = simplex.size() - 1;
+  const auto &w0 = simplex[newest].w;
+  double best = std::numeric_limits<double>::infinity();
+  unsigned bestFace = 0;
+  Eigen::VectorXd bestWeights;
+
+  for (unsigned face = 0; face < (1u << newest); ++face) {
+    std::vector<size_t> others;
+    for (size_t i = 0; i < newest; ++i)
+      if (face & (1u << i))
+        others.push_back(i);
+
+    // v = w0 + E mu, with mu minimizing |v|
+    auto n = others.size();
+    Eigen::MatrixXd E(w0.size(), n);
+    for (size_t j = 0; j < n; ++j)
+      E.col(j) = simplex[others[j]].w - w0;
+    Eigen::VectorXd mu = Eigen::VectorXd::Zero(n);
+    if (n > 0) {
+      auto qr = (E.transpose() * E).colPivHouseholderQr();
+      if (qr.rank() < Eigen::DenseIndex(n))
+        continue; // (a degenerate face)
+      mu = qr.solve(-E.transpose() * w0);
+    }
+    if ((mu.array() <= 0).any() || mu.sum() >= 1)
+      continue; // (v does not lie in the relative interior of the face)
+
+    double norm = (w0 + E * mu).squaredNorm();
+    if (norm < best) {
+      best = norm;
+      bestFace = face;
+      bestWeights = mu;
+    }
+  }
+
+  std::vector<SimplexVertex> reduced;
+  v = simplex[newest].w;
+  a = simplex[newest].a;
+  b = simplex[newest].b;
+  size_t j = 0;
+  for (size_t i = 0; i < newest; ++i)
+    if (bestFace & (1u << i)) {
+      double weight = bestWeights(j++);
+      v += weight * (simplex[i].w - simplex[newest].w);
+      a += weight * (simplex[i].a - simplex[newest].a);
+      b += weight * (simplex[i].b - simplex[newest].b);
+      reduced.push_back(std::move(simplex[i]));
+    }
+  reduced.push_back(std::move(simplex[newest]));
+  simplex = std::move(reduced);
+}
+
+double gjk(const SupportMap &supportA, const SupportMap &supportB, size_t dim,
+           Eigen::VectorXd &nearestA, Eigen::VectorXd &nearestB) {
+  auto vertex = [&](const Eigen::VectorXd &d) {
+    SimplexVertex s;
+    s.a = supportA(d).point;
+    s.b = supportB(-d).point;
+    s.w = s.a - s.b;
+    return s;
+  };
+
+  std::vector<SimplexVertex> simplex{vertex(Eigen::VectorXd::Unit(dim, 0))};
+  Eigen::VectorXd v = simplex[0].w;
+  nearestA = simplex[0].a;
+  nearestB = simplex[0].b;
+  double scale = 1 + simplex[0].w.norm();
+
+  for (int iter = 0; iter < GJK_MAX_ITERATIONS; ++iter) {
+    double vv = v.squaredNorm();
+    if (vv <= std::pow(GJK_TOLERANCE * scale, 2))
+      return 0; // (the origin lies in A - B: the sets overlap)
+
+    auto s = vertex(-v);
+    scale = std::max(scale, 1 + s.w.norm());
+    if (vv - v.dot(s.w) <= GJK_TOLERANCE * vv)
+      return v.norm();
+    for (const auto &known : simplex)
+      if ((known.w - s.w).norm() <= GJK_TOLERANCE * scale)
+        return v.norm(); // (no progress)
+
+    simplex.push_back(std::move(s));
+    nearestOnSimplex(simplex, v, nearestA, nearestB);
+    if (simplex.size() > dim)
+      return 0; // (a full-dimensional simplex around the origin)
+  }
+  throw NoConvergence("The GJK algorithm did not converge.");
+}
+
+AdvFunc::Support lpSupport(SeidelLP &lp, const Eigen::VectorXd &direction) {
+  Eigen::VectorXd x;
+  switch (lp.minimize(-direction, x)) {
+  case SeidelLP::Status::Infeasible:
+    throw EvaluationError("Support of an empty set.");
+  case SeidelLP::Status::Unbounded:
+    throw EvaluationError("Support of an unbounded set.");
+  default:
+    return AdvFunc::Support{x, direction.dot(x)};
+  }
+}
+
+AdvFunc::Support polytopeSupport(const Eigen::MatrixXd &A,
+                                 const Eigen::VectorXd &b,
+                                 const Eigen::VectorXd &direction) {
+  SeidelLP lp(A.cols());
+  lp.reserve(A.rows());
+  lp.addConstraints(A, b);
+  return lpSupport(lp, direction);
+}
+
+AdvFunc::Support vertexSupport(const Vertices &vertices,
+                               const Eigen::VectorXd &direction) {
+  AdvFunc::Support result{vertices[0], direction.dot(vertices[0])};
+  for (const auto &x : vertices)
+    if (direction.dot(x) > result.value)
+      result = AdvFunc::Support{x, direction.dot(x)};
+  return result;
+}
+
+} // namespace
+
+AdvFunc::Support AdvFunc::support(SetExpr::Reader set,
+                                  const Eigen::VectorXd &direction,
+                                  const ValueMap &bound_vars) {
+  assert(_advValid);
+  beginEvaluation(bound_vars);
+  return support(set, direction);
+}
+
+double AdvFunc::distance(SetExpr::Reader a, SetExpr::Reader b,
+                         const ValueMap &bound_vars, Eigen::VectorXd *nearestA,
+                         Eigen::VectorXd *nearestB) {
+  assert(_advValid);
+  beginEvaluation(bound_vars);
+  auto supportA = [&](const Eigen::VectorXd &d) {
+    _nesting_depth = 0;
+    return support(a, d);
+  };
+  auto supportB = [&](const Eigen::VectorXd &d) {
+    _nesting_depth = 0;
+    return support(b, d);
+  };
+  auto dim = dimension(a);
+  if (dim == 0 || dim != dimension(b))
+    throw EvaluationError("Distance between sets of different dimensions");
+
+  Eigen::VectorXd x, y;
+  double result = gjk(supportA, supportB, dim, x, y);
+  if (nearestA)
+    *nearestA = x;
+  if (nearestB)
+    *nearestB = y;
+  return result;
+}
+
+Eigen::VectorXd AdvFunc::closestPoint(SetExpr::Reader set,
+                                      const Eigen::VectorXd &point,
+                                      const ValueMap &bound_vars) {
+  assert(_advValid);
+  beginEvaluation(bound_vars);
+  if (membership(set, point))
+    return point;
+
+  auto supportSet = [&](const Eigen::VectorXd &d) {
+    _nesting_depth = 0;
+    return support(set, d);
+  };
+  auto supportPoint = [&](const Eigen::VectorXd &d) {
+    return Support{point, d.dot(point)};
+  };
+  Eigen::VectorXd x, y;
+  gjk(supportSet, supportPoint, point.size(), x, y);
+  return x;
+}
+
+AdvFunc::Support AdvFunc::support(SetExpr::Reader set,
+                                  const Eigen::VectorXd &direction) {
+  if (++_nesting_depth > MAX_NESTING_DEPTH) {
+    throw EvaluationError("max nesting depth reached");
+  }
+
+  switch (set.which()) {
+  case SetExpr::SINGLETON: {
+    Eigen::VectorXd x = evalToVector(set.getSingleton());
+    return Support{x, direction.dot(x)};
+  }
+  case SetExpr::BALL: {
+    auto ball = set.getBall();
+    Eigen::VectorXd center = evalToVector(ball.getCenter());
+    double r = std::abs(eval(ball.getRadius()));
+    // (as for membership, only the square of the radius counts)
+    double norm = direction.norm();
+    if (norm == 0)
+      return Support{center, 0};
+    return Support{center + r / norm * direction,
+                   direction.dot(center) + r * norm};
+  }
+  case SetExpr::RECTANGLE: {
+    auto rect = set.getRectangle();
+    Eigen::VectorXd x(rect.size());
+    int i = 0;
+    for (auto bpair : rect) {
+      auto val1 = eval(bpair.getBoundA());
+      auto val2 = eval(bpair.getBoundB());
+      x(i) = (direction(i) >= 0) ? std::max(val1, val2) : std::min(val1, val2);
+      ++i;
+    }
+    return Support{x, direction.dot(x)};
+  }
+  case SetExpr::CONVEX_POLYTOPE: {
+    if (auto cached = cachedPolytope(set)) {
+      if (cached->bounded && !cached->vertices.empty())
+        return vertexSupport(cached->vertices, direction);
+      return polytopeSupport(cached->A, cached->b, direction);
+    }
+    auto poly = set.getConvexPolytope();
+    Eigen::MatrixXd A(evalToMatrix(poly.getA()));
+    Eigen::VectorXd b(evalToVector(poly.getB()));
+    if (A.cols() == 2) {
+      Vertices vertices;
+      switch (convexPolygonVertices(A, b, vertices)) {
+      case PolygonStatus::Empty:
+        throw EvaluationError("Support of an empty set.");
+      case PolygonStatus::Unbounded:
+        throw EvaluationError("Support of an unbounded set.");
+      default:
+        return vertexSupport(vertices, direction);
+      }
+    }
+    return polytopeSupport(A, b, direction);
+  }
+  case SetExpr::INTERSECTION:
+    return support(set.getIntersection(), direction);
+  case SetExpr::REFERENCE:
+    return support(referencedSet(set.getReference()), direction);
+  default:
+    boost::format msg;
+    KJ_IF_MAYBE(fieldname, getUnionFieldName(set)) {
+      msg = boost::format("AdvFunc::support [.which()=%1%,%2%]") %
+            int(set.which()) % fieldname;
+    }
+    else {
+      msg = boost::format("AdvFunc::support [.which()=%1%]") %
+            int(set.which());
+    }
+    throw WhichError(set.which(), msg.str());
+  }
+}
+
+AdvFunc::Support
+AdvFunc::support(capnp::List<SetExpr>::Reader intersection,
+                 const Eigen::VectorXd &direction) {
+  // an intersection with a singleton is that singleton (or empty)
+  for (auto set : intersection) {
+    if (set.which() == SetExpr::REFERENCE)
+      set = referencedSet(set.getReference());
+    if (set.which() == SetExpr::SINGLETON) {
+      Eigen::VectorXd x = evalToVector(set.getSingleton());
+      if (!membership(intersection, x))
+        throw EvaluationError("Support of an empty set.");
+      return Support{x, direction.dot(x)};
+    }
+  }
+
+  // polytopes and rectangles: a single LP over all their constraints
+  SeidelLP lp(direction.size());
+  bool polyhedral = true;
+  for (auto set : intersection)
+    polyhedral = polyhedral && addConstraints(set, lp);
+  if (polyhedral)
+    return lpSupport(lp, direction);
+
+  // a disk with polygons and rectangles, in the plane: from the vertices
+  Ball::Reader disk;
+  if (direction.size() == 2 && isDiskPolygon(intersection, disk)) {
+    Eigen::Vector2d x;
+    if (!evalDiskPolygon(disk, intersection).support(direction, x))
+      throw EvaluationError("Support of an empty set.");
+    return Support{x, direction.dot(x)};
+  }
+
+  // otherwise, by projected ascent: x <- proj(x + t d), whose fixed points are
+  // the support points, with a step t of the order of the size of the set
+  auto depth = _nesting_depth;
+  auto hull = rectHull(intersection);
+  double norm = direction.norm();
+  double size = hull.diagonal().norm();
+  Eigen::VectorXd x = proj(intersection, Eigen::VectorXd(hull.center()));
+  _nesting_depth = depth;
+  if (norm == 0)
+    return Support{x, 0};
+  double step = std::max(size, 1e-9) / norm;
+  for (int iter = 0; iter < 100; ++iter) {
+    Eigen::VectorXd next = proj(intersection, Eigen::VectorXd(x + step * direction));
+    _nesting_depth = depth;
+    // (every projection counts as a nesting level)
+    bool done = direction.dot(next - x) <= 1e-9 * norm * std::max(size, 1.0);
+    x = next;
+    if (done)
+      break;
+  }
+  return Support{x, direction.dot(x)};
+}
+
+size_t AdvFunc::dimension(SetExpr::Reader set) {
+  switch (set.which()) {
+  case SetExpr::SINGLETON:
+    return set.getSingleton().size();
+  case SetExpr::BALL:
+    return set.getBall().getCenter().size();
+  case SetExpr::RECTANGLE:
+    return set.getRectangle().size();
+  case SetExpr::CONVEX_POLYTOPE: {
+    auto A = set.getConvexPolytope().getA();
+    return (A.size() > 0) ? A[0].size() : 0;
+  }
+  case SetExpr::INTERSECTION: {
+    auto intersection = set.getIntersection();
+    return (intersection.size() > 0) ? dimension(intersection[0]) : 0;
+  }
+  case SetExpr::REFERENCE:
+    return dimension(referencedSet(set.getReference()));
+  default:
+    throw WhichError(set.which(), "AdvFunc::dimension");
+  }
+}
+
+bool AdvFunc::addConstraints(SetExpr::Reader set, SeidelLP &lp) {
+  switch (set.which()) {
+  case SetExpr::REFERENCE:
+    return addConstraints(referencedSet(set.getReference()), lp);
+  case SetExpr::RECTANGLE: {
+    auto rect = set.getRectangle();
+    if (int(rect.size()) != lp.dim())
+      throw EvaluationError("Support: the dimensions of the sets differ");
+    int i = 0;
+    for (auto bpair : rect) {
+      auto val1 = eval(bpair.getBoundA());
+      auto val2 = eval(bpair.getBoundB());
+      Eigen::VectorXd unit = Eigen::VectorXd::Unit(lp.dim(), i++);
+      lp.addConstraint(unit, std::max(val1, val2));
+      lp.addConstraint(-unit, -std::min(val1, val2));
+    }
+    return true;
+  }
+  case SetExpr::CONVEX_POLYTOPE: {
+    if (auto cached = cachedPolytope(set)) {
+      if (cached->A.cols() != lp.dim())
+        throw EvaluationError("Support: the dimensions of the sets differ");
+      lp.addConstraints(cached->A, cached->b);
+      return true;
+    }
+    auto poly = set.getConvexPolytope();
+    Eigen::MatrixXd A(evalToMatrix(poly.getA()));
+    Eigen::VectorXd b(evalToVector(poly.getB()));
+    if (A.cols() != lp.dim())
+      throw EvaluationError("Support: the dimensions of the sets differ");
+    lp.addConstraints(A, b);
+    return true;
+  }
+  case SetExpr::INTERSECTION:
+    for (auto child_set : set.getIntersection())
+      if (!addConstraints(child_set, lp))
+        return false;
+    return true;
+  default:
+    return false;
+  }
+}
@@ -1,12 +1,82 @@
 #include <commelec-interpreter/adv-interpreter.hpp>
+#include <commelec-interpreter/adv-structure.hpp>
 #include <commelec-api/mathfunctions.hpp>
 
 using namespace msg;
 
-AdvFunc::AdvFunc(Advertisement::Reader adv) : _adv(adv), _advValid(true) 
+AdvFunc::AdvFunc(Advertisement::Reader adv, bool parametric)
+    : _model(std::make_shared<AdvModel>()), _advValid(true), _caching(false),
+      _specialization(nullptr), _literals(nullptr),
+      _polytopes(nullptr)
 {
+  _model->adv = adv;
+  _model->parametric = parametric;
   findReferences();
-  // populates _real_expr_refs and _set_expr_refs
+  // populates _model->realExprRefs and _model->setExprRefs
+  linkReferences();
+  compileAdvertisement();
+  analyzeDependencies();
+}
+
+AdvFunc::AdvFunc(std::shared_ptr<const AdvModel> model)
+    : _model(std::const_pointer_cast<AdvModel>(model)), _advValid(true),
+      _caching(false), _specialization(nullptr), _literals(nullptr),
+      _polytopes(nullptr)
+{
+  // (the model is copied before it is modified; see unshare)
+  auto refs = _model->namedRealExprs.size();
+  _ref_values.resize(refs);
+  _ref_partials.resize(refs);
+  _ref_value_known.assign(refs, 0);
+  _ref_partial_known.assign(refs, 0);
+}
+
+AdvFunc AdvFunc::context() const
+{
+  assert(_advValid);
+  return AdvFunc(std::shared_ptr<const AdvModel>(_model));
+}
+
+void AdvFunc::unshare()
+{
+  if (_model.use_count() > 1)
+    _model = std::make_shared<AdvModel>(*_model);
+}
+
+void AdvFunc::rebind(Advertisement::Reader adv, const AdvStructure &structure)
+{
+  assert(_advValid && _model->parametric);
+  auto model = std::make_shared<AdvModel>();
+  model->adv = adv;
+  model->parametric = true;
+  model->program = _model->program;
+  if (_model->specialized)
+    model->program.truncate(_model->beforeSpecialization);
+  // (specialized expressions have the old literals folded into them)
+  model->costFunction = _model->costFunction;
+  model->pqProfile = _model->pqProfile;
+  model->beliefFunction = _model->beliefFunction;
+  model->bindings = _model->bindings;
+  model->polytopes = _model->polytopes;
+  for (const auto &binding : model->bindings) {
+    if (binding.second >= structure.literals.size())
+      throw EvaluationError("AdvFunc::rebind: the advertisement has another "
+                            "structure");
+    model->program.constants[binding.first] = structure.literals[binding.second];
+  }
+  for (const auto &polytope : model->polytopes)
+    if (polytope.second >= structure.polytopes.size())
+      throw EvaluationError("AdvFunc::rebind: the advertisement has another "
+                            "structure");
+
+  _model = model;
+  for (const auto &polytope : _model->polytopes)
+    cachePolytope(structure.polytopes[polytope.second],
+                  _model->program.sets[polytope.first]);
+  // (with the new constants, keyed by the addresses in adv)
+  findReferences();
+  linkReferences();
+  analyzeDependencies();
 }
 
 Eigen::VectorXd AdvFunc::evalToVector(capnp::List<RealExpr>::Reader list){
@@ -44,9 +114,19 @@ Eigen::MatrixXd AdvFunc::evalToMatrix(capnp::List<capnp::List<RealExpr>>::Reader
 
 Eigen::AlignedBoxXd AdvFunc::rectangularHull(SetExpr::Reader set, const ValueMap &bound_vars){
   assert(_advValid);
-  _bound_vars = &bound_vars;
-  _nesting_depth = 0;
-  return rectHull(set);
+  beginEvaluation(bound_vars);
+
+  // the hull of a set of the advertisement that does not depend on the
+  // variables is computed once
+  auto label = _model->dependencies.find(address(set));
+  if (label == _model->dependencies.end() || label->second != 0)
+    return rectHull(set);
+  auto cached = _hulls.find(label->first);
+  if (cached != _hulls.end())
+    return cached->second;
+  auto hull = rectHull(set);
+  _hulls[label->first] = hull;
+  return hull;
 }
 
 
@@ -54,16 +134,16 @@ void AdvFunc::findReferences()
 {
   _nesting_depth=0;
 
-  if (_adv.hasPQProfile()){
-    findReferences(_adv.getPQProfile());
+  if (_model->adv.hasPQProfile()){
+    findReferences(_model->adv.getPQProfile());
     _nesting_depth=0;
   }
-  if (_adv.hasBeliefFunction()){
-    findReferences(_adv.getBeliefFunction());
+  if (_model->adv.hasBeliefFunction()){
+    findReferences(_model->adv.getBeliefFunction());
     _nesting_depth=0;
   }
-  if (_adv.hasCostFunction()){
-    findReferences(_adv.getCostFunction());
+  if (_model->adv.hasCostFunction()){
+    findReferences(_model->adv.getCostFunction());
     _nesting_depth=0;
   }
 }
@@ -75,7 +155,7 @@ void AdvFunc::findReferences(RealExpr::Reader expr) {
   }
 
   if (expr.hasName()) {
-    _real_expr_refs[expr.getName()] = expr;
+    _model->realExprRefs[expr.getName()] = expr;
   }
 
   // traverse children
@@ -113,7 +193,7 @@ void AdvFunc::findReferences(SetExpr::Reader set) {
   }
 
   if (set.hasName())
-    _set_expr_refs[set.getName()] = set;
+    _model->setExprRefs[set.getName()] = set;
 
   auto type = set.which();
   switch (type) {
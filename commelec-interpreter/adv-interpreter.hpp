@@ -3,11 +3,14 @@
 
 #include <commelec-api/schema.capnp.h>
 #include <capnp/message.h>
+#include <capnp/any.h>
 #include <kj/string.h>
 
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <unordered_map>
+#include <memory>
 #include <stdexcept>
 #include <cassert>
 #include <iostream>
@@ -18,6 +21,10 @@
 
 #include <boost/format.hpp>
 
+#include <commelec-interpreter/adv-program.hpp>
+#include <commelec-interpreter/projection-convexpolygon.hpp>
+#include <commelec-interpreter/disk-polygon.hpp>
+
 #ifndef NO_CAPNP_REFLECTION      
 #include <capnp/dynamic.h> // only for error messaging purpose
 // can be disabled if necessary (e.g., for Windows builds, where Cap'n Proto
@@ -79,6 +86,75 @@ struct HalfSpace
   double b;
 };
 
+struct PolytopeCache
+{
+  // a convex polytope {x : A x <= b} whose coefficients do not depend on the
+  // variables, evaluated once when the advertisement is set
+  Eigen::MatrixXd A;
+  Eigen::VectorXd b;
+  std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> vertices;
+  // (only for polygons in the plane)
+  bool bounded; // bounded and non-empty polytope, whose hull is known
+  Eigen::AlignedBoxXd hull;
+
+  template <typename Derived>
+  bool contains(const Eigen::MatrixBase<Derived> &point) const {
+    return ((A * point).array() <= b.array()).all();
+  }
+};
+
+struct Interval
+{
+  double lo;
+  double hi;
+};
+
+struct RoutineBuilder;
+struct LinkState;
+class ProjectionSession;
+class SeidelLP;
+struct Specialization;
+struct AdvStructure;
+// helper for compiling a RealExpr into a routine (see adv-interpreter-compile.cpp)
+
+struct AdvModel
+{
+  // The part of an AdvFunc that is derived from its advertisement when the
+  // advertisement is set: the named expressions and the targets of the
+  // references, the compiled program, the constant polytopes and the
+  // dependency labels (see AdvFunc::context)
+  msg::Advertisement::Reader adv;
+  RealExprRefMap realExprRefs;
+  SetExprRefMap setExprRefs;
+  std::vector<msg::RealExpr::Reader> namedRealExprs;
+  std::vector<msg::SetExpr::Reader> namedSetExprs;
+  std::unordered_map<const char *, uint32_t> realExprLinks;
+  std::unordered_map<const char *, uint32_t> setExprLinks;
+  // maps every reference in the advertisement (the address of its text) to the
+  // index of the referenced expression in namedRealExprs or namedSetExprs
+
+  AdvProgram program;
+  std::unordered_map<const void *, PolytopeCache> constantPolytopes;
+  std::unordered_map<const void *, uint64_t> dependencies;
+  // (see AdvFunc::VariableMask)
+  CompiledExpr costFunction;
+  CompiledSet pqProfile;
+  CompiledSet beliefFunction;
+
+  bool parametric = false;
+  std::vector<std::pair<uint32_t, uint32_t>> bindings;
+  // In a parametric model (see AdvFunc::setAdv), the constants of the program
+  // that hold literals of the advertisement, each with the index of its
+  // literal in the AdvStructure of the advertisement (see adv-structure.hpp)
+  bool specialized = false;
+  AdvProgram::Mark beforeSpecialization = AdvProgram::Mark();
+  // the program before the first specialized expression (see
+  // AdvFunc::releaseSpecializations)
+  std::vector<std::pair<uint32_t, uint32_t>> polytopes;
+  // and its convex polytopes: the index of the SetNode, with the index of the
+  // polytope in the AdvStructure (rebind caches them anew)
+};
+
 template <typename T> int sgn(T val) {
 // signum function
     return (T(0) < val) - (val < T(0));
@@ -93,17 +169,54 @@ struct AdvFunc
   // (Attackers might try to send a message with a cycle on purpose, or
   // inexperienced users may accidentally do this)
 
-  AdvFunc(msg::Advertisement::Reader adv);
+  AdvFunc(msg::Advertisement::Reader adv, bool parametric = false);
 
-  AdvFunc(): _advValid(false) {};
+  AdvFunc()
+      : _model(std::make_shared<AdvModel>()), _advValid(false),
+        _caching(false), _specialization(nullptr), _literals(nullptr), _polytopes(nullptr){};
 
-  void setAdv(msg::Advertisement::Reader adv)
+  void setAdv(msg::Advertisement::Reader adv, bool parametric = false)
   {
-    _adv = adv;
+    _model = std::make_shared<AdvModel>();
+    // (other AdvFunc's that shared the previous model keep it)
+    _model->adv = adv;
+    _model->parametric = parametric;
     _advValid = true;
     findReferences();
+    linkReferences();
+    compileAdvertisement();
+    analyzeDependencies();
   };
 
+  // Evaluation contexts
+  //
+  // An AdvFunc consists of its model (see AdvModel), which is only read
+  // during evaluation, and of the state of the calls that are in progress
+  // (the bound variables, the memoized references and the stacks of the
+  // executors). context() returns a new AdvFunc that shares the model, with
+  // state of its own: one AdvFunc per thread can then evaluate, project and
+  // hull the same advertisement concurrently, without locks and without
+  // copies of the model; the model also outlives the AdvFunc it came from, and
+  // AdvFunc(model) creates another context. A single AdvFunc must not be used
+  // by several threads at once. compile() and specialize() extend the model;
+  // on a shared model, they first make a copy of it for this AdvFunc.
+  AdvFunc context() const;
+  // In parametric mode, the compiler folds no constants: every constant of
+  // the program that stems from a literal of the advertisement is listed in
+  // AdvModel::bindings, so that the program also evaluates advertisements of
+  // the same structure, once the constants are replaced by their literals
+  // (see evaluateBatch below).
+  void rebind(msg::Advertisement::Reader adv, const AdvStructure &structure);
+  // For a parametric model: sets an advertisement of the same structure (of
+  // which structure is the AdvStructure), in a new model. The compiled program
+  // is kept, with the bound constants replaced by the literals of adv; only
+  // the reference maps, links and dependency labels, which point into the
+  // message, are built anew. Specialized expressions are dropped (see
+  // releaseSpecializations), since the old literals are folded into them.
+  // Other AdvFunc's keep the previous model.
+  std::shared_ptr<const AdvModel> model() const { return _model; }
+  explicit AdvFunc(std::shared_ptr<const AdvModel> model);
+
   // Top-level user functions:
   bool testMembership(msg::SetExpr::Reader set, PointTypePP point, const ValueMap &bound_vars);
   double evaluate(msg::RealExpr::Reader, const ValueMap &bound_vars);
@@ -114,8 +227,7 @@ struct AdvFunc
                           const Eigen::MatrixBase<Derived> &point,
                           const ValueMap &bound_vars) {
     assert(_advValid);
-    _bound_vars = &bound_vars;
-    _nesting_depth = 0;
+    beginEvaluation(bound_vars);
     return proj(set, point);
   }
   /*
@@ -135,9 +247,179 @@ struct AdvFunc
 
 
   Eigen::AlignedBoxXd rectangularHull(msg::SetExpr::Reader set, const ValueMap &bound_vars);
+  Boundary boundary(msg::SetExpr::Reader set, const ValueMap &bound_vars);
+  // Boundary of a disk in the PQ plane, or of the intersection of a disk with
+  // convex polygons and rectangles (see disk-polygon.hpp). Throws a
+  // WhichError for other sets.
   double evalPartialDerivative(msg::RealExpr::Reader expr,std::string diffVariable, const ValueMap &bound_vars); 
 
+  // Compiled evaluation (see adv-program.hpp)
+  //
+  // The cost function, PQ profile and belief function are compiled when the
+  // advertisement is set. Other expressions (for example, the bounds of a
+  // rectangle) can be compiled with compile(). A compiled expression is
+  // evaluated without walking the Cap'n Proto message.
+  CompiledExpr compile(msg::RealExpr::Reader expr);
+  CompiledSet compile(msg::SetExpr::Reader set);
+  CompiledExpr costFunction() const { return _model->costFunction; }
+  CompiledSet pqProfile() const { return _model->pqProfile; }
+  CompiledSet beliefFunction() const { return _model->beliefFunction; }
+
+  double evaluate(CompiledExpr expr, const ValueMap &bound_vars);
+  bool testMembership(CompiledSet set, PointTypePP point, const ValueMap &bound_vars);
+
+  // Variable slots
+  //
+  // The variables that occur in the compiled expressions are numbered when
+  // they are compiled; "P" and "Q" always occupy slots 0 and 1. Instead of a
+  // ValueMap, the values of the variables can be passed as an array indexed by
+  // slot, which avoids looking up the variables by name. Slots beyond the
+  // length of the array are unbound.
+  static const uint32_t P_SLOT = 0;
+  static const uint32_t Q_SLOT = 1;
+  const std::vector<std::string> &variables() const {
+    return _model->program.variables;
+  }
+  int slotOf(const std::string &var) const;
+  // returns -1 if the variable does not occur in the compiled expressions
+
+  double evaluate(CompiledExpr expr, const double *values, size_t num_values);
+  double evaluate(CompiledExpr expr, const Eigen::Vector2d &PQ) {
+    return evaluate(expr, PQ.data(), 2);
+  }
+  bool testMembership(CompiledSet set, const double *point, size_t dim,
+                      const double *values, size_t num_values);
+  bool testMembership(CompiledSet set, const Eigen::Vector2d &point,
+                      const Eigen::Vector2d &PQ) {
+    return testMembership(set, point.data(), 2, PQ.data(), 2);
+  }
+
+  // Batch evaluation (see adv-interpreter-batch.cpp)
+  //
+  // Evaluates a compiled expression on n points at once: out[i] is the value
+  // for P = P[i] and Q = Q[i]. The points are processed in blocks of
+  // BATCH_BLOCK, and every instruction is executed on a whole block.
+  // Alternatively, values[s] points to the n values of the variable in slot s.
+  static const size_t BATCH_BLOCK = 64;
+  void evaluateBatch(CompiledExpr expr, const double *P, const double *Q,
+                     size_t n, double *out);
+  void evaluateBatch(CompiledExpr expr, const double *const *values,
+                     size_t num_values, size_t n, double *out);
+  void testMembershipBatch(CompiledSet set, const double *P, const double *Q,
+                           size_t n, bool *out);
+  // tests membership of the points (P[i],Q[i]), where the variables P and Q
+  // are bound to the same values
+  void evaluateBatch(CompiledExpr expr, const double *const *values,
+                     size_t num_values, const double *const *constants,
+                     size_t n, double *out);
+  void testMembershipBatch(CompiledSet set, const double *P, const double *Q,
+                           const double *const *constants, size_t n, bool *out);
+  // as above, where every point also has constants of its own: constant c of
+  // the program is constants[c][i] for the i-th point, or the constant itself
+  // if constants[c] is nullptr (constants has one entry per constant of the
+  // program). With the literals of advertisements of the same structure as
+  // the constants of a parametric program, the lanes are advertisements.
+
+  // Derivatives (see adv-interpreter-ad.cpp)
+  //
+  // Forward-mode automatic differentiation of a compiled expression: returns
+  // the value and stores in gradient[i] the partial derivative with respect
+  // to the variable in slot i, for i < num_values, computed in a single pass.
+  double evaluateWithGradient(CompiledExpr expr, const double *values,
+                              size_t num_values, double *gradient);
+  double evaluateWithGradient(CompiledExpr expr, const Eigen::Vector2d &PQ,
+                              Eigen::Vector2d &gradient) {
+    return evaluateWithGradient(expr, PQ.data(), 2, gradient.data());
+  }
+
+  double evaluateWithHessian(CompiledExpr expr, const double *values,
+                             size_t num_values, double *gradient,
+                             double *hessian);
+  double evaluateWithHessian(CompiledExpr expr, const Eigen::Vector2d &PQ,
+                             Eigen::Vector2d &gradient,
+                             Eigen::Matrix2d &hessian) {
+    return evaluateWithHessian(expr, PQ.data(), 2, gradient.data(),
+                               hessian.data());
+  }
+  // as evaluateWithGradient, and stores the (symmetric) matrix of second
+  // partial derivatives in hessian[i * num_values + j]
+
+  // Interval evaluation (see adv-interpreter-interval.cpp)
+  //
+  // Returns bounds on the values of a compiled expression over a box: the
+  // variable in slot i ranges over [box.min()(i), box.max()(i)], for
+  // i < box.dim(). The returned interval contains the value of the expression
+  // at every point of the box.
+  Eigen::AlignedBox1d evaluateInterval(CompiledExpr expr,
+                                       const Eigen::AlignedBoxXd &box);
+
+  // Variable dependencies (see adv-interpreter-deps.cpp)
+  //
+  // When the advertisement is set, every RealExpr and SetExpr in it is
+  // labelled with the variables it depends on: those that occur in it, in
+  // the expressions it references, and in the evaluation points of its case
+  // distinctions. The variables are given as a bit mask over their slots (bit
+  // s for slot s; variables in slots from 63 on, or that do not occur in the
+  // advertisement, share bit 63). Expressions that are not part of the
+  // advertisement are analyzed on demand.
+  using VariableMask = uint64_t;
+  static VariableMask variableBit(uint32_t slot) {
+    return VariableMask(1) << std::min(slot, uint32_t(63));
+  }
+  VariableMask dependencies(msg::RealExpr::Reader expr);
+  VariableMask dependencies(msg::SetExpr::Reader set);
+  bool isConstant(msg::RealExpr::Reader expr) { return dependencies(expr) == 0; }
+  bool isConstant(msg::SetExpr::Reader set) { return dependencies(set) == 0; }
+
+  // Partial evaluation (see adv-interpreter-specialize.cpp)
+  //
+  // Compiles an expression with some of its variables bound to the given
+  // values: everything that depends on these variables only is folded into
+  // constants, polynomials become polynomials in the other variables, and
+  // case distinctions on bound variables are resolved at compile time where
+  // possible. The residual expression is evaluated like any compiled
+  // expression, binding the other variables only. (Like compile(), every
+  // call extends the program, and so the stack of every executor.)
+  CompiledExpr specialize(msg::RealExpr::Reader expr, const ValueMap &bound_vars);
+  void releaseSpecializations();
+  // Discards the specialized expressions, and everything compiled after the
+  // first of them (also by compile()); their handles become invalid. Call it
+  // before specializing anew, for example when the bound values change.
+
+  // Support functions and distances (see adv-interpreter-support.cpp)
+  //
+  // The support point of a bounded convex set S in the direction d is a point
+  // x of S that maximizes d^T x, and h_S(d) = d^T x is the support value.
+  // support() computes them for every type of SetExpr: in closed form for
+  // singletons, balls and rectangles, from the vertices of polygons, and by
+  // linear programming for other polytopes. (For an intersection with balls
+  // outside the plane, the support point is found by projected ascent, to
+  // the accuracy of the projection.) Throws an EvaluationError if the set is
+  // empty or unbounded.
+  //
+  // distance() and closestPoint() only query support points, by the GJK
+  // algorithm: they return the Euclidean distance between two sets (and a
+  // pair of nearest points), and the projection of a point onto a set. For
+  // overlapping sets, the distance is zero and the nearest points are a
+  // common point.
+  struct Support {
+    Eigen::VectorXd point;
+    double value;
+  };
+  Support support(msg::SetExpr::Reader set, const Eigen::VectorXd &direction,
+                  const ValueMap &bound_vars);
+  double distance(msg::SetExpr::Reader a, msg::SetExpr::Reader b,
+                  const ValueMap &bound_vars,
+                  Eigen::VectorXd *nearestA = nullptr,
+                  Eigen::VectorXd *nearestB = nullptr);
+  Eigen::VectorXd closestPoint(msg::SetExpr::Reader set,
+                               const Eigen::VectorXd &point,
+                               const ValueMap &bound_vars);
+
 private:
+  friend class ProjectionSession;
+  // (see projection-session.hpp)
+
   Eigen::VectorXd evalToVector(capnp::List<msg::RealExpr>::Reader list);
   // convert cap'n proto list of realexpr to evaluated vector of doubles
   
@@ -172,11 +454,15 @@ private:
     case msg::SetExpr::RECTANGLE:
       return membership(set.getRectangle(), point);
     case msg::SetExpr::CONVEX_POLYTOPE:
+      if (auto cached = cachedPolytope(set)) {
+        checkDimension(cached->A.cols(), point.size());
+        return cached->contains(point);
+      }
       return membership(set.getConvexPolytope(), point);
     case msg::SetExpr::INTERSECTION:
       return membership(set.getIntersection(), point);
     case msg::SetExpr::REFERENCE:
-      return membership(_set_expr_refs[set.getReference()], point);
+      return membership(referencedSet(set.getReference()), point);
     // case msg::SetExpr::LIST_OPERATION:
     //  return membership(set.getListOperation(), point);
     default:
@@ -207,7 +493,7 @@ private:
   template <typename Derived>
   bool membership(capnp::List<msg::RealExpr>::Reader singleton,
                   const Eigen::MatrixBase<Derived> &point) {
-    assert(point.size() == singleton.size());
+    checkDimension(singleton.size(), point.size());
     Eigen::VectorXd sing = evalToVector(singleton);
     return point.isApprox(sing);
   }
@@ -216,7 +502,7 @@ private:
   bool membership(msg::Ball::Reader ball,
                   const Eigen::MatrixBase<Derived> &point) {
     auto center = ball.getCenter();
-    assert(point.size() == center.size());
+    checkDimension(center.size(), point.size());
 
     // evaluate center and store result in cent
     Eigen::VectorXd cent = evalToVector(center); // (sz);
@@ -227,7 +513,7 @@ private:
   template <typename Derived>
   bool membership(capnp::List<msg::BoundaryPair>::Reader rect,
                   const Eigen::MatrixBase<Derived> &point) {
-    assert(point.size() == rect.size());
+    checkDimension(rect.size(), point.size());
     auto i = 0;
     for (auto boundspair : rect) {
 
@@ -248,6 +534,7 @@ private:
                   const Eigen::MatrixBase<Derived> &point) {
     Eigen::MatrixXd A(evalToMatrix(poly.getA()));
     Eigen::VectorXd b(evalToVector(poly.getB()));
+    checkDimension(A.cols(), point.size());
     return ((A * point).array() <= b.array()).all();
     // coefficient-wise comparison using .array() method
   }
@@ -345,6 +632,12 @@ private:
     case msg::SetExpr::RECTANGLE:
       return proj(set.getRectangle(), point);
     case msg::SetExpr::CONVEX_POLYTOPE:
+      if (auto cached = cachedPolytope(set)) {
+        if (point.size() == 2 && cached->bounded)
+          return projectOntoPolygon(cached->vertices, Eigen::Vector2d(point));
+        // (the vertices are known, in O(m) for m vertices)
+        return proj(cached->A, cached->b, point);
+      }
       return proj(set.getConvexPolytope(), point);
     case msg::SetExpr::INTERSECTION:
       return proj(set.getIntersection(), point);
@@ -425,7 +718,24 @@ private:
   template <typename Derived>
   typename Derived::PlainObject proj(msg::ConvexPolytope::Reader poly,
                                      const Eigen::MatrixBase<Derived> &point) {
-    if (membership(poly, point))
+    return proj(evalToMatrix(poly.getA()), evalToVector(poly.getB()), point);
+  }
+
+  template <typename Derived>
+  typename Derived::PlainObject proj(const Eigen::MatrixXd &A,
+                                     const Eigen::VectorXd &b,
+                                     const Eigen::MatrixBase<Derived> &point) {
+    // projection onto the polytope {x : A x <= b}
+    if (point.size() == 2) {
+      // in the PQ plane, the projection onto the polygon is computed exactly
+      Eigen::Vector2d result;
+      if (projectConvexPolygon(A, b, Eigen::Vector2d(point), result))
+        return result;
+      else
+        throw EvaluationError("Projection onto an empty polygon.");
+    }
+
+    if (((A * point).array() <= b.array()).all())
       return point;
 
     // represent polytope as intersection of half-planes
@@ -433,13 +743,10 @@ private:
 
     std::vector<HalfSpace> altPolygonRepr;
 
-    auto A = poly.getA();
-    auto b = poly.getB();
-
-    auto sz = A.size();
+    auto sz = A.rows();
 
     for (auto i = 0; i < sz; ++i) {
-      altPolygonRepr.push_back(HalfSpace{evalToVector(A[i]), eval(b[i])});
+      altPolygonRepr.push_back(HalfSpace{A.row(i).transpose(), b(i)});
     }
 
     Eigen::VectorXd result;
@@ -455,6 +762,17 @@ private:
     if (membership(intsect, point))
       return point;
 
+    msg::Ball::Reader disk;
+    if (point.size() == 2 && isDiskPolygon(intsect, disk)) {
+      // the projection onto a disk intersected with half-planes is computed
+      // exactly
+      Eigen::Vector2d result;
+      if (evalDiskPolygon(disk, intsect).project(Eigen::Vector2d(point), result))
+        return result;
+      else
+        throw EvaluationError("Projection onto an empty set.");
+    }
+
     Eigen::VectorXd result;
     if (dykstraProjectionAlgorithm(intsect, point, result))
       return result;
@@ -561,6 +879,47 @@ private:
     return converged;
   }
 
+  bool isDiskPolygon(capnp::List<msg::SetExpr>::Reader intersection,
+                     msg::Ball::Reader &disk);
+  // whether the intersection consists of exactly one disk and any number of
+  // convex polygons and rectangles in the plane (possibly referenced); if so,
+  // disk is set to the disk
+  DiskPolygon evalDiskPolygon(msg::Ball::Reader disk,
+                              capnp::List<msg::SetExpr>::Reader intersection);
+  void addHalfPlanes(msg::SetExpr::Reader set, DiskPolygon &kernel);
+
+  template <typename Reader> static const void *address(Reader reader) {
+    return capnp::AnyStruct::Reader(reader).getDataSection().begin();
+  }
+  // identifies a RealExpr or SetExpr by the start of its data section in the
+  // message (which holds the union discriminant, hence is never empty)
+
+  void analyzeDependencies();
+  VariableMask analyze(msg::RealExpr::Reader expr, int depth, bool label);
+  VariableMask analyze(msg::SetExpr::Reader set, int depth, bool label);
+  // (if label is set, the masks are stored in _model->dependencies)
+  VariableMask variableMask(const kj::StringPtr var) const;
+
+  // Constant polytopes (see adv-interpreter-cache.cpp)
+  //
+  // A convex polytope whose coefficients are constants (after constant
+  // folding) is evaluated once, when the advertisement is compiled, together
+  // with its vertices and hull in the plane. The cache is keyed by the
+  // address of the SetExpr in the message.
+  bool constantRoutine(uint32_t entry, double &value) const;
+  void cachePolytope(const void *set, const SetNode &node);
+  // (set is the address of the SetExpr)
+  const PolytopeCache *cachedPolytope(msg::SetExpr::Reader set) const;
+  // nullptr if the polytope is not cached
+
+  Support support(msg::SetExpr::Reader set, const Eigen::VectorXd &direction);
+  Support support(capnp::List<msg::SetExpr>::Reader intersection,
+                  const Eigen::VectorXd &direction);
+  size_t dimension(msg::SetExpr::Reader set);
+  bool addConstraints(msg::SetExpr::Reader set, SeidelLP &lp);
+  // adds the constraints of a polytope, rectangle, or an intersection of
+  // these; returns false for other sets
+
   Eigen::AlignedBoxXd rectHull(msg::SetExpr::Reader set);
   Eigen::AlignedBoxXd rectHull(capnp::List<msg::RealExpr>::Reader singleton);
   Eigen::AlignedBoxXd rectHull(msg::Ball::Reader ball);
@@ -568,17 +927,157 @@ private:
   Eigen::AlignedBoxXd rectHull(msg::ConvexPolytope::Reader poly);
   Eigen::AlignedBoxXd rectHull(capnp::List<msg::SetExpr>::Reader intersection);
 
-  // Scan through the message for named RealExpressions and named SetExpressions and store pointers (Reader objects) to these objects in the "RefMaps" _real_expr_refs and _set_expr_refs respectively. When encountering a reference during evaluation of an expression, we can then find the reference using these RefMaps. The findReferences method is called by the constructor of AdvFunc, assuming that a new AdvFunc object is constructed each time an advertisement is received.
+  void beginEvaluation(const ValueMap &bound_vars) {
+    _bound_vars = &bound_vars;
+    _nesting_depth = 0;
+    std::fill(_ref_value_known.begin(), _ref_value_known.end(), 0);
+    std::fill(_ref_partial_known.begin(), _ref_partial_known.end(), 0);
+  }
+  // Called by the top-level user functions. The values (and partial
+  // derivatives) of named RealExpr's are memoized in _ref_values and
+  // _ref_partials for the duration of one call, as they only depend on
+  // bound_vars.
+
+  // Scan through the message for named RealExpressions and named SetExpressions and store pointers (Reader objects) to these objects in the "RefMaps" _model->realExprRefs and _model->setExprRefs respectively. When encountering a reference during evaluation of an expression, we can then find the reference using these RefMaps. The findReferences method is called by the constructor of AdvFunc, assuming that a new AdvFunc object is constructed each time an advertisement is received.
   void findReferences();
   void findReferences(msg::RealExpr::Reader expr);
   void findReferences(msg::SetExpr::Reader expr);
 
+  // Resolve all references in the message to the named expressions they refer
+  // to, and throw on dangling references and cycles (see
+  // adv-interpreter-link.cpp). Called after findReferences.
+  void linkReferences();
+  void linkReferences(msg::RealExpr::Reader expr, LinkState &state);
+  void linkReferences(msg::SetExpr::Reader set, LinkState &state);
+  int linkedRealExpr(const kj::StringPtr ref) const;
+  // index in _model->namedRealExprs, or -1 if the reference is not part of the
+  // advertisement
+  msg::SetExpr::Reader referencedSet(const kj::StringPtr ref);
+
+  // ===========================================
+  // Compilation and execution of AdvProgram's
+  // ===========================================
+
+  void compileAdvertisement();
+  uint32_t compileRoutine(msg::RealExpr::Reader expr, int depth);
+  void compileExpr(msg::RealExpr::Reader expr, RoutineBuilder &routine, int depth);
+  void compileRef(const kj::StringPtr ref, RoutineBuilder &routine, int depth);
+  void emitConstant(double value, RoutineBuilder &routine);
+  void bindLiteral(const void *source);
+  // (in a parametric model, binds the last constant to the literal at source)
+  void emitOperation(OpCode op, uint32_t n, RoutineBuilder &routine);
+  void emitCall(uint32_t reference, RoutineBuilder &routine);
+  uint32_t compileSet(msg::SetExpr::Reader set, int depth);
+  uint32_t compileSetRef(const kj::StringPtr ref, int depth);
+  uint32_t compileDiagnostic(Diagnostic::Kind kind, const std::string &what,
+                             const std::string &ref = "", int which = -1);
+  uint32_t variableSlot(const kj::StringPtr var);
+
+  bool specializedValue(const std::string &var, double &value) const;
+  std::unordered_map<std::string, uint32_t> &compiledRefs(const kj::StringPtr ref,
+                                                          bool set);
+  // the names of the compiled RealExpr's (or SetExpr's) that a reference to
+  // ref may use
+  bool specializePolynomial(const PolynomialData &poly, RoutineBuilder &routine);
+  void compileSpecializedCases(msg::CaseDistinction<msg::RealExpr>::Reader casedist,
+                               RoutineBuilder &routine, int depth);
+
+  void bindVariables(const ValueMap &bound_vars);
+  void bindVariables(const double *values, size_t num_values);
+  double run(uint32_t entry);
+  double loadVariable(uint32_t slot) const;
+  const double *tabulatePowers(const PolynomialData &poly);
+  double evalPolynomial(const PolynomialData &poly, double *partials = nullptr);
+  bool member(uint32_t set, const double *point, size_t dim);
+  [[noreturn]] void throwDiagnostic(uint32_t index) const;
+  [[noreturn]] void throwUnknownVariable(uint32_t slot) const;
+  static void checkDimension(size_t set_dim, size_t point_dim);
+  // throws an EvaluationError unless the point has the dimension of the set
+  // (for all membership tests, compiled or not)
+
+  void bindBatch(const double *const *values, size_t num_values,
+                 const double *const *constants, size_t offset, size_t len);
+  void runBlock(uint32_t entry);
+  void constantBlock(uint32_t index, double *out) const;
+  void evalPolynomialBlock(const PolynomialData &poly, double *out);
+  void memberBlock(uint32_t set, const double *point, size_t dim, double *mask);
+  // the blocks of the batch executor are stored consecutively in
+  // _batch_stack, BATCH_BLOCK doubles apart
+
+  void bindJets(const double *values, size_t num_values, bool hessian);
+  void runJet(uint32_t entry);
+  void evalPolynomialJet(const PolynomialData &poly, double *out);
+  // a jet is the value of an expression followed by its partial derivatives;
+  // the jets of the AD executor are stored consecutively in _jet_stack
+
+  enum class Overlap { Outside, Inside, Partial };
+  void bindIntervals(const Eigen::AlignedBoxXd &box);
+  void runInterval(uint32_t entry);
+  Interval loadInterval(uint32_t slot) const;
+  Interval evalPolynomialInterval(const PolynomialData &poly);
+  Overlap classify(uint32_t set, const Interval *box, size_t dim);
+  // whether a box lies outside or inside a set for all values of the
+  // variables, or whether this cannot be decided by interval arithmetic
+
+  void unshare();
+  // gives this AdvFunc a model of its own before the model is extended (by
+  // compile() or specialize()), if other AdvFunc's share it
+
+  std::shared_ptr<AdvModel> _model;
   int _nesting_depth;
-  msg::Advertisement::Reader _adv;
   bool _advValid;
   const ValueMap* _bound_vars;
-  RealExprRefMap _real_expr_refs;
-  SetExprRefMap _set_expr_refs;
+  std::vector<double> _ref_values;
+  std::vector<double> _ref_partials;
+  std::vector<char> _ref_value_known;
+  std::vector<char> _ref_partial_known;
+
+  std::unordered_map<const void *, Eigen::AlignedBoxXd> _hulls;
+  // hulls of the variable-free sets of the advertisement, once computed
+  bool _caching; // (while compiling the advertisement itself)
+  Specialization *_specialization; // (while compiling a specialized expression)
+  const std::unordered_map<const void *, uint32_t> *_literals;
+  // (while compiling a parametric model: the index of the literal at every
+  // address, see AdvStructure)
+  const std::unordered_map<const void *, uint32_t> *_polytopes;
+  // (likewise, the index of every convex polytope)
+
+  // scratch space for executing the program
+  std::vector<double> _stack;
+  double *_sp;
+  std::vector<double> _var_values;
+  std::vector<char> _var_bound;
+  std::vector<double> _powers;
+  std::vector<double> _partials;
+  std::vector<double> _memo;
+  std::vector<char> _memo_valid;
+  // results of the routines in _model->program.references, for the bound variables
+  std::vector<double, Eigen::aligned_allocator<double>> _batch_stack;
+  double *_bsp;
+  size_t _batch_len;
+  size_t _batch_offset;
+  const double *const *_batch_constants;
+  const double *_batch_active;
+  // the lanes selected by the enclosing case distinctions, or nullptr for all
+  std::vector<const double *> _batch_vars;
+  std::vector<double> _batch_memo;
+  std::vector<char> _batch_memo_valid;
+  std::vector<double> _jet_stack;
+  double *_jsp;
+  std::vector<double> _jet_memo;
+  std::vector<char> _jet_memo_valid;
+  size_t _jet_dim;   // number of partial derivatives
+  bool _jet_hessian; // whether the jets contain second-order derivatives
+  size_t _jet_width; // number of doubles per jet
+  std::vector<Interval> _ival_stack;
+  Interval *_isp;
+  std::vector<Interval> _ival_vars; // the ranges of the first box.dim() slots
+  std::vector<Interval> _ival_powers;
+  std::vector<Interval> _ival_memo;
+  std::vector<char> _ival_memo_valid;
 };
 
+using EvalContext = AdvFunc;
+// (an AdvFunc created by AdvFunc::context)
+
 #endif
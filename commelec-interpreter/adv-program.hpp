@@ -0,0 +1,187 @@
+#ifndef ADVPROGRAM_HPP
+#define ADVPROGRAM_HPP
+
+// Compiled form of the RealExpr'essions and SetExpr'essions of an advertisement
+//
+// The tree-walking evaluator (adv-interpreter-eval.cpp) re-dispatches through
+// the Cap'n Proto readers on every call. Instead, AdvFunc can lower each
+// RealExpr once into a "routine": a linear sequence of instructions for a
+// small stack machine, terminated by a Return instruction. All routines of an
+// advertisement are stored back-to-back in AdvProgram::code, and a routine is
+// identified by the index of its first instruction (its entry point).
+//
+// Numeric literals are not stored in the instructions themselves, but in a
+// constants table, in order of appearance in the message. Variables are
+// referred to by their slot in the variables table.
+//
+// SetExpr'essions (needed for case distinctions) are compiled into SetNodes,
+// whose RealExpr'essions are again routines.
+//
+// A named RealExpr is compiled into a routine of its own, which is called by
+// every reference to it. Calls refer to the routine by its index in
+// AdvProgram::references, such that the executors can memoize the result:
+// the referenced routine is executed at most once per set of bound variables.
+
+#include <commelec-api/schema.capnp.h>
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <limits>
+#include <cstdint>
+
+enum class OpCode : uint8_t {
+  Const,           // push constants[arg]
+  Variable,        // push the value bound to variable slot arg
+  Call,            // push the result of the routine references[arg]
+  Throw,           // throw the error described by diagnostics[arg]
+
+  // unary operations (replace the top of the stack)
+  Negate,
+  Abs,
+  Sign,
+  MultInv,
+  Square,
+  Sqrt,
+  Sin,
+  Cos,
+  Tan,
+  Exp,
+  Ln,
+  Log10,
+  Round,
+  Floor,
+  Ceil,
+
+  // binary operations (pop two values, push one)
+  Sum,
+  Prod,
+  Pow,
+  Min,
+  Max,
+  LessEqThan,
+  GreaterThan,
+
+  // list operations (pop arg values, push one)
+  SumList,
+  ProdList,
+
+  Polynomial,      // push the value of polynomials[arg]
+  CaseDistinction, // push the value of the active case of cases[arg]
+  Return           // end of routine, the result is on top of the stack
+};
+
+struct Instruction {
+  OpCode op;
+  uint32_t arg;
+};
+
+struct PolynomialData {
+  // The offsets of the monomials in the message are decoded at compile time:
+  // the exponent of the v-th variable in the t-th monomial is
+  // exponents[t * variables.size() + v]. The executors first tabulate the
+  // powers 1, x, x^2, ..., x^maxExponent of every variable x, so that a
+  // monomial (and each of its partial derivatives) costs one multiplication
+  // per variable.
+  std::vector<uint32_t> variables; // variable slots
+  std::vector<uint32_t> exponents;
+  std::vector<uint32_t> powerIndex;
+  // the powers of the v-th variable start at powerIndex[v] in the table,
+  // the table has powerIndex.back() entries
+  uint32_t firstCoeff;             // coefficient of monomial i is constants[firstCoeff + i]
+  uint32_t terms = 0;
+
+  uint32_t maxExponent(size_t var) const {
+    return powerIndex[var + 1] - powerIndex[var] - 1;
+  }
+};
+
+struct CaseDistinctionData {
+  std::vector<uint32_t> variables; // variable slots that form the evaluation point
+  std::vector<uint32_t> sets;      // per case: set to test membership of
+  std::vector<uint32_t> routines;  // per case: entry point of the expression
+  std::vector<uint32_t> fixed;
+  // per coordinate of the point: in a specialized program (see
+  // AdvFunc::specialize), the index into constants of the value the variable
+  // is bound to, or notFixed; empty if no coordinate is fixed
+
+  static constexpr uint32_t notFixed = std::numeric_limits<uint32_t>::max();
+  bool isFixed(size_t i) const { return !fixed.empty() && fixed[i] != notFixed; }
+};
+
+struct SetNode {
+  msg::SetExpr::Which type;
+  std::vector<uint32_t> exprs;
+  // entry points of the RealExpr's in the set:
+  //   singleton:       the coordinates
+  //   ball:            the coordinates of the center, followed by the radius
+  //   rectangle:       boundA and boundB of the first pair, then of the second, ...
+  //   convex polytope: A (row-major), followed by b
+  std::vector<uint32_t> children;
+  // intersection: the intersected sets, reference: the referenced set
+  uint32_t rows = 0;
+  uint32_t cols = 0;
+  // dimensions of A for a convex polytope
+  int32_t error = -1;
+  // index into diagnostics if operations on this set must throw
+};
+
+struct Diagnostic {
+  enum class Kind { UnknownReference, UnknownVariable, EvaluationError, WhichError };
+  Kind kind;
+  std::string what;
+  std::string ref;
+  int which;
+};
+
+struct CompiledExpr {
+  // Handle to a RealExpr that has been compiled by AdvFunc::compile
+  static constexpr uint32_t invalid = std::numeric_limits<uint32_t>::max();
+  uint32_t entry = invalid;
+  bool valid() const { return entry != invalid; }
+};
+
+struct CompiledSet {
+  // Handle to a SetExpr that has been compiled by AdvFunc::compile
+  static constexpr uint32_t invalid = std::numeric_limits<uint32_t>::max();
+  uint32_t node = invalid;
+  bool valid() const { return node != invalid; }
+};
+
+struct AdvProgram {
+  std::vector<Instruction> code;
+  std::vector<double> constants;
+  std::vector<std::string> variables;
+  std::vector<PolynomialData> polynomials;
+  std::vector<CaseDistinctionData> cases;
+  std::vector<SetNode> sets;
+  std::vector<Diagnostic> diagnostics;
+  std::vector<uint32_t> references; // entry points of the named RealExpr's
+
+  size_t stackSize = 0;
+  // upper bound on the stack usage of any (nested) evaluation: we simply add
+  // up the maximum stack depth of all routines
+
+  std::unordered_map<std::string, uint32_t> variableSlots;
+  std::unordered_map<std::string, uint32_t> realExprRefs;
+  std::unordered_map<std::string, uint32_t> setExprRefs;
+  // named RealExpr's and SetExpr's that have already been compiled (maps the
+  // name to the index in references or to the set node)
+
+  void clear() { *this = AdvProgram(); }
+
+  struct Mark {
+    size_t code, constants, polynomials, cases, sets, diagnostics, references;
+    size_t stackSize;
+  };
+  Mark mark() const {
+    return Mark{code.size(),  constants.size(),   polynomials.size(),
+                cases.size(), sets.size(),        diagnostics.size(),
+                references.size(), stackSize};
+  }
+  void truncate(const Mark &mark);
+  // discards everything that was compiled after mark() (named expressions
+  // compiled since are forgotten; variable slots are kept)
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include <commelec-interpreter/adv-structure.hpp>
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <capnp/any.h>
+
+using namespace msg;
+
+namespace {
+
+const int MAX_NESTING_DEPTH = 10000; // (as in AdvFunc)
+
+struct StructureWalk {
+  AdvStructure &result;
+
+  void put(uint32_t value) {
+    result.signature.append(reinterpret_cast<const char *>(&value),
+                            sizeof(value));
+  }
+  void put(kj::StringPtr text) {
+    put(uint32_t(text.size()));
+    result.signature.append(text.cStr(), text.size());
+  }
+  template <typename Reader> void literal(double value, Reader source) {
+    // same address as AdvFunc::address
+    result.literals.push_back(value);
+    result.sources.push_back(
+        capnp::AnyStruct::Reader(source).getDataSection().begin());
+  }
+  void variables(capnp::List<capnp::Text>::Reader vars) {
+    put(vars.size());
+    for (auto var : vars)
+      put(var);
+  }
+
+  template <typename CaseType>
+  void cases(typename CaseDistinction<CaseType>::Reader casedist, int depth) {
+    variables(casedist.getVariables());
+    put(casedist.getCases().size());
+    for (auto cs : casedist.getCases()) {
+      walk(cs.getSet(), depth);
+      walk(cs.getExpression(), depth);
+    }
+  }
+
+  void walk(RealExpr::Reader expr, int depth) {
+    if (++depth > MAX_NESTING_DEPTH)
+      throw EvaluationError("max nesting depth reached");
+    put(uint32_t(expr.which()));
+    put(uint32_t(expr.hasName()));
+    if (expr.hasName())
+      put(expr.getName());
+
+    switch (expr.which()) {
+    case RealExpr::REAL:
+      literal(expr.getReal(), expr);
+      break;
+    case RealExpr::POLYNOMIAL: {
+      auto poly = expr.getPolynomial();
+      variables(poly.getVariables());
+      put(poly.getMaxVarDegree());
+      put(poly.getCoefficients().size());
+      for (auto coeff : poly.getCoefficients()) {
+        put(coeff.getOffset());
+        literal(coeff.getValue(), coeff);
+      }
+      break;
+    }
+    case RealExpr::UNARY_OPERATION: {
+      auto op = expr.getUnaryOperation();
+      put(uint32_t(op.getOperation().which()));
+      walk(op.getArg(), depth);
+      break;
+    }
+    case RealExpr::BINARY_OPERATION: {
+      auto op = expr.getBinaryOperation();
+      put(uint32_t(op.getOperation().which()));
+      walk(op.getArgA(), depth);
+      walk(op.getArgB(), depth);
+      break;
+    }
+    case RealExpr::LIST_OPERATION: {
+      auto op = expr.getListOperation();
+      put(uint32_t(op.getOperation().which()));
+      put(op.getArgs().size());
+      for (auto arg : op.getArgs())
+        walk(arg, depth);
+      break;
+    }
+    case RealExpr::CASE_DISTINCTION:
+      cases<RealExpr>(expr.getCaseDistinction(), depth);
+      break;
+    case RealExpr::REFERENCE:
+      put(expr.getReference());
+      break;
+    case RealExpr::VARIABLE:
+      put(expr.getVariable());
+      break;
+    default:
+      break;
+    }
+  }
+
+  void walk(SetExpr::Reader set, int depth) {
+    if (++depth > MAX_NESTING_DEPTH)
+      throw EvaluationError("max nesting depth reached");
+    put(uint32_t(set.which()));
+    put(uint32_t(set.hasName()));
+    if (set.hasName())
+      put(set.getName());
+
+    switch (set.which()) {
+    case SetExpr::SINGLETON:
+      put(set.getSingleton().size());
+      for (auto expr : set.getSingleton())
+        walk(expr, depth);
+      break;
+    case SetExpr::BALL: {
+      auto ball = set.getBall();
+      put(ball.getCenter().size());
+      for (auto expr : ball.getCenter())
+        walk(expr, depth);
+      walk(ball.getRadius(), depth);
+      break;
+    }
+    case SetExpr::RECTANGLE:
+      put(set.getRectangle().size());
+      for (auto bpair : set.getRectangle()) {
+        walk(bpair.getBoundA(), depth);
+        walk(bpair.getBoundB(), depth);
+      }
+      break;
+    case SetExpr::CONVEX_POLYTOPE: {
+      auto poly = set.getConvexPolytope();
+      result.polytopes.push_back(
+          capnp::AnyStruct::Reader(set).getDataSection().begin());
+      put(poly.getA().size());
+      for (auto row : poly.getA()) {
+        put(row.size());
+        for (auto expr : row)
+          walk(expr, depth);
+      }
+      put(poly.getB().size());
+      for (auto expr : poly.getB())
+        walk(expr, depth);
+      break;
+    }
+    case SetExpr::INTERSECTION:
+      put(set.getIntersection().size());
+      for (auto child_set : set.getIntersection())
+        walk(child_set, depth);
+      break;
+    case SetExpr::CASE_DISTINCTION:
+      cases<SetExpr>(set.getCaseDistinction(), depth);
+      break;
+    case SetExpr::REFERENCE:
+      put(set.getReference());
+      break;
+    default:
+      break;
+    }
+  }
+};
+
+} // namespace
+
+AdvStructure structureOf(Advertisement::Reader adv) {
+  AdvStructure result;
+  StructureWalk walk{result};
+  // (a field that is not set is not the same as an empty expression)
+  walk.put(uint32_t(adv.hasPQProfile()));
+  if (adv.hasPQProfile())
+    walk.walk(adv.getPQProfile(), 0);
+  walk.put(uint32_t(adv.hasBeliefFunction()));
+  if (adv.hasBeliefFunction())
+    walk.walk(adv.getBeliefFunction(), 0);
+  walk.put(uint32_t(adv.hasCostFunction()));
+  if (adv.hasCostFunction())
+    walk.walk(adv.getCostFunction(), 0);
+
+  result.hash = 14695981039346656037ull;
+  for (unsigned char c : result.signature) {
+    result.hash ^= c;
+    result.hash *= 1099511628211ull;
+  }
+  return result;
+}
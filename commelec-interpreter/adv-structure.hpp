@@ -0,0 +1,41 @@
+// Structure of an advertisement
+//
+// The advertisements of one kind of resource (for example, all batteries
+// built by _BatteryAdvertisement) have the same expression trees, and differ
+// only in their numeric literals. structureOf walks the expressions of an
+// advertisement (the PQ profile, the belief function and the cost function,
+// in preorder, without following references) and separates the two: the
+// signature encodes the types of the nodes, the operations, the names,
+// references and variables, the lengths of the lists and the exponents of the
+// polynomials; the literals are the values of the Real nodes and the
+// coefficients of the polynomials, in the order of the walk.
+//
+// Two advertisements with the same signature differ only in their literals:
+// a program compiled in parametric mode from one of them (see AdvFunc::setAdv)
+// evaluates the other one when its constants are bound to the literals of
+// the other one (see AdvModel::bindings).
+
+#ifndef ADVSTRUCTURE_HPP
+#define ADVSTRUCTURE_HPP
+
+#include <commelec-api/schema.capnp.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct AdvStructure {
+  std::string signature;
+  uint64_t hash; // of the signature (FNV-1a)
+  std::vector<double> literals;
+  std::vector<const void *> sources;
+  // the address of every literal in the message: of its RealExpr, or of the
+  // coefficient of a polynomial (see AdvFunc::address)
+  std::vector<const void *> polytopes;
+  // the address of every convex polytope (of its SetExpr), in the same order
+};
+
+AdvStructure structureOf(msg::Advertisement::Reader adv);
+// Throws an EvaluationError if the expressions are nested too deeply.
+
+#endif
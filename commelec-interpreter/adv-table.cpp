@@ -0,0 +1,150 @@
+#include <commelec-interpreter/adv-table.hpp>
+
+using namespace msg;
+
+const uint64_t AdvertisementTable::EMPTY;
+
+AdvertisementTable::AdvertisementTable(size_t capacity, size_t maxReaders)
+    : _maxReaders(std::max(maxReaders, size_t(1))), _epoch(1), _version(0) {
+  size_t n = 1;
+  while (n < capacity)
+    n *= 2;
+  _mask = n - 1;
+  _slots.reset(new Slot[n]);
+  for (size_t i = 0; i < n; ++i) {
+    _slots[i].key.store(EMPTY);
+    _slots[i].value.store(nullptr);
+  }
+  _readers.reset(new ReaderSlot[_maxReaders]);
+  for (size_t i = 0; i < _maxReaders; ++i) {
+    _readers[i].claimed.store(false);
+    _readers[i].epoch.store(0);
+  }
+}
+
+AdvertisementTable::~AdvertisementTable() {
+  for (size_t i = 0; i <= _mask; ++i)
+    delete _slots[i].value.load();
+  for (auto &retired : _retired)
+    delete retired.adv;
+}
+
+AdvertisementTable::Slot *AdvertisementTable::slotOf(uint32_t agentId,
+                                                     bool insert) {
+  // linear probing from a multiplicative hash; keys are never removed, so a
+  // probe ends at the agent or at the first empty slot
+  size_t start = (agentId * UINT32_C(2654435769)) & _mask;
+  for (size_t i = 0; i <= _mask; ++i) {
+    auto &slot = _slots[(start + i) & _mask];
+    auto key = slot.key.load(std::memory_order_acquire);
+    if (key == agentId)
+      return &slot;
+    if (key == EMPTY) {
+      if (!insert)
+        return nullptr;
+      slot.key.store(agentId, std::memory_order_release);
+      // (the value is still nullptr: readers do not find the agent yet)
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+void AdvertisementTable::publish(Message::Reader message) {
+  if (message.isAdvertisement())
+    publish(message.getAgentId(), message.getAdvertisement());
+}
+
+void AdvertisementTable::publish(uint32_t agentId, Advertisement::Reader adv) {
+  std::unique_ptr<PublishedAdvertisement> published(
+      new PublishedAdvertisement());
+  published->agentId = agentId;
+  published->message.setRoot(adv);
+  published->adv = published->message.getRoot<Advertisement>().asReader();
+  published->model = _cache.model(published->adv);
+
+  auto slot = slotOf(agentId, true);
+  if (!slot)
+    throw std::runtime_error("AdvertisementTable::publish: table full");
+  published->version = ++_version;
+  auto previous = slot->value.exchange(published.release());
+  if (previous)
+    retire(previous);
+  reclaim();
+}
+
+bool AdvertisementTable::remove(uint32_t agentId) {
+  auto slot = slotOf(agentId, false);
+  if (!slot)
+    return false;
+  auto previous = slot->value.exchange(nullptr);
+  // (the key remains, for the next advertisement of the agent)
+  if (!previous)
+    return false;
+  retire(previous);
+  reclaim();
+  return true;
+}
+
+void AdvertisementTable::retire(PublishedAdvertisement *adv) {
+  // readers that entered before the increment may still see adv; those that
+  // enter after it load the new value (the exchange precedes the increment)
+  _retired.push_back(Retired{adv, _epoch.fetch_add(1)});
+}
+
+size_t AdvertisementTable::reclaim() {
+  auto oldest = _epoch.load();
+  for (size_t i = 0; i < _maxReaders; ++i) {
+    auto epoch = _readers[i].epoch.load();
+    if (epoch != 0 && epoch < oldest)
+      oldest = epoch;
+  }
+  // a version retired in epoch e is visible to readers in epochs <= e only
+  size_t kept = 0;
+  for (auto &retired : _retired) {
+    if (retired.epoch < oldest)
+      delete retired.adv;
+    else
+      _retired[kept++] = retired;
+  }
+  _retired.resize(kept);
+  return kept;
+}
+
+AdvertisementTable::Reader::Reader(AdvertisementTable &table) : _table(table) {
+  for (_slot = 0; _slot < _table._maxReaders; ++_slot) {
+    bool claimed = false;
+    if (_table._readers[_slot].claimed.compare_exchange_strong(claimed, true))
+      return;
+  }
+  throw std::runtime_error("AdvertisementTable::Reader: too many readers");
+}
+
+AdvertisementTable::Reader::~Reader() {
+  _table._readers[_slot].epoch.store(0);
+  _table._readers[_slot].claimed.store(false);
+}
+
+void AdvertisementTable::Reader::enter() {
+  // (sequentially consistent, as the exchange in publish and the scan in
+  // reclaim: if reclaim misses this epoch, find loads the new version)
+  _table._readers[_slot].epoch.store(_table._epoch.load());
+}
+
+void AdvertisementTable::Reader::leave() {
+  _table._readers[_slot].epoch.store(0);
+}
+
+const PublishedAdvertisement *
+AdvertisementTable::Reader::find(uint32_t agentId) const {
+  size_t start = (agentId * UINT32_C(2654435769)) & _table._mask;
+  for (size_t i = 0; i <= _table._mask; ++i) {
+    auto &slot = _table._slots[(start + i) & _table._mask];
+    auto key = slot.key.load(std::memory_order_acquire);
+    if (key == agentId)
+      return slot.value.load();
+    if (key == EMPTY)
+      return nullptr;
+  }
+  return nullptr;
+}
@@ -0,0 +1,112 @@
+// Latest advertisement of every agent, for concurrent readers
+//
+// The receive path of a grid agent publishes every new advertisement, while
+// the threads of the control loop keep reading the previous ones. An
+// AdvertisementTable maps the agentId of a message to an immutable
+// PublishedAdvertisement: a copy of the advertisement and its model (compiled
+// through an AdvCache, so that an advertisement of a known structure is not
+// compiled again).
+//
+// Readers take no locks: a lookup probes an open-addressing table of fixed
+// capacity and loads one pointer, in a bounded number of steps. A new version
+// of an advertisement replaces the previous one with an atomic exchange. The
+// previous version is retired and freed by epoch-based reclamation: a reader
+// announces the epoch in which it entered its read section, and a version
+// retired in an earlier epoch is freed once no reader is still in that epoch
+// or an earlier one.
+//
+// Only one thread at a time may publish (or remove); any number of threads
+// (up to maxReaders) may read, each with a Reader of its own.
+
+#ifndef ADVTABLE_HPP
+#define ADVTABLE_HPP
+
+#include <commelec-interpreter/adv-cache.hpp>
+
+#include <atomic>
+#include <memory>
+
+struct PublishedAdvertisement {
+  uint32_t agentId;
+  uint64_t version; // (number of the publication in the table, from 1)
+  capnp::MallocMessageBuilder message;
+  msg::Advertisement::Reader adv; // (in message)
+  std::shared_ptr<const AdvModel> model;
+  // AdvFunc(model) evaluates the advertisement; it must not be used after
+  // the read section in which the advertisement was found
+};
+
+class AdvertisementTable {
+public:
+  explicit AdvertisementTable(size_t capacity = 1024, size_t maxReaders = 64);
+  // capacity: the maximum number of agents (rounded up to a power of two)
+  ~AdvertisementTable();
+  // (no reader may be in a read section)
+
+  void publish(msg::Message::Reader message);
+  // publishes the advertisement of the message, if it carries one
+  void publish(uint32_t agentId, msg::Advertisement::Reader adv);
+  // Throws a std::runtime_error if the table is full, or as the constructor
+  // of AdvFunc (the previous version then remains published).
+  bool remove(uint32_t agentId);
+  size_t reclaim();
+  // frees the retired versions that no reader can see any more (publish and
+  // remove call it as well); returns the number of versions still retired
+
+  class Reader {
+  public:
+    explicit Reader(AdvertisementTable &table);
+    // Throws a std::runtime_error if maxReaders Readers exist.
+    ~Reader();
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    void enter();
+    void leave();
+    const PublishedAdvertisement *find(uint32_t agentId) const;
+    // only between enter() and leave(); the advertisement remains valid until
+    // leave(). nullptr if the agent has no advertisement.
+
+    struct Section {
+      explicit Section(Reader &reader) : _reader(reader) { _reader.enter(); }
+      ~Section() { _reader.leave(); }
+      Reader &_reader;
+    };
+
+  private:
+    AdvertisementTable &_table;
+    size_t _slot;
+  };
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> key; // the agentId, or EMPTY
+    std::atomic<PublishedAdvertisement *> value;
+  };
+  struct alignas(64) ReaderSlot {
+    // (every reader writes to a cache line of its own)
+    std::atomic<bool> claimed;
+    std::atomic<uint64_t> epoch; // of the read section, 0 outside
+  };
+  struct Retired {
+    PublishedAdvertisement *adv;
+    uint64_t epoch;
+  };
+  static const uint64_t EMPTY = ~uint64_t(0);
+
+  Slot *slotOf(uint32_t agentId, bool insert);
+  // the slot of the agent, or nullptr; with insert, a free slot becomes the
+  // slot of the agent
+  void retire(PublishedAdvertisement *adv);
+
+  size_t _mask; // (capacity - 1)
+  std::unique_ptr<Slot[]> _slots;
+  size_t _maxReaders;
+  std::unique_ptr<ReaderSlot[]> _readers;
+  std::atomic<uint64_t> _epoch;
+  uint64_t _version;
+  std::vector<Retired> _retired;
+  AdvCache _cache;
+};
+
+#endif
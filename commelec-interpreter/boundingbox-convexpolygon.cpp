@@ -1,7 +1,7 @@
 // Function to compute bounding box of a convex polytope
 // Niek Bouman / Andrey Bernstein
 //
-// solve_lp2 re-uses code from Michael Hohmeyer, for which
+// SeidelLP re-uses code from Michael Hohmeyer, for which
 // license below applies:
 //
 // Copyright (c) 1990 Michael E. Hohmeyer, 
@@ -12,64 +12,163 @@
 
 #include <commelec-interpreter/boundingbox-convexpolygon.hpp>
 #include <seidel_lp/lp.h>
-#include <ctime>
+#include <algorithm>
+#include <cmath>
 #include <stdexcept>
 
-std::vector<double> solve_lp2(const std::vector<double> &_halves,
-                              const std::vector<double> &c) {
+SeidelLP::SeidelLP(int dim, unsigned seed)
+    : _dim(dim), _opt(dim + 1, 0.0), _n_vec(dim + 1, 0.0),
+      _d_vec(dim + 1, 0.0), _objective(Eigen::VectorXd::Zero(dim)),
+      _solved(0), _status(INFEASIBLE), _rng(seed) {
+  if (dim < 1)
+    throw std::invalid_argument("SeidelLP: the dimension must be positive");
+  _halves.assign(dim + 1, 0.0);
+  _halves[dim] = 1;
+  _opt[dim] = 1;
+  _d_vec[dim] = 1;
+}
+
+void SeidelLP::reserve(size_t constraints) {
+  auto m = constraints + 1;
+  _halves.reserve((_dim + 1) * m);
+  _next.reserve(m);
+  _prev.reserve(m);
+  _perm.reserve(m);
+  _work.reserve((m + 3) * (_dim + 2) * (_dim - 1) / 2);
+}
+
+void SeidelLP::clear() {
+  _halves.resize(_dim + 1);
+  _solved = 0;
+}
+
+void SeidelLP::normalize(size_t h) {
+  double norm = 0;
+  for (int j = 0; j <= _dim; ++j)
+    norm += _halves[h + j] * _halves[h + j];
+  norm = std::sqrt(norm);
+  if (norm > 0)
+    for (int j = 0; j <= _dim; ++j)
+      _halves[h + j] /= norm;
+}
 
-  // the trivial halfspace (0,0,1) should be at position 0 in halves
-  std::vector<double> halves{0, 0, 1};
-  halves.insert(halves.end(), _halves.begin(), _halves.end());
+int SeidelLP::link(int first) {
+  int m = _halves.size() / (_dim + 1);
+  int last = 0;
+  if (first > 1)
+    while (_next[last] != first)
+      last = _next[last];
+  // (the end of the list of the previous solve, which was terminated by
+  // 'first')
 
-  // setup n_vec and d_vec for linear programming
-  std::vector<double> n_vec(c);
-  n_vec.push_back(0);
-  std::vector<double> d_vec = {0, 0, 1};
+  _perm.resize(m - first);
+  for (int i = first; i < m; ++i)
+    _perm[i - first] = i;
+  std::shuffle(_perm.begin(), _perm.end(), _rng);
+  for (int i : _perm) {
+    _next[last] = i;
+    _prev[i] = last;
+    last = i;
+  }
+  _next[last] = m;
+  return _perm.empty() ? m : _perm.front();
+}
 
-  auto m = halves.size() / 3;
-  auto d = 2;
+SeidelLP::Status SeidelLP::minimize(const Eigen::VectorXd &c,
+                                    Eigen::VectorXd &x) {
+  const int d = _dim;
+  int m = _halves.size() / (d + 1);
+  _next.resize(m);
+  _prev.resize(m);
+  _work.resize((m + 3) * (d + 2) * (d - 1) / 2);
 
-  std::vector<int> next(m);
-  std::vector<int> prev(m);
-  std::vector<int> perm(m - 1);
-  std::vector<double> opt(d + 1);
-  std::vector<double> work((m + 3) * (d + 2) * (d - 1) / 2);
+  // the previous optimum may be kept if it was finite, and is an optimum for
+  // the same objective
+  bool incremental = _solved > 0 && c == _objective &&
+                     (_status == MINIMUM || _status == AMBIGUOUS) &&
+                     _opt[d] != 0;
+  if (!(incremental && _solved == m)) {
+    _prev[0] = 1234567890; // previous to 0 should never be used
+    int first = link(incremental ? _solved : 1);
+    int istart = incremental ? first : 0;
 
-  srand(time(NULL));            // needed?
-  randperm(m - 1, perm.data()); // randomize the input planes
-  prev[0] = 1234567890;         // previous to 0 should never be used
-  next[0] = perm[0] + 1;        // link the zero position in at the beginning
-  prev[perm[0] + 1] = 0;        // link the other planes
-  for (int i = 0; i < m - 2; i++) {
-    next[perm[i] + 1] = perm[i + 1] + 1;
-    prev[perm[i + 1] + 1] = perm[i] + 1;
+    for (int j = 0; j < d; ++j)
+      _n_vec[j] = c(j);
+    _status = linprog(_halves.data(), istart, m, _n_vec.data(),
+                      _d_vec.data(), d, _opt.data(), _work.data(),
+                      _next.data(), _prev.data(), m);
+    _objective = c;
+    _solved = m;
   }
-  // flag the last plane
-  next[perm[m - 2] + 1] = m;
-  auto status = linprog(halves.data(), 0, m, n_vec.data(), d_vec.data(), d,
-                        opt.data(), work.data(), next.data(), prev.data(), m);
 
-  switch (status) {
+  switch (_status) {
   case INFEASIBLE:
-    //(void)printf("no feasible solution\n");
-    throw std::runtime_error("error in computing bounding box: LP infeasible");
-  // break;
+    return Status::Infeasible;
   case MINIMUM:
   case AMBIGUOUS:
     //  ambiguous occurs for example if we minimize x and the solution contains
     //  all points on a line-segment that is parallel to the y axis
-    if (opt[d] != 0.0)
-      return {opt[0] / opt[d], opt[1] / opt[d]};
-    else
-      // solution at infinity?
-      throw std::runtime_error(
-          "error in computing bounding box: LP solution at infinity?");
-  case UNBOUNDED:
+    if (_opt[d] != 0.0) {
+      x.resize(d);
+      for (int j = 0; j < d; ++j)
+        x(j) = _opt[j] / _opt[d];
+      return Status::Minimum;
+    }
+    return Status::Unbounded; // (the solution is at infinity)
+  default:
+    return Status::Unbounded;
+  }
+}
+
+std::vector<double> solve_lp2(const std::vector<double> &_halves,
+                              const std::vector<double> &c) {
+  SeidelLP lp;
+  lp.reserve(_halves.size() / 3);
+  for (size_t i = 0; i + 2 < _halves.size(); i += 3)
+    lp.addConstraint(Eigen::Vector2d(-_halves[i], -_halves[i + 1]),
+                     _halves[i + 2]);
+
+  Eigen::VectorXd x;
+  switch (lp.minimize(Eigen::Vector2d(c[0], c[1]), x)) {
+  case SeidelLP::Status::Infeasible:
+    throw std::runtime_error("error in computing bounding box: LP infeasible");
+  case SeidelLP::Status::Unbounded:
     throw std::runtime_error(
         "error in computing bounding box: LP region is unbounded");
   default:
-    throw std::runtime_error(
-        "error in computing bounding box: unknown problem with LP solver");
+    return {x(0), x(1)};
   }
 }
+
+Eigen::AlignedBoxXd boundingBoxLP(const Eigen::MatrixXd &A,
+                                  const Eigen::VectorXd &b) {
+  const int d = A.cols();
+  SeidelLP lp(d);
+  lp.reserve(A.rows());
+  lp.addConstraints(A, b);
+
+  // per coordinate, one LP for the minimum and one for the maximum
+  Eigen::AlignedBoxXd box(d);
+  Eigen::VectorXd c = Eigen::VectorXd::Zero(d);
+  Eigen::VectorXd x(d);
+  for (int i = 0; i < d; ++i)
+    for (double sign : {1.0, -1.0}) {
+      c(i) = sign;
+      switch (lp.minimize(c, x)) {
+      case SeidelLP::Status::Infeasible:
+        throw std::runtime_error(
+            "error in computing bounding box: LP infeasible");
+      case SeidelLP::Status::Unbounded:
+        throw std::runtime_error(
+            "error in computing bounding box: LP region is unbounded");
+      default:
+        break;
+      }
+      if (sign > 0)
+        box.min()(i) = x(i);
+      else
+        box.max()(i) = x(i);
+      c(i) = 0;
+    }
+  return box;
+}
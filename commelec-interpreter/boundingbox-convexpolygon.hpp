@@ -1,7 +1,7 @@
 // Function to compute bounding box of a convex polytope
 // Niek Bouman / Andrey Bernstein
 //
-// solve_lp2 re-uses code from Michael Hohmeyer, for which
+// SeidelLP re-uses code from Michael Hohmeyer, for which
 // license below applies:
 //
 // Copyright (c) 1990 Michael E. Hohmeyer, 
@@ -16,49 +16,105 @@
 #include <vector>
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Geometry>
+#include <stdexcept>
+#include <random>
+#include <commelec-interpreter/projection-convexpolygon.hpp>
+
+class SeidelLP {
+  // Seidel's randomized linear programming in d dimensions (the solver of
+  // externals/seidel_lp, whose expected running time is O(d! m) for m
+  // constraints), with a workspace that is kept between solves and a random
+  // generator of its own. After a solve, constraints may be added and the
+  // same objective solved again: only the new constraints are tested against
+  // the previous optimum (the incremental mode of linprog).
+public:
+  enum class Status { Minimum, Infeasible, Unbounded };
+
+  explicit SeidelLP(int dim = 2, unsigned seed = 5489u);
+
+  void reserve(size_t constraints);
+  // (no allocations until that many constraints have been added)
+  void clear();
+  // removes the constraints, but keeps the workspace
+
+  template <typename Derived>
+  void addConstraint(const Eigen::MatrixBase<Derived> &a, double b) {
+    // the half-space a^T x <= b
+    auto h = _halves.size();
+    _halves.resize(h + _dim + 1);
+    for (int j = 0; j < _dim; ++j)
+      _halves[h + j] = -a(j);
+    _halves[h + _dim] = b;
+    normalize(h);
+  }
+
+  template <typename DerivedA, typename DerivedB>
+  void addConstraints(const Eigen::MatrixBase<DerivedA> &A,
+                      const Eigen::MatrixBase<DerivedB> &b) {
+    for (auto i = 0; i < A.rows(); ++i)
+      addConstraint(A.row(i), b(i));
+  }
+
+  Status minimize(const Eigen::VectorXd &c, Eigen::VectorXd &x);
+  // minimizes c^T x over the constraints; x is only set if the status is
+  // Minimum (for an ambiguous minimum, it is one of the minimizers)
+
+  int dim() const { return _dim; }
+  size_t size() const { return _halves.size() / (_dim + 1) - 1; }
+
+private:
+  void normalize(size_t h);
+  // (linprog expects normalized coefficients)
+  int link(int first);
+  // links the constraints from index 'first' on, in random order, at the end
+  // of the list of constraints; returns the first of them in the list
+
+  int _dim;
+  std::vector<double> _halves; // (h_0, ..., h_d): h_0 x_0 + ... + h_d >= 0;
+                               // the first one is the trivial 0^T x + 1 >= 0
+  std::vector<int> _next, _prev, _perm;
+  std::vector<double> _work;
+  std::vector<double> _opt; // (homogeneous coordinates)
+  std::vector<double> _n_vec, _d_vec; // (the objective, as linprog takes it)
+  Eigen::VectorXd _objective;
+  int _solved; // number of half-spaces that _opt is optimal for (0: none)
+  int _status;
+  std::mt19937 _rng;
+};
 
 std::vector<double> solve_lp2(const std::vector<double> &_halves,
                               const std::vector<double> &c);
+// minimizes c^T x over the half-planes, given in the form of linprog (see
+// SeidelLP::_halves); throws std::runtime_error if there is no minimum
+
+Eigen::AlignedBoxXd boundingBoxLP(const Eigen::MatrixXd &A,
+                                  const Eigen::VectorXd &b);
+// the bounding box of {x : A x <= b} in any dimension, from 2 d LPs that
+// share one SeidelLP
 
 template <typename DerivedA, typename DerivedB>
 Eigen::AlignedBoxXd
 computeAABBConvexPolytope(const Eigen::MatrixBase<DerivedA> &A,
                           const Eigen::MatrixBase<DerivedB> &b) {
-  auto dim = 2;
-  auto numConstraints = A.rows();
-
-  std::vector<double> halves(numConstraints * (dim + 1));
-
-  // overlay with Eigen matrix map
-  Eigen::Map<
-      Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>
-      eigHalves(halves.data(), numConstraints, dim + 1);
-
-  // concat A with b
-  eigHalves << A, b;
-
-  // normalize A|b
-  auto sz = eigHalves.rows();
-  for (auto i = 0; i < sz; ++i)
-    eigHalves.row(i).normalize();
-
-  // solve the four linear programs to find, respectively, max x1, min x1, max
-  // x2, min x2. (for the variable x=(x1,x2))
-  // subject to Ax=b
-  auto sol = solve_lp2(halves, {1, 0});
-  auto xmax = -sol[0];
-  auto sol2 = solve_lp2(halves, {-1, 0});
-  auto xmin = -sol2[0];
-  auto sol3 = solve_lp2(halves, {0, 1});
-  auto ymax = -sol3[1];
-  auto sol4 = solve_lp2(halves, {0, -1});
-  auto ymin = -sol4[1];
-
-  Eigen::Vector2d minvec;
-  minvec << xmin, ymin;
-  Eigen::Vector2d maxvec;
-  maxvec << xmax, ymax;
-  return Eigen::AlignedBoxXd(minvec, maxvec);
+  if (A.cols() != 2)
+    return boundingBoxLP(A, b);
+
+  // in the plane, the four extremes of the polygon are read from its vertices
+  Vertices vertices;
+  switch (convexPolygonVertices(A, b, vertices)) {
+  case PolygonStatus::Empty:
+    throw std::runtime_error("error in computing bounding box: LP infeasible");
+  case PolygonStatus::Unbounded:
+    throw std::runtime_error(
+        "error in computing bounding box: LP region is unbounded");
+  default:
+    break;
+  }
+
+  Eigen::AlignedBoxXd box(2);
+  for (const auto &x : vertices)
+    box.extend(x);
+  return box;
 }
 
 #endif
@@ -0,0 +1,219 @@
+#include <commelec-interpreter/disk-polygon.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+DiskPolygon::DiskPolygon(const Eigen::Vector2d &center, double radius)
+    : _center(center), _radius(std::abs(radius)), _empty(false),
+      _tol(1e-9 * (std::abs(radius) + center.lpNorm<Eigen::Infinity>() + 1.0)) {
+  // (membership of a ball is tested against the squared radius, hence a
+  // negative radius has the same effect as its absolute value)
+}
+
+void DiskPolygon::addHalfPlane(const Eigen::Vector2d &a, double b) {
+  double norm = a.norm();
+  if (norm == 0) {
+    _empty = _empty || b < 0;
+    return;
+  }
+  _normals.push_back(a / norm);
+  _offsets.push_back(b / norm);
+}
+
+void DiskPolygon::addHalfPlanes(const Eigen::MatrixXd &A,
+                                const Eigen::VectorXd &b) {
+  for (auto i = 0; i < A.rows(); ++i)
+    addHalfPlane(Eigen::Vector2d(A.row(i).transpose()), b(i));
+}
+
+bool DiskPolygon::feasible(const Eigen::Vector2d &x) const {
+  if ((x - _center).norm() > _radius + _tol)
+    return false;
+  for (size_t i = 0; i < _normals.size(); ++i)
+    if (_normals[i].dot(x) - _offsets[i] > _tol)
+      return false;
+  return true;
+}
+
+void DiskPolygon::lineCircleIntersections(size_t i, Points &points) const {
+  const auto &a = _normals[i];
+  double d = _offsets[i] - a.dot(_center);
+  // (signed distance from the center to the i-th line)
+  if (std::abs(d) > _radius + _tol)
+    return;
+  Eigen::Vector2d foot = _center + d * a;
+  Eigen::Vector2d tangent(-a(1), a(0));
+  double h = std::sqrt(std::max(0.0, _radius * _radius - d * d));
+  points.push_back(foot + h * tangent);
+  points.push_back(foot - h * tangent);
+}
+
+DiskPolygon::Points DiskPolygon::vertices() const {
+  Points candidates;
+  auto m = _normals.size();
+  for (size_t i = 0; i < m; ++i)
+    lineCircleIntersections(i, candidates);
+  for (size_t i = 0; i < m; ++i)
+    for (size_t j = i + 1; j < m; ++j) {
+      const auto &ai = _normals[i];
+      const auto &aj = _normals[j];
+      double det = ai(0) * aj(1) - ai(1) * aj(0);
+      if (det == 0)
+        continue; // (parallel lines)
+      candidates.emplace_back((_offsets[i] * aj(1) - _offsets[j] * ai(1)) / det,
+                              (ai(0) * _offsets[j] - aj(0) * _offsets[i]) / det);
+    }
+
+  // keep the vertices that lie in the set, without duplicates (several lines
+  // may pass through the same vertex)
+  Points result;
+  for (const auto &x : candidates) {
+    if (!feasible(x))
+      continue;
+    bool duplicate = std::any_of(result.begin(), result.end(),
+                                 [&](const Eigen::Vector2d &y) {
+                                   return (x - y).norm() <= 10 * _tol;
+                                 });
+    if (!duplicate)
+      result.push_back(x);
+  }
+  return result;
+}
+
+bool DiskPolygon::project(const Eigen::Vector2d &point,
+                          Eigen::Vector2d &result) const {
+  // The nearest point of the set either is the point itself, or lies on one
+  // of the pieces of the boundary. On a piece, it is either the projection
+  // onto the circle or line that carries the piece, or one of the endpoints
+  // of the piece, which are vertices. We take the nearest candidate that lies
+  // in the set.
+  if (_empty)
+    return false;
+
+  bool inside = (point - _center).squaredNorm() <= _radius * _radius;
+  for (size_t i = 0; inside && i < _normals.size(); ++i)
+    inside = _normals[i].dot(point) <= _offsets[i];
+  if (inside) {
+    result = point;
+    return true;
+  }
+
+  double best = std::numeric_limits<double>::infinity();
+  auto consider = [&](const Eigen::Vector2d &x) {
+    double d = (x - point).squaredNorm();
+    if (d < best && feasible(x)) {
+      best = d;
+      result = x;
+    }
+  };
+
+  Eigen::Vector2d dir = point - _center;
+  double norm = dir.norm();
+  consider(_center + _radius * ((norm > 0) ? Eigen::Vector2d(dir / norm)
+                                           : Eigen::Vector2d(1, 0)));
+  // (if the point is the center, all points of the circle are equally near)
+  for (size_t i = 0; i < _normals.size(); ++i)
+    consider(point - (_normals[i].dot(point) - _offsets[i]) * _normals[i]);
+  for (const auto &x : vertices())
+    consider(x);
+
+  return best < std::numeric_limits<double>::infinity();
+}
+
+bool DiskPolygon::support(const Eigen::Vector2d &direction,
+                          Eigen::Vector2d &result) const {
+  // as for the bounding box: the maximum is attained at a vertex, or at the
+  // extreme point of the circle in the given direction
+  if (_empty)
+    return false;
+
+  double best = -std::numeric_limits<double>::infinity();
+  auto consider = [&](const Eigen::Vector2d &x) {
+    double value = direction.dot(x);
+    if (value > best) {
+      best = value;
+      result = x;
+    }
+  };
+
+  double norm = direction.norm();
+  Eigen::Vector2d extreme =
+      _center + _radius * ((norm > 0) ? Eigen::Vector2d(direction / norm)
+                                      : Eigen::Vector2d(1, 0));
+  if (feasible(extreme))
+    consider(extreme);
+  for (const auto &x : vertices())
+    consider(x);
+
+  return best > -std::numeric_limits<double>::infinity();
+}
+
+Eigen::AlignedBoxXd DiskPolygon::boundingBox() const {
+  // The extremes of a coordinate are attained at vertices, or at the extreme
+  // points of the circle in the direction of an axis
+  Eigen::AlignedBoxXd box(2);
+  if (_empty)
+    return box;
+
+  for (const auto &x : vertices())
+    box.extend(x);
+  for (int axis = 0; axis < 2; ++axis)
+    for (double sign : {-1.0, 1.0}) {
+      Eigen::Vector2d x = _center;
+      x(axis) += sign * _radius;
+      if (feasible(x))
+        box.extend(x);
+    }
+  return box;
+}
+
+Boundary DiskPolygon::boundary() const {
+  Boundary pieces;
+  if (_empty)
+    return pieces;
+
+  auto points = vertices();
+  if (points.empty()) {
+    // no line meets the disk, hence the set is either the disk or empty
+    Eigen::Vector2d start = _center + Eigen::Vector2d(_radius, 0);
+    if (feasible(start))
+      pieces.push_back(BoundaryPiece{start, true});
+    return pieces;
+  }
+  if (points.size() == 1) {
+    // a line touches the disk (the set is the disk), or the set consists of
+    // a single point
+    bool disk = _radius > _tol && feasible(_center);
+    pieces.push_back(BoundaryPiece{points[0], disk});
+    return pieces;
+  }
+
+  // sort the vertices counterclockwise around their mean, which lies in the
+  // (convex) set
+  Eigen::Vector2d mean = Eigen::Vector2d::Zero();
+  for (const auto &x : points)
+    mean += x;
+  mean /= points.size();
+  std::sort(points.begin(), points.end(),
+            [&](const Eigen::Vector2d &x, const Eigen::Vector2d &y) {
+              return std::atan2(x(1) - mean(1), x(0) - mean(0)) <
+                     std::atan2(y(1) - mean(1), y(0) - mean(0));
+            });
+
+  // consecutive vertices are joined by a segment if they lie on a common
+  // line whose half-plane is on the left (which is the inside of a
+  // counterclockwise boundary), and by an arc otherwise
+  auto n = points.size();
+  for (size_t k = 0; k < n; ++k) {
+    const auto &u = points[k];
+    const auto &w = points[(k + 1) % n];
+    Eigen::Vector2d right(w(1) - u(1), u(0) - w(0));
+    bool segment = false;
+    for (size_t i = 0; !segment && i < _normals.size(); ++i)
+      segment = std::abs(_normals[i].dot(u) - _offsets[i]) <= _tol &&
+                std::abs(_normals[i].dot(w) - _offsets[i]) <= _tol &&
+                _normals[i].dot(right) > 0;
+    pieces.push_back(BoundaryPiece{u, !segment});
+  }
+  return pieces;
+}
@@ -0,0 +1,72 @@
+// Exact geometry of the intersection of a disk and half-planes
+//
+// The PQ profiles and belief functions of batteries, fuel cells, PV inverters
+// and uncontrollable resources (see hlapi.cpp) are intersections of a disk
+// with a convex polygon and/or a rectangle. For such sets, the projection,
+// the axis-aligned bounding box and the boundary are computed in closed form:
+// they are determined by the vertices of the set (the points where two of
+// its boundary lines, or a line and the circle, intersect) and by a few
+// distinguished points of the circle and the lines.
+
+#ifndef DISKPOLYGON_HPP
+#define DISKPOLYGON_HPP
+
+#include <vector>
+#include <eigen3/Eigen/Core>
+#include <eigen3/Eigen/Geometry>
+
+struct BoundaryPiece {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  Eigen::Vector2d start;
+  bool arc;
+};
+
+using Boundary = std::vector<BoundaryPiece, Eigen::aligned_allocator<BoundaryPiece>>;
+// The boundary of a set is the closed curve through the starting points of
+// its pieces, in counterclockwise order. A piece ends where the next piece
+// starts, and is either a line segment or an arc of the circle
+// (counterclockwise around its center). A single arc is the full circle.
+
+class DiskPolygon {
+  // the set { x : |x - center| <= radius, a_i^T x <= b_i for all i }
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  DiskPolygon(const Eigen::Vector2d &center, double radius);
+
+  void addHalfPlane(const Eigen::Vector2d &a, double b);
+  void addHalfPlanes(const Eigen::MatrixXd &A, const Eigen::VectorXd &b);
+  // adds the half-plane { x : a^T x <= b }, or { x : A x <= b }
+
+  bool project(const Eigen::Vector2d &point, Eigen::Vector2d &result) const;
+  // Euclidean projection; returns false if the set is empty
+
+  bool support(const Eigen::Vector2d &direction, Eigen::Vector2d &result) const;
+  // a point of the set that maximizes direction^T x; returns false if the
+  // set is empty
+
+  Eigen::AlignedBoxXd boundingBox() const;
+  // the smallest axis-aligned box that contains the set (an empty box if the
+  // set is empty)
+
+  Boundary boundary() const;
+  // (empty if the set is empty)
+
+private:
+  using Points = std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>;
+
+  bool feasible(const Eigen::Vector2d &x) const;
+  // membership test that tolerates the rounding errors of points computed
+  // on the boundary
+  Points vertices() const;
+  void lineCircleIntersections(size_t i, Points &points) const;
+
+  Eigen::Vector2d _center;
+  double _radius;
+  Points _normals; // of unit length
+  std::vector<double> _offsets;
+  bool _empty;     // (due to a half-plane 0^T x <= b with b < 0)
+  double _tol;
+};
+
+#endif
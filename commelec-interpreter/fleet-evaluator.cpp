@@ -0,0 +1,239 @@
+#include <commelec-interpreter/fleet-evaluator.hpp>
+#include <chrono>
+#include <cmath>
+
+using namespace msg;
+
+WorkStealingPool::WorkStealingPool(unsigned threads)
+    : _generation(0), _pending(0), _stop(false) {
+  if (threads == 0)
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  for (unsigned i = 0; i < threads; ++i)
+    _queues.emplace_back(new Queue());
+  for (unsigned i = 0; i + 1 < threads; ++i)
+    _threads.emplace_back([this, i] {
+      size_t seen = 0;
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(_mutex);
+          _wake.wait(lock, [&] { return _stop || _generation != seen; });
+          if (_stop)
+            return;
+          seen = _generation;
+        }
+        work(i);
+      }
+    });
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+  for (auto &thread : _threads)
+    thread.join();
+}
+
+bool WorkStealingPool::pop(size_t thread, std::function<void()> *&task) {
+  auto n = _queues.size();
+  for (size_t k = 0; k < n; ++k) {
+    auto &queue = *_queues[(thread + k) % n];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+      continue;
+    if (k == 0) {
+      task = queue.tasks.front();
+      queue.tasks.pop_front();
+    } else {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void WorkStealingPool::work(size_t thread) {
+  std::function<void()> *task;
+  while (pop(thread, task)) {
+    (*task)();
+    if (--_pending == 0) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _done.notify_all();
+    }
+  }
+}
+
+void WorkStealingPool::run(std::vector<std::function<void()>> &tasks) {
+  if (tasks.empty())
+    return;
+  _pending = tasks.size();
+  // (before the tasks are queued: a thread that is still running work() from
+  // the previous call may start on them right away)
+  auto n = _queues.size();
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    auto &queue = *_queues[i % n];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(&tasks[i]);
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_generation;
+  }
+  _wake.notify_all();
+
+  work(n - 1);
+  std::unique_lock<std::mutex> lock(_mutex);
+  _done.wait(lock, [&] { return _pending == 0; });
+}
+
+namespace {
+
+double percentile(std::vector<double> &values, double q) {
+  // nearest-rank percentile; sorts the values
+  if (values.empty())
+    return 0;
+  std::sort(values.begin(), values.end());
+  auto rank = static_cast<size_t>(std::ceil(q * values.size()));
+  return values[std::min(std::max(rank, size_t(1)), values.size()) - 1];
+}
+
+} // namespace
+
+FleetEvaluator::FleetEvaluator(unsigned threads, size_t batchSize)
+    : _pool(threads), _batchSize(std::max(batchSize, size_t(1))) {}
+
+void FleetEvaluator::update(Message::Reader message) {
+  if (message.isAdvertisement())
+    update(message.getAgentId(), message.getAdvertisement());
+}
+
+void FleetEvaluator::update(uint32_t agentId, Advertisement::Reader adv) {
+  // (if the advertisement cannot be compiled, the exception of AdvFunc
+  // propagates and the previous advertisement is kept)
+  std::unique_ptr<Agent> agent(new Agent());
+  agent->message.setRoot(adv);
+  agent->interpreter.setAdv(
+      agent->message.getRoot<Advertisement>().asReader());
+  _agents[agentId] = std::move(agent);
+}
+
+void FleetEvaluator::remove(uint32_t agentId) { _agents.erase(agentId); }
+
+bool FleetEvaluator::contains(uint32_t agentId) const {
+  return _agents.find(agentId) != _agents.end();
+}
+
+void FleetEvaluator::query(Agent *agent, AdvFunc *interpreter,
+                           const AgentQuery &query, AgentResult &result) {
+  auto start = std::chrono::steady_clock::now();
+  result.agentId = query.agentId;
+  result.valid = false;
+  result.error.clear();
+  if (!agent) {
+    result.error = "Unknown agent.";
+  } else {
+    try {
+      auto adv = agent->message.getRoot<Advertisement>().asReader();
+      if (!interpreter->costFunction().valid())
+        throw EvaluationError("The advertisement has no valid cost function.");
+      Eigen::Vector2d setpoint(query.P, query.Q);
+      Eigen::Vector2d gradient;
+      result.cost = interpreter->evaluateWithGradient(
+          interpreter->costFunction(), setpoint, gradient);
+      result.gradient = gradient;
+      result.projection =
+          interpreter->project(adv.getPQProfile(), setpoint, ValueMap{});
+      result.beliefHull = interpreter->rectangularHull(
+          adv.getBeliefFunction(), {{"P", query.P}, {"Q", query.Q}});
+      result.valid = true;
+    } catch (const std::exception &e) {
+      result.error = e.what();
+    }
+  }
+  result.latency = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start).count();
+}
+
+const std::vector<AgentResult> &
+FleetEvaluator::evaluate(const std::vector<AgentQuery> &queries) {
+  auto start = std::chrono::steady_clock::now();
+  auto n = queries.size();
+  _results.resize(n);
+
+  std::vector<Agent *> agents(n);
+  std::vector<char> repeated(n, 0);
+  // whether the agent was queried in an earlier batch already
+  std::unordered_map<Agent *, size_t> firstBatch;
+  for (size_t i = 0; i < n; ++i) {
+    auto agent = _agents.find(queries[i].agentId);
+    agents[i] = (agent != _agents.end()) ? agent->second.get() : nullptr;
+    if (agents[i])
+      repeated[i] =
+          firstBatch.emplace(agents[i], i / _batchSize).first->second !=
+          i / _batchSize;
+  }
+
+  _tasks.clear();
+  for (size_t begin = 0; begin < n; begin += _batchSize) {
+    auto end = std::min(begin + _batchSize, n);
+    _tasks.push_back([this, &queries, &agents, &repeated, begin, end] {
+      // (the AdvFunc of an agent belongs to the batch of its first query)
+      std::unordered_map<Agent *, AdvFunc> contexts;
+      for (size_t i = begin; i < end; ++i) {
+        AdvFunc *interpreter = agents[i] ? &agents[i]->interpreter : nullptr;
+        if (repeated[i]) {
+          auto context = contexts.find(agents[i]);
+          if (context == contexts.end())
+            context = contexts.emplace(agents[i], interpreter->context()).first;
+          interpreter = &context->second;
+        }
+        query(agents[i], interpreter, queries[i], _results[i]);
+      }
+    });
+  }
+  _pool.run(_tasks);
+
+  _stats.agents = n;
+  _stats.tasks = _tasks.size();
+  _stats.duration = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+  std::vector<double> latencies(n);
+  for (size_t i = 0; i < n; ++i)
+    latencies[i] = _results[i].latency;
+  _stats.median = percentile(latencies, 0.5);
+  _stats.p90 = percentile(latencies, 0.9);
+  _stats.p99 = percentile(latencies, 0.99);
+  _stats.max = latencies.empty() ? 0 : latencies.back();
+
+  _durations.push_back(_stats.duration);
+  if (_durations.size() > HISTORY)
+    _durations.pop_front();
+  return _results;
+}
+
+const std::vector<AgentResult> &FleetEvaluator::evaluate() {
+  _all.clear();
+  for (const auto &agent : _agents) {
+    AgentQuery query{agent.first, 0, 0};
+    auto setpoint =
+        agent.second->message.getRoot<Advertisement>().getImplementedSetpoint();
+    if (setpoint.size() == 2) {
+      query.P = setpoint[0];
+      query.Q = setpoint[1];
+    }
+    _all.push_back(query);
+  }
+  std::sort(_all.begin(), _all.end(),
+            [](const AgentQuery &a, const AgentQuery &b) {
+              return a.agentId < b.agentId;
+            });
+  return evaluate(_all);
+}
+
+double FleetEvaluator::cyclePercentile(double q) const {
+  std::vector<double> durations(_durations.begin(), _durations.end());
+  return percentile(durations, q);
+}
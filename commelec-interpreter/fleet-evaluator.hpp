@@ -0,0 +1,138 @@
+// Evaluation of the advertisements of a fleet of resource agents
+//
+// In every control cycle, a grid agent queries the advertisement of every
+// resource agent it serves: the cost and its gradient at a setpoint, the
+// projection of the setpoint onto the PQ profile, and the rectangular hull of
+// the belief function. A FleetEvaluator holds the latest advertisement of
+// every agent (by agentId) and answers the queries of a cycle in parallel:
+// the agents are split into batches, and the batches are run as tasks on a
+// WorkStealingPool. Every agent has an AdvFunc of its own, which the batch of
+// its first query uses; if the queries name an agent again in another batch,
+// that batch evaluates it in a context of its own (see AdvFunc::context), so
+// that the tasks share no state.
+//
+// The latency of every agent is measured; the percentiles of the latencies of
+// a cycle, and of the durations of past cycles, are reported.
+
+#ifndef FLEETEVALUATOR_HPP
+#define FLEETEVALUATOR_HPP
+
+#include <commelec-interpreter/adv-interpreter.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(unsigned threads = 0);
+  // threads = 0: one thread per core (the thread calling run() counts as one)
+  ~WorkStealingPool();
+
+  unsigned size() const { return _queues.size(); }
+
+  void run(std::vector<std::function<void()>> &tasks);
+  // Runs the tasks and returns when all of them are done; the calling thread
+  // runs tasks as well. The tasks are dealt round-robin to the threads; a
+  // thread whose queue is empty steals from the back of the other queues.
+  // Tasks must not throw.
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()> *> tasks;
+  };
+
+  bool pop(size_t thread, std::function<void()> *&task);
+  void work(size_t thread);
+  // runs tasks until all queues are empty
+
+  std::vector<std::unique_ptr<Queue>> _queues;
+  // one per thread; the last one is that of the thread calling run()
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _done;
+  size_t _generation; // (number of calls of run)
+  std::atomic<size_t> _pending; // tasks not finished yet
+  bool _stop;
+};
+
+struct AgentQuery {
+  uint32_t agentId;
+  double P;
+  double Q;
+};
+
+struct AgentResult {
+  uint32_t agentId;
+  bool valid; // false if the agent is unknown, or its advertisement invalid
+  std::string error; // (if not valid)
+  double cost;
+  Eigen::VectorXd gradient;
+  Eigen::VectorXd projection; // of the setpoint onto the PQ profile
+  Eigen::AlignedBoxXd beliefHull; // at the setpoint
+  double latency; // in seconds
+};
+
+struct CycleStats {
+  size_t agents = 0;
+  size_t tasks = 0;
+  double duration = 0; // in seconds
+  double median = 0;   // percentiles of the latencies of the agents
+  double p90 = 0;
+  double p99 = 0;
+  double max = 0;
+};
+
+class FleetEvaluator {
+public:
+  explicit FleetEvaluator(unsigned threads = 0, size_t batchSize = 16);
+
+  void update(msg::Message::Reader message);
+  // stores the advertisement of the message, if it carries one
+  void update(uint32_t agentId, msg::Advertisement::Reader adv);
+  // The advertisement is copied (and compiled); it replaces the previous
+  // advertisement of the agent. Throws as the constructor of AdvFunc (the
+  // previous advertisement is then kept).
+  void remove(uint32_t agentId);
+  bool contains(uint32_t agentId) const;
+  size_t size() const { return _agents.size(); }
+
+  const std::vector<AgentResult> &evaluate(const std::vector<AgentQuery> &queries);
+  const std::vector<AgentResult> &evaluate();
+  // One cycle: the results are in the order of the queries, or by agentId for
+  // the queries of all agents at their implemented setpoints. An agent may be
+  // queried several times. update() and remove() must not be called during a
+  // cycle.
+
+  const CycleStats &stats() const { return _stats; } // of the last cycle
+  double cyclePercentile(double q) const;
+  // q-th quantile (0 <= q <= 1) of the durations of the last cycles
+  static const size_t HISTORY = 1000; // (number of cycles kept)
+
+private:
+  struct Agent {
+    capnp::MallocMessageBuilder message;
+    AdvFunc interpreter;
+  };
+
+  void query(Agent *agent, AdvFunc *interpreter, const AgentQuery &query,
+             AgentResult &result);
+  // (interpreter: that of the agent, or a context of it)
+
+  WorkStealingPool _pool;
+  size_t _batchSize;
+  std::unordered_map<uint32_t, std::unique_ptr<Agent>> _agents;
+  std::vector<AgentResult> _results;
+  std::vector<std::function<void()>> _tasks;
+  std::vector<AgentQuery> _all; // (for evaluate())
+  CycleStats _stats;
+  std::deque<double> _durations;
+};
+
+#endif
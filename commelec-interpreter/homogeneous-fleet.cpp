@@ -0,0 +1,127 @@
+#include <commelec-interpreter/homogeneous-fleet.hpp>
+
+using namespace msg;
+
+size_t HomogeneousFleet::shapeFor(const AdvStructure &structure,
+                                  Advertisement::Reader adv) {
+  auto candidates = _shapesByHash.equal_range(structure.hash);
+  for (auto candidate = candidates.first; candidate != candidates.second;
+       ++candidate)
+    if (_shapes[candidate->second]->signature == structure.signature)
+      return candidate->second;
+
+  std::unique_ptr<Shape> shape(new Shape());
+  shape->signature = structure.signature;
+  shape->message.setRoot(adv);
+  shape->interpreter.setAdv(shape->message.getRoot<Advertisement>().asReader(),
+                            true);
+  // (the literals of the copy are in the same order as those of adv)
+  auto model = shape->interpreter.model();
+  shape->columns.resize(model->bindings.size());
+  shape->constants.assign(model->program.constants.size(), nullptr);
+  _shapes.push_back(std::move(shape));
+  _shapesByHash.emplace(structure.hash, _shapes.size() - 1);
+  return _shapes.size() - 1;
+}
+
+void HomogeneousFleet::insert(size_t index, size_t shape,
+                              const AdvStructure &structure) {
+  auto &s = *_shapes[shape];
+  const auto &bindings = s.interpreter.model()->bindings;
+  for (size_t k = 0; k < bindings.size(); ++k)
+    s.columns[k].push_back(structure.literals[bindings[k].second]);
+  s.lanes.push_back(index);
+  _members[index] = Member{shape, s.lanes.size() - 1};
+}
+
+void HomogeneousFleet::erase(size_t index) {
+  // moves the last lane of the shape into the lane of the member
+  auto member = _members[index];
+  auto &s = *_shapes[member.shape];
+  auto last = s.lanes.size() - 1;
+  for (auto &column : s.columns) {
+    column[member.lane] = column[last];
+    column.pop_back();
+  }
+  s.lanes[member.lane] = s.lanes[last];
+  s.lanes.pop_back();
+  if (member.lane != last)
+    _members[s.lanes[member.lane]].lane = member.lane;
+}
+
+size_t HomogeneousFleet::add(Advertisement::Reader adv) {
+  auto structure = structureOf(adv);
+  auto shape = shapeFor(structure, adv);
+  _members.push_back(Member{shape, 0});
+  insert(_members.size() - 1, shape, structure);
+  return _members.size() - 1;
+}
+
+void HomogeneousFleet::update(size_t index, Advertisement::Reader adv) {
+  auto structure = structureOf(adv);
+  auto shape = shapeFor(structure, adv);
+  auto member = _members[index];
+  if (shape != member.shape) {
+    erase(index);
+    insert(index, shape, structure);
+    return;
+  }
+  auto &s = *_shapes[shape];
+  const auto &bindings = s.interpreter.model()->bindings;
+  for (size_t k = 0; k < bindings.size(); ++k)
+    s.columns[k][member.lane] = structure.literals[bindings[k].second];
+}
+
+void HomogeneousFleet::gather(Shape &shape, const double *P, const double *Q) {
+  auto n = shape.lanes.size();
+  _P.resize(n);
+  _Q.resize(n);
+  for (size_t lane = 0; lane < n; ++lane) {
+    _P[lane] = P[shape.lanes[lane]];
+    _Q[lane] = Q[shape.lanes[lane]];
+  }
+  const auto &bindings = shape.interpreter.model()->bindings;
+  for (size_t k = 0; k < bindings.size(); ++k)
+    shape.constants[bindings[k].first] = shape.columns[k].data();
+}
+
+void HomogeneousFleet::evaluateCost(const double *P, const double *Q,
+                                    double *out) {
+  for (auto &shape : _shapes) {
+    auto n = shape->lanes.size();
+    if (n == 0)
+      continue;
+    auto &interpreter = shape->interpreter;
+    if (!interpreter.costFunction().valid())
+      throw EvaluationError("HomogeneousFleet::evaluateCost: advertisement "
+                            "without cost function");
+    gather(*shape, P, Q);
+    _out.resize(n);
+    const double *values[] = {_P.data(), _Q.data()};
+    // P and Q occupy slots P_SLOT and Q_SLOT
+    interpreter.evaluateBatch(interpreter.costFunction(), values, 2,
+                              shape->constants.data(), n, _out.data());
+    for (size_t lane = 0; lane < n; ++lane)
+      out[shape->lanes[lane]] = _out[lane];
+  }
+}
+
+void HomogeneousFleet::testPQProfile(const double *P, const double *Q,
+                                     bool *out) {
+  for (auto &shape : _shapes) {
+    auto n = shape->lanes.size();
+    if (n == 0)
+      continue;
+    auto &interpreter = shape->interpreter;
+    if (!interpreter.pqProfile().valid())
+      throw EvaluationError("HomogeneousFleet::testPQProfile: advertisement "
+                            "without PQ profile");
+    gather(*shape, P, Q);
+    std::unique_ptr<bool[]> mask(new bool[n]);
+    interpreter.testMembershipBatch(interpreter.pqProfile(), _P.data(),
+                                    _Q.data(), shape->constants.data(), n,
+                                    mask.get());
+    for (size_t lane = 0; lane < n; ++lane)
+      out[shape->lanes[lane]] = mask[lane];
+  }
+}
@@ -0,0 +1,72 @@
+// Fleets of advertisements of the same structure
+//
+// Most resources of a fleet advertise with the same code (for example,
+// _BatteryAdvertisement or _PVAdvertisement), so that their advertisements
+// differ only in their literals (see adv-structure.hpp). A HomogeneousFleet
+// groups the advertisements by structure. Every group ("shape") has one
+// program, compiled in parametric mode from its first advertisement, and
+// stores the literals of its members column-wise: one array per bound
+// constant of the program, with one entry per member. The batch executor
+// then evaluates the cost functions (or tests the PQ profiles) of all
+// members of a shape at once, with the members as lanes (see
+// AdvFunc::evaluateBatch).
+
+#ifndef HOMOGENEOUSFLEET_HPP
+#define HOMOGENEOUSFLEET_HPP
+
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <commelec-interpreter/adv-structure.hpp>
+
+#include <memory>
+
+class HomogeneousFleet {
+public:
+  size_t add(msg::Advertisement::Reader adv);
+  // returns the index of the advertisement in the fleet; only the literals
+  // are kept, except for the first advertisement of a shape, which is copied
+  void update(size_t index, msg::Advertisement::Reader adv);
+  // replaces the advertisement at index (which moves to another shape if its
+  // structure differs)
+
+  size_t size() const { return _members.size(); }
+  size_t shapes() const { return _shapes.size(); }
+  size_t shapeOf(size_t index) const { return _members[index].shape; }
+
+  void evaluateCost(const double *P, const double *Q, double *out);
+  // out[i] is the cost of the i-th advertisement at (P[i], Q[i])
+  void testPQProfile(const double *P, const double *Q, bool *out);
+  // out[i] tells whether (P[i], Q[i]) lies in the PQ profile of the i-th
+  // advertisement
+
+private:
+  struct Shape {
+    std::string signature; // (see AdvStructure)
+    capnp::MallocMessageBuilder message; // the first advertisement
+    AdvFunc interpreter; // (parametric)
+    std::vector<std::vector<double>> columns;
+    // one per binding of the program (see AdvModel::bindings), with the
+    // literal of every member
+    std::vector<const double *> constants;
+    // one per constant of the program: the column of its binding, or nullptr
+    std::vector<size_t> lanes; // the index of every member in the fleet
+  };
+  struct Member {
+    size_t shape;
+    size_t lane;
+  };
+
+  size_t shapeFor(const AdvStructure &structure, msg::Advertisement::Reader adv);
+  void insert(size_t index, size_t shape, const AdvStructure &structure);
+  void erase(size_t index);
+  void gather(Shape &shape, const double *P, const double *Q);
+  // copies the points of the members to _P and _Q, in the order of the lanes,
+  // and points the constants to the columns
+
+  std::vector<std::unique_ptr<Shape>> _shapes;
+  std::unordered_multimap<uint64_t, size_t> _shapesByHash;
+  std::vector<Member> _members;
+  std::vector<double> _P, _Q; // (the points of the lanes of a shape)
+  std::vector<double> _out;
+};
+
+#endif
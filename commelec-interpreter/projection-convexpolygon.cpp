@@ -0,0 +1,216 @@
+#include <commelec-interpreter/projection-convexpolygon.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+struct Line {
+  // the half-plane a^T x <= b, with |a| = 1; it lies to the left of its
+  // boundary line, directed along (-a_2, a_1)
+  double ax, ay, b;
+  double angle; // of the direction of the line
+
+  bool out(const Eigen::Vector2d &x, double eps) const {
+    return ax * x(0) + ay * x(1) - b > eps;
+  }
+};
+
+Line makeLine(double ax, double ay, double b) {
+  return Line{ax, ay, b, std::atan2(ax, -ay)};
+}
+
+void sortByAngle(std::vector<Line> &lines) {
+  // of several half-planes with the same angle, only the smallest counts
+  std::sort(lines.begin(), lines.end(), [](const Line &l, const Line &m) {
+    return (l.angle < m.angle) || (l.angle == m.angle && l.b < m.b);
+  });
+  lines.erase(std::unique(lines.begin(), lines.end(),
+                          [](const Line &l, const Line &m) {
+                            return std::abs(l.angle - m.angle) < 1e-12;
+                          }),
+              lines.end());
+}
+
+Eigen::Vector2d intersect(const Line &l, const Line &m) {
+  double det = l.ax * m.ay - l.ay * m.ax;
+  return Eigen::Vector2d((l.b * m.ay - m.b * l.ay) / det,
+                         (l.ax * m.b - m.ax * l.b) / det);
+}
+
+bool intersectLines(const std::vector<Line> &lines, double eps,
+                    Vertices &vertices) {
+  // The half-planes are sorted by angle; the deque holds the half-planes
+  // whose boundary lines carry the edges of the intersection of the
+  // half-planes processed so far. Requires that this intersection is bounded.
+  // Returns false if it is empty.
+  std::vector<const Line *> dq(lines.size());
+  size_t front = 0, back = 0; // dq[front, back)
+  for (const auto &line : lines) {
+    while (back - front > 1 &&
+           line.out(intersect(*dq[back - 1], *dq[back - 2]), eps))
+      --back;
+    while (back - front > 1 &&
+           line.out(intersect(*dq[front], *dq[front + 1]), eps))
+      ++front;
+    if (back - front > 0) {
+      const auto &last = *dq[back - 1];
+      double cross = last.ax * line.ay - last.ay * line.ax;
+      if (std::abs(cross) < 1e-12 && last.ax * line.ax + last.ay * line.ay < 0)
+        return false; // (opposite half-planes that do not overlap)
+    }
+    dq[back++] = &line;
+  }
+  while (back - front > 2 &&
+         dq[front]->out(intersect(*dq[back - 1], *dq[back - 2]), eps))
+    --back;
+  while (back - front > 2 &&
+         dq[back - 1]->out(intersect(*dq[front], *dq[front + 1]), eps))
+    ++front;
+  if (back - front < 3)
+    return false;
+
+  vertices.clear();
+  for (size_t i = front; i < back; ++i)
+    vertices.push_back(intersect(*dq[i], *dq[(i + 1 < back) ? i + 1 : front]));
+  return true;
+}
+
+std::vector<Line> normalized(const Eigen::MatrixXd &A, const Eigen::VectorXd &b,
+                             double &scale) {
+  // the half-planes with a nonzero normal; returns an empty list, and sets
+  // scale to -1, if some half-plane 0^T x <= b with b < 0 is empty
+  std::vector<Line> lines;
+  scale = 1;
+  for (auto i = 0; i < A.rows(); ++i) {
+    double norm = A.row(i).norm();
+    if (norm == 0) {
+      if (b(i) < 0) {
+        scale = -1;
+        return std::vector<Line>();
+      }
+      continue;
+    }
+    lines.push_back(makeLine(A(i, 0) / norm, A(i, 1) / norm, b(i) / norm));
+    scale = std::max(scale, std::abs(lines.back().b));
+  }
+  return lines;
+}
+
+bool intersectBox(const std::vector<Line> &lines, double R, double eps,
+                  Vertices &vertices) {
+  std::vector<Line> boxed(lines);
+  for (int axis = 0; axis < 2; ++axis)
+    for (double sign : {-1.0, 1.0})
+      boxed.push_back(makeLine(sign * (1 - axis), sign * axis, R));
+  sortByAngle(boxed);
+  return intersectLines(boxed, eps, vertices);
+}
+
+} // namespace
+
+PolygonStatus convexPolygonVertices(const Eigen::MatrixXd &A,
+                                    const Eigen::VectorXd &b,
+                                    Vertices &vertices) {
+  vertices.clear();
+  double scale;
+  auto lines = normalized(A, b, scale);
+  if (scale < 0)
+    return PolygonStatus::Empty; // (0^T x <= b with b < 0)
+  const double eps = 1e-9 * scale;
+
+  sortByAngle(lines);
+
+  // The polygon is bounded (or empty) if and only if the normals of its
+  // half-planes leave no angular gap of pi or more
+  const double pi = std::acos(-1.0);
+  bool bounded = !lines.empty();
+  for (size_t i = 0; bounded && i < lines.size(); ++i) {
+    double next = (i + 1 < lines.size()) ? lines[i + 1].angle
+                                         : lines[0].angle + 2 * pi;
+    bounded = next - lines[i].angle < pi - 1e-12;
+  }
+  if (bounded)
+    return intersectLines(lines, eps, vertices) ? PolygonStatus::Bounded
+                                                : PolygonStatus::Empty;
+
+  // an unbounded region may still be empty: we intersect it with a large box
+  // to find out
+  Vertices corners;
+  bool empty = !intersectBox(lines, 1e6 * scale, eps, corners);
+  return empty ? PolygonStatus::Empty : PolygonStatus::Unbounded;
+}
+
+bool boxedPolygonVertices(const Eigen::MatrixXd &A, const Eigen::VectorXd &b,
+                          double R, Vertices &vertices) {
+  vertices.clear();
+  double scale;
+  auto lines = normalized(A, b, scale);
+  if (scale < 0)
+    return false;
+  return intersectBox(lines, R, 1e-9 * std::max(scale, R), vertices);
+}
+
+Eigen::Vector2d projectOntoPolygon(const Vertices &vertices,
+                                   const Eigen::Vector2d &point) {
+  auto n = vertices.size();
+  assert(n > 0);
+  bool inside = (n > 2);
+  // (a polygon of one or two vertices is a point or a segment)
+  double best = std::numeric_limits<double>::infinity();
+  Eigen::Vector2d result = vertices[0];
+  for (size_t i = 0; i < n; ++i) {
+    const Eigen::Vector2d &p = vertices[i];
+    Eigen::Vector2d edge = vertices[(i + 1) % n] - p;
+    Eigen::Vector2d rel = point - p;
+    if (edge(0) * rel(1) - edge(1) * rel(0) < 0)
+      inside = false; // (the point lies to the right of the edge)
+    double len2 = edge.squaredNorm();
+    double t = (len2 > 0) ? std::min(std::max(edge.dot(rel) / len2, 0.0), 1.0)
+                          : 0.0;
+    Eigen::Vector2d x = p + t * edge;
+    double d = (x - point).squaredNorm();
+    if (d < best) {
+      best = d;
+      result = x;
+    }
+  }
+  return inside ? point : result;
+}
+
+bool projectConvexPolygon(const Eigen::MatrixXd &A, const Eigen::VectorXd &b,
+                          const Eigen::Vector2d &point,
+                          Eigen::Vector2d &result) {
+  if (((A * point).array() <= b.array()).all()) {
+    result = point;
+    return true;
+  }
+
+  Vertices vertices;
+  switch (convexPolygonVertices(A, b, vertices)) {
+  case PolygonStatus::Empty:
+    return false;
+  case PolygonStatus::Bounded:
+    result = projectOntoPolygon(vertices, point);
+    return true;
+  default:
+    break;
+  }
+
+  // The projection x is no farther from the point than any point q of the
+  // polygon, so that |x|_inf <= |point|_inf + |q - point|. We find some q in
+  // a box around the origin, growing the box until it meets the polygon; in
+  // a box of that size, the boxed polygon has the same projection.
+  double R = 1 + point.cwiseAbs().maxCoeff();
+  while (!boxedPolygonVertices(A, b, R, vertices)) {
+    R *= 1e3;
+    if (!std::isfinite(R))
+      return false;
+  }
+  double needed = 1 + point.cwiseAbs().maxCoeff() + (vertices[0] - point).norm();
+  if (needed > R && !boxedPolygonVertices(A, b, 2 * needed, vertices))
+    return false;
+  result = projectOntoPolygon(vertices, point);
+  return true;
+}
@@ -0,0 +1,45 @@
+// Exact geometry of a convex polygon in the plane, given as an intersection
+// of half-planes {x : A x <= b}: its vertices, and the Euclidean projection of
+// a point onto it
+
+#ifndef PROJPOLYGON_HPP
+#define PROJPOLYGON_HPP
+
+#include <vector>
+#include <eigen3/Eigen/Core>
+
+using Vertices = std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>>;
+
+enum class PolygonStatus { Bounded, Empty, Unbounded };
+
+PolygonStatus convexPolygonVertices(const Eigen::MatrixXd &A,
+                                    const Eigen::VectorXd &b,
+                                    Vertices &vertices);
+// Computes the vertices of the polygon {x : A x <= b}, in counterclockwise
+// order, by a single pass over its half-planes sorted by angle (O(m log m)
+// for m constraints). The extremes of the polygon in any direction (in
+// particular, its bounding box) are attained at these vertices. If the
+// polygon is empty or unbounded, no vertices are returned.
+
+bool boxedPolygonVertices(const Eigen::MatrixXd &A, const Eigen::VectorXd &b,
+                          double R, Vertices &vertices);
+// Likewise for the polygon cut off by the box [-R,R]^2: its vertices in the
+// box, the points where its boundary (for an unbounded polygon, its two
+// recession rays) leaves the box, and the corners of the box in between.
+// Returns false if the polygon does not meet the box.
+
+bool projectConvexPolygon(const Eigen::MatrixXd &A, const Eigen::VectorXd &b,
+                          const Eigen::Vector2d &point,
+                          Eigen::Vector2d &result);
+// Computes the projection in closed form, from the vertices of the polygon
+// (O(m log m) for m constraints). An unbounded polygon is cut off by a box
+// that contains the projection, so that the projection onto the boxed
+// polygon is the same. Returns false if the polygon is empty.
+
+Eigen::Vector2d projectOntoPolygon(const Vertices &vertices,
+                                   const Eigen::Vector2d &point);
+// The projection onto the convex polygon with the given vertices, in
+// counterclockwise order (at least one): the point itself if it lies inside,
+// otherwise the nearest point of the edges, in O(m) for m vertices.
+
+#endif
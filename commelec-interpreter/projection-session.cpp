@@ -0,0 +1,184 @@
+#include <commelec-interpreter/projection-session.hpp>
+#include <eigen3/Eigen/QR>
+#include <algorithm>
+
+using namespace msg;
+
+ProjectionSession::ProjectionSession(AdvFunc &interpreter, SetExpr::Reader set,
+                                     ProjectionOptions options)
+    : _interpreter(interpreter), _set(set), _options(options), _count(0),
+      _dim(0), _warm(false), _history(0), _next(0) {
+  _options.memory = std::max(_options.memory, 1);
+}
+
+void ProjectionSession::reset() {
+  _warm = false;
+  _history = 0;
+  _next = 0;
+}
+
+void ProjectionSession::prepare(size_t dim) {
+  // (re)allocates the workspace only when the shape of the problem changes
+  auto n = _count * dim;
+  if (static_cast<size_t>(_y.size()) != n) {
+    _y.setZero(n);
+    _Ty.resize(n);
+    _g.resize(n);
+    _gPrev.resize(n);
+    _TyPrev.resize(n);
+    _dG.resize(n, _options.memory);
+    _dTy.resize(n, _options.memory);
+    _warm = false;
+  }
+  if (static_cast<size_t>(_x.size()) != dim) {
+    _x.resize(dim);
+    _xPrev.resize(dim);
+    _z.resize(dim);
+  }
+  _dim = dim;
+  if (!_options.warmStart || !_warm)
+    _y.setZero();
+  _history = 0;
+  _next = 0;
+}
+
+Eigen::VectorXd ProjectionSession::projectOnto(size_t i,
+                                               const Eigen::VectorXd &z) {
+  if (_set.which() == SetExpr::CONVEX_POLYTOPE)
+    return _interpreter.proj(_halfSpaces[i], z);
+  return _interpreter.proj(_set.getIntersection()[i], z);
+}
+
+void ProjectionSession::sweep(const Eigen::VectorXd &point) {
+  // Dykstra's algorithm maintains x = point - sum_i y_i, hence a pass may
+  // start from any dual variables (in particular, from those of the previous
+  // call), and still converges to the projection of the point
+  _x = point;
+  for (size_t i = 0; i < _count; ++i)
+    _x -= _y.segment(i * _dim, _dim);
+
+  for (size_t i = 0; i < _count; ++i) {
+    _z = _x + _y.segment(i * _dim, _dim);
+    _x = projectOnto(i, _z);
+    _Ty.segment(i * _dim, _dim) = _z - _x;
+  }
+  _interpreter._nesting_depth = 0;
+  // (every projection counts as a nesting level; a long run is no cycle of
+  // references)
+}
+
+void ProjectionSession::extrapolate() {
+  if (!_options.accelerate) {
+    _y = _Ty;
+    return;
+  }
+
+  // Anderson extrapolation (type II) of the fixed-point iteration y -> Ty
+  _g = _Ty - _y;
+  if (_stats.iterations > 1) {
+    if (_g.norm() > _gPrev.norm()) {
+      // the extrapolation did not pay off: restart from a plain step
+      _history = 0;
+      _next = 0;
+    } else {
+      _dG.col(_next) = _g - _gPrev;
+      _dTy.col(_next) = _Ty - _TyPrev;
+      _next = (_next + 1) % _options.memory;
+      _history = std::min(_history + 1, _options.memory);
+    }
+  }
+  _gPrev = _g;
+  _TyPrev = _Ty;
+
+  if (_history == 0) {
+    _y = _Ty;
+    return;
+  }
+  Eigen::VectorXd gamma =
+      _dG.leftCols(_history).colPivHouseholderQr().solve(_g);
+  _y = _Ty - _dTy.leftCols(_history) * gamma;
+}
+
+Eigen::VectorXd ProjectionSession::dykstra(const Eigen::VectorXd &point) {
+  // reference: Shih-Ping Han - A Successive Projection Method
+  //            Mathematical Programming 40 (1988) p. 1-14
+  prepare(point.size());
+
+  _xPrev = point;
+  for (size_t i = 0; i < _count; ++i)
+    _xPrev -= _y.segment(i * _dim, _dim);
+
+  _stats.converged = false;
+  while (_stats.iterations < _options.maxIterations) {
+    ++_stats.iterations;
+    sweep(point);
+    _stats.residual = (_x - _xPrev).norm();
+    if (_stats.residual < _options.threshold) {
+      _stats.converged = true;
+      _y = _Ty;
+      break;
+    }
+    _xPrev = _x;
+    extrapolate();
+  }
+
+  _warm = _stats.converged;
+  // (the dual variables of a failed call are no good starting point)
+  if (!_stats.converged)
+    throw NoConvergence("Dykstra's algorithm did not converge.");
+  return _x;
+}
+
+Eigen::VectorXd ProjectionSession::project(const Eigen::VectorXd &point,
+                                           const ValueMap &bound_vars) {
+  assert(_interpreter._advValid);
+  _interpreter.beginEvaluation(bound_vars);
+  _stats = ProjectionStats();
+
+  if (_set.which() == SetExpr::INTERSECTION) {
+    auto intersection = _set.getIntersection();
+    if (_interpreter.membership(intersection, point))
+      return point;
+
+    Ball::Reader disk;
+    if (point.size() == 2 && _interpreter.isDiskPolygon(intersection, disk)) {
+      Eigen::Vector2d result;
+      if (_interpreter.evalDiskPolygon(disk, intersection)
+              .project(Eigen::Vector2d(point), result))
+        return result;
+      else
+        throw EvaluationError("Projection onto an empty set.");
+    }
+
+    _count = intersection.size();
+    return dykstra(point);
+  }
+
+  if (_set.which() == SetExpr::CONVEX_POLYTOPE && point.size() != 2) {
+    if (_interpreter.membership(_set, point))
+      return point;
+
+    if (auto cached = _interpreter.cachedPolytope(_set)) {
+      _halfSpaces.resize(cached->A.rows());
+      for (size_t i = 0; i < _halfSpaces.size(); ++i) {
+        _halfSpaces[i].a = cached->A.row(i).transpose();
+        _halfSpaces[i].b = cached->b(i);
+      }
+    } else {
+      auto poly = _set.getConvexPolytope();
+      auto A = poly.getA();
+      auto b = poly.getB();
+      _halfSpaces.resize(A.size());
+      for (size_t i = 0; i < A.size(); ++i) {
+        _halfSpaces[i].a = _interpreter.evalToVector(A[i]);
+        _halfSpaces[i].b = _interpreter.eval(b[i]);
+      }
+    }
+    _count = _halfSpaces.size();
+    return dykstra(point);
+  }
+
+  // other sets are projected onto directly (and in the PQ plane, polygons
+  // exactly)
+  return _interpreter.proj(_set, point);
+}
@@ -0,0 +1,77 @@
+// Repeated projections onto the same set
+//
+// In the projected-gradient steps of the grid agent, the same set is
+// projected onto many times, at points that move only slightly between
+// calls. A ProjectionSession keeps the dual variables of Dykstra's algorithm
+// (the increments y_i, one per intersected set) between calls and starts the
+// next call from them, which typically saves most of the iterations. Its
+// workspace is allocated once, and the number of iterations and the final
+// residual of each call are reported.
+//
+// Optionally, the iterations are accelerated by Anderson extrapolation of the
+// dual variables (with a restart whenever the fixed-point residual grows).
+
+#ifndef PROJECTIONSESSION_HPP
+#define PROJECTIONSESSION_HPP
+
+#include <commelec-interpreter/adv-interpreter.hpp>
+
+struct ProjectionOptions {
+  double threshold = 1.0e-3; // on the distance between successive iterates
+  int maxIterations = 1000;
+  bool warmStart = true;
+  bool accelerate = false;
+  int memory = 5; // (number of past iterates used by Anderson extrapolation)
+};
+
+struct ProjectionStats {
+  int iterations = 0; // (0 if the projection was computed exactly)
+  double residual = 0; // distance between the last two iterates
+  bool converged = true;
+};
+
+class ProjectionSession {
+public:
+  ProjectionSession(AdvFunc &interpreter, msg::SetExpr::Reader set,
+                    ProjectionOptions options = ProjectionOptions());
+
+  Eigen::VectorXd project(const Eigen::VectorXd &point,
+                          const ValueMap &bound_vars);
+  // Same result as AdvFunc::project (up to the threshold). Throws
+  // NoConvergence if the maximum number of iterations is reached; stats()
+  // then still describes the failed call.
+
+  const ProjectionStats &stats() const { return _stats; }
+
+  void reset();
+  // forgets the dual variables, e.g., after the set has changed a lot
+
+private:
+  void prepare(size_t dim);
+  Eigen::VectorXd projectOnto(size_t i, const Eigen::VectorXd &z);
+  void sweep(const Eigen::VectorXd &point);
+  // one pass of Dykstra's algorithm over the sets, from the dual variables
+  // _y; stores the new dual variables in _Ty and the iterate in _x
+  void extrapolate();
+  // sets _y to the next dual variables (_Ty, or their Anderson extrapolation)
+  Eigen::VectorXd dykstra(const Eigen::VectorXd &point);
+
+  AdvFunc &_interpreter;
+  msg::SetExpr::Reader _set;
+  ProjectionOptions _options;
+  ProjectionStats _stats;
+
+  std::vector<HalfSpace> _halfSpaces; // for a polytope (in dimensions != 2)
+  size_t _count; // number of sets in the current call
+  size_t _dim;
+  bool _warm; // whether _y holds the dual variables of a previous call
+
+  Eigen::VectorXd _y, _Ty; // dual variables, stacked
+  Eigen::VectorXd _x, _xPrev, _z;
+  Eigen::VectorXd _g, _gPrev, _TyPrev; // (for the extrapolation)
+  Eigen::MatrixXd _dG, _dTy; // differences of past residuals and iterates
+  int _history;              // number of valid columns of _dG and _dTy
+  int _next;                 // column to overwrite next
+};
+
+#endif
@@ -0,0 +1,151 @@
+// Micro-benchmark of the interpreter: evaluates the cost functions and tests
+// membership of the PQ profiles of the advertisements in the high-level API on
+// a grid of setpoints, both with the tree-walking evaluator and with the
+// compiled program (binding the variables by name and by slot, and in batch).
+//
+// Usage: interpreter_bench [repetitions]
+
+#include <commelec-api/hlapi-internal.hpp>
+#include <commelec-interpreter/adv-interpreter.hpp>
+#include <capnp/message.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+using Clock = std::chrono::steady_clock;
+
+const int gridSize = 100;
+// number of grid points along each axis
+
+double timeNs(const std::function<void(double, double)> &fun, double lim,
+              int repetitions) {
+  // returns the average time per call in nanoseconds
+  auto start = Clock::now();
+  for (int rep = 0; rep < repetitions; ++rep)
+    for (int i = 0; i < gridSize; ++i)
+      for (int j = 0; j < gridSize; ++j)
+        fun(-lim + 2 * lim * i / (gridSize - 1),
+            -lim + 2 * lim * j / (gridSize - 1));
+  std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+  return elapsed.count() / (double(repetitions) * gridSize * gridSize);
+}
+
+void benchmark(const std::string &name, msg::Advertisement::Builder adv,
+               double lim, int repetitions) {
+  AdvFunc interpreter(adv);
+  auto cost = adv.getCostFunction().asReader();
+  auto pqProfile = adv.getPQProfile().asReader();
+
+  volatile double sink = 0;
+  // prevents that the compiler optimizes the evaluations away
+
+  ValueMap vars{{"P", 0}, {"Q", 0}};
+  PointType point{0, 0};
+
+  auto treeCost = timeNs([&](double P, double Q) {
+    vars["P"] = P;
+    vars["Q"] = Q;
+    sink = sink + interpreter.evaluate(cost, vars);
+  }, lim, repetitions);
+
+  auto compiledCost = timeNs([&](double P, double Q) {
+    vars["P"] = P;
+    vars["Q"] = Q;
+    sink = sink + interpreter.evaluate(interpreter.costFunction(), vars);
+  }, lim, repetitions);
+
+  auto slotCost = timeNs([&](double P, double Q) {
+    sink = sink + interpreter.evaluate(interpreter.costFunction(),
+                                       Eigen::Vector2d(P, Q));
+  }, lim, repetitions);
+
+  // batch evaluation on the whole grid at once
+  Eigen::VectorXd gridP(gridSize * gridSize), gridQ(gridSize * gridSize),
+      values(gridSize * gridSize);
+  for (int i = 0; i < gridSize; ++i)
+    for (int j = 0; j < gridSize; ++j) {
+      gridP[i * gridSize + j] = -lim + 2 * lim * i / (gridSize - 1);
+      gridQ[i * gridSize + j] = -lim + 2 * lim * j / (gridSize - 1);
+    }
+  auto start = Clock::now();
+  for (int rep = 0; rep < repetitions; ++rep) {
+    interpreter.evaluateBatch(interpreter.costFunction(), gridP.data(),
+                              gridQ.data(), gridP.size(), values.data());
+    sink = sink + values[rep % values.size()];
+  }
+  std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+  auto batchCost = elapsed.count() / (double(repetitions) * gridP.size());
+
+  // value and gradient: three tree walks versus one pass of the AD executor
+  auto treeGradient = timeNs([&](double P, double Q) {
+    vars["P"] = P;
+    vars["Q"] = Q;
+    sink = sink + interpreter.evaluate(cost, vars) +
+           interpreter.evalPartialDerivative(cost, "P", vars) +
+           interpreter.evalPartialDerivative(cost, "Q", vars);
+  }, lim, repetitions);
+
+  Eigen::Vector2d gradient;
+  auto adGradient = timeNs([&](double P, double Q) {
+    sink = sink + interpreter.evaluateWithGradient(interpreter.costFunction(),
+                                                   Eigen::Vector2d(P, Q),
+                                                   gradient);
+  }, lim, repetitions);
+
+  auto treeMember = timeNs([&](double P, double Q) {
+    vars["P"] = point[0] = P;
+    vars["Q"] = point[1] = Q;
+    sink = sink + interpreter.testMembership(pqProfile, point, vars);
+  }, lim, repetitions);
+
+  auto compiledMember = timeNs([&](double P, double Q) {
+    vars["P"] = point[0] = P;
+    vars["Q"] = point[1] = Q;
+    sink = sink +
+           interpreter.testMembership(interpreter.pqProfile(), point, vars);
+  }, lim, repetitions);
+
+  auto slotMember = timeNs([&](double P, double Q) {
+    Eigen::Vector2d PQ(P, Q);
+    sink = sink + interpreter.testMembership(interpreter.pqProfile(), PQ, PQ);
+  }, lim, repetitions);
+
+  std::cout << std::setw(10) << name << std::fixed << std::setprecision(1)
+            << std::setw(14) << treeCost << std::setw(14) << compiledCost
+            << std::setw(14) << slotCost << std::setw(14) << batchCost
+            << std::setw(14) << treeGradient << std::setw(14) << adGradient
+            << std::setw(14) << treeMember << std::setw(14) << compiledMember
+            << std::setw(14) << slotMember << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  int repetitions = (argc > 1) ? std::atoi(argv[1]) : 20;
+
+  std::cout << "average time per call [ns]" << std::endl;
+  std::cout << std::setw(10) << "adv" << std::setw(14) << "cost (tree)"
+            << std::setw(14) << "cost (comp)" << std::setw(14) << "cost (slots)"
+            << std::setw(14) << "cost (batch)" << std::setw(14) << "grad (tree)"
+            << std::setw(14) << "grad (AD)"
+            << std::setw(14) << "pq (tree)" << std::setw(14) << "pq (comp)"
+            << std::setw(14) << "pq (slots)" << std::endl;
+
+  ::capnp::MallocMessageBuilder message;
+
+  auto adv = message.initRoot<msg::Advertisement>();
+  _BatteryAdvertisement(adv, -30, 30, 33, 1.0, 0.1, 0, 0);
+  benchmark("battery", adv, 40, repetitions);
+
+  adv = message.initRoot<msg::Advertisement>();
+  _PVAdvertisement(adv, 25, 20, 0.5, 0.3, 1.0, 2.0, 0, 0);
+  benchmark("pv", adv, 30, repetitions);
+
+  adv = message.initRoot<msg::Advertisement>();
+  _zenoneAdvertisement(adv, -8000, 0, 1000, 600, 0.5, 2.0, 0, 0);
+  benchmark("zenone", adv, 16000, repetitions);
+
+  return 0;
+}
@@ -4,9 +4,20 @@
 #include <commelec-api/realexpr-convenience.hpp>
 #include <commelec-api/polynomial-convenience.hpp>
 #include <commelec-api/hlapi-internal.hpp>
+#include <commelec-api/simplify.hpp>
 #include <commelec-interpreter/adv-interpreter.hpp>
+#include <commelec-interpreter/boundingbox-convexpolygon.hpp>
+#include <commelec-interpreter/projection-session.hpp>
+#include <commelec-interpreter/fleet-evaluator.hpp>
+#include <commelec-interpreter/homogeneous-fleet.hpp>
+#include <commelec-interpreter/adv-cache.hpp>
+#include <commelec-interpreter/adv-table.hpp>
 #include <capnp/message.h>
+#include <capnp/serialize.h>
 #include <iostream>
+#include <functional>
+#include <string>
+#include <thread>
 
 const lest::test specification[] =
 {
@@ -113,6 +124,1650 @@ const lest::test specification[] =
     EXPECT(newInterpreter.evalPartialDerivative(expr2,"P",{{"P",2},{"Q",3}})==85);
 
   }},
+
+  {CASE( "Compiled evaluation agrees with the tree-walking evaluator" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+
+    // compares the cost function and PQ profile on a grid of
+    // setpoints (P,Q) in [-lim,lim]^2
+    auto compare = [&](msg::Advertisement::Builder adv, double lim) {
+      AdvFunc interpreter(adv);
+      bool agree = true;
+      for (double P = -lim; P <= lim; P += lim / 10) {
+        for (double Q = -lim; Q <= lim; Q += lim / 10) {
+          ValueMap vars{{"P", P}, {"Q", Q}};
+          PointType point{P, Q};
+          double a = interpreter.evaluate(adv.getCostFunction(), vars);
+          double b = interpreter.evaluate(interpreter.costFunction(), vars);
+          double c = interpreter.evaluate(interpreter.costFunction(),
+                                          Eigen::Vector2d(P, Q));
+          agree = agree && (a == b || (std::isnan(a) && std::isnan(b)));
+          agree = agree && (b == c || (std::isnan(b) && std::isnan(c)));
+          agree = agree &&
+                  interpreter.testMembership(adv.getPQProfile(), point, vars) ==
+                      interpreter.testMembership(interpreter.pqProfile(),
+                                                 point, vars);
+          agree = agree &&
+                  interpreter.testMembership(adv.getPQProfile(), point, vars) ==
+                      interpreter.testMembership(interpreter.pqProfile(),
+                                                 Eigen::Vector2d(P, Q),
+                                                 Eigen::Vector2d(P, Q));
+        }
+      }
+      return agree;
+    };
+
+    _BatteryAdvertisement(adv, -30, 30, 33, 1.0, 0.1, 0, 0);
+    EXPECT(compare(adv, 40));
+
+    adv = message.initRoot<msg::Advertisement>();
+    _PVAdvertisement(adv, 25, 20, 0.5, 0.3, 1.0, 2.0, 0, 0);
+    EXPECT(compare(adv, 30));
+
+    adv = message.initRoot<msg::Advertisement>();
+    _zenoneAdvertisement(adv, -8000, 0, 1000, 600, 0.5, 2.0, 0, 0);
+    EXPECT(compare(adv, 16000));
+
+    // expressions that are not part of the cost function are compiled on demand
+    adv = message.initRoot<msg::Advertisement>();
+    auto expr = adv.initCostFunction();
+    using namespace cv;
+    Var x("X");
+    Var y("Y");
+    buildRealExpr(expr, Real(3.0) * x + sin(y));
+    AdvFunc interpreter(adv);
+    auto compiled = interpreter.compile(adv.getCostFunction());
+    EXPECT(interpreter.evaluate(compiled, {{"X", 6.0}, {"Y", 2.4}}) ==
+           interpreter.evaluate(expr, {{"X", 6.0}, {"Y", 2.4}}));
+    EXPECT_THROWS_AS(interpreter.evaluate(compiled, {{"X", 6.0}}), UnknownVariable);
+
+    // binding variables by slot
+    std::vector<double> values(interpreter.variables().size());
+    values[interpreter.slotOf("X")] = 6.0;
+    values[interpreter.slotOf("Y")] = 2.4;
+    EXPECT(interpreter.slotOf("Z") == -1);
+    EXPECT(interpreter.evaluate(compiled, values.data(), values.size()) ==
+           interpreter.evaluate(expr, {{"X", 6.0}, {"Y", 2.4}}));
+    EXPECT_THROWS_AS(interpreter.evaluate(compiled, values.data(), 2), UnknownVariable);
+  }},
+
+  {CASE( "Points of another dimension than their set are rejected" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    using namespace cv;
+    Var P("P");
+
+    // a case distinction on (P,Q) whose set is an interval
+    auto casedist = adv.initCostFunction().initCaseDistinction();
+    auto variables = casedist.initVariables(2);
+    variables.set(0, "P");
+    variables.set(1, "Q");
+    auto cases = casedist.initCases(1);
+    auto rect = cases[0].initSet().initRectangle(1);
+    rect[0].initBoundA().setReal(-1);
+    rect[0].initBoundB().setReal(1);
+    buildRealExpr(cases[0].initExpression(), square(P));
+
+    // and a PQ profile that is a ball in three dimensions
+    auto ball = adv.initPQProfile().initBall();
+    auto center = ball.initCenter(3);
+    for (unsigned i = 0; i < 3; ++i)
+      center[i].setReal(0);
+    ball.initRadius().setReal(1);
+
+    AdvFunc interpreter(adv);
+    ValueMap vars{{"P", 0.5}, {"Q", 0.5}};
+    EXPECT_THROWS_AS(interpreter.evaluate(adv.getCostFunction(), vars), EvaluationError);
+    EXPECT_THROWS_AS(interpreter.evaluate(interpreter.costFunction(), vars),
+                     EvaluationError);
+    double P0 = 0.5, Q0 = 0.5, value;
+    EXPECT_THROWS_AS(interpreter.evaluateBatch(interpreter.costFunction(), &P0, &Q0,
+                                               1, &value),
+                     EvaluationError);
+    PointType point{0.5, 0.5};
+    EXPECT_THROWS_AS(interpreter.testMembership(adv.getPQProfile(), point, vars),
+                     EvaluationError);
+    EXPECT_THROWS_AS(interpreter.testMembership(interpreter.pqProfile(), point, vars),
+                     EvaluationError);
+  }},
+
+  {CASE( "Batch evaluation agrees with scalar evaluation" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+
+    // evaluates the cost function and tests membership of the PQ profile on
+    // n random points in [-limP,limP]x[-limQ,limQ] (n is not a multiple of the
+    // block size)
+    auto compare = [&](msg::Advertisement::Builder adv, double limP,
+                       double limQ) {
+      AdvFunc interpreter(adv);
+      const size_t n = 1000;
+      Eigen::VectorXd P = limP * Eigen::VectorXd::Random(n);
+      Eigen::VectorXd Q = limQ * Eigen::VectorXd::Random(n);
+
+      Eigen::Array<bool, Eigen::Dynamic, 1> member(n);
+      interpreter.testMembershipBatch(interpreter.pqProfile(), P.data(),
+                                      Q.data(), n, member.data());
+
+      // the cost function is only defined on the PQ profile
+      std::vector<double> domainP, domainQ;
+      bool agree = true;
+      for (size_t i = 0; i < n; ++i) {
+        Eigen::Vector2d PQ(P[i], Q[i]);
+        agree = agree &&
+                member[i] == interpreter.testMembership(interpreter.pqProfile(), PQ, PQ);
+        if (member[i]) {
+          domainP.push_back(P[i]);
+          domainQ.push_back(Q[i]);
+        }
+      }
+
+      std::vector<double> values(domainP.size());
+      interpreter.evaluateBatch(interpreter.costFunction(), domainP.data(),
+                                domainQ.data(), domainP.size(), values.data());
+      for (size_t i = 0; i < domainP.size(); ++i) {
+        double expected = interpreter.evaluate(
+            interpreter.costFunction(), Eigen::Vector2d(domainP[i], domainQ[i]));
+        agree = agree && std::abs(values[i] - expected) <=
+                             1e-12 * std::max(1.0, std::abs(expected));
+      }
+      return agree && !domainP.empty();
+    };
+
+    _BatteryAdvertisement(adv, -30, 30, 33, 1.0, 0.1, 0, 0);
+    EXPECT(compare(adv, 40, 40));
+
+    adv = message.initRoot<msg::Advertisement>();
+    _PVAdvertisement(adv, 25, 20, 0.5, 0.3, 1.0, 2.0, 0, 0);
+    EXPECT(compare(adv, 30, 30));
+
+    adv = message.initRoot<msg::Advertisement>();
+    _zenoneAdvertisement(adv, -8000, 0, 1000, 600, 0.5, 2.0, 0, 0);
+    EXPECT(compare(adv, 16000, 0));
+    // (the PQ profile of this advertisement lies on the P axis)
+  }},
+
+  {CASE( "Nested case distinctions need only cover their outer case in batches" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    using namespace cv;
+    Var P("P");
+
+    // the cases of the inner distinctions only cover the case they are in
+    auto interval = [](msg::ExprCase<msg::RealExpr>::Builder item, double a,
+                       double b) {
+      auto rect = item.initSet().initRectangle(1);
+      rect[0].initBoundA().setReal(a);
+      rect[0].initBoundB().setReal(b);
+    };
+    auto outer = adv.initCostFunction().initCaseDistinction();
+    outer.initVariables(1).set(0, "P");
+    auto cases = outer.initCases(2);
+    interval(cases[0], -10, 0);
+    interval(cases[1], 0, 10);
+    auto left = cases[0].initExpression().initCaseDistinction();
+    left.initVariables(1).set(0, "P");
+    auto leftCases = left.initCases(2);
+    interval(leftCases[0], -10, -5);
+    buildRealExpr(leftCases[0].initExpression(), Real(1) + P);
+    interval(leftCases[1], -5, 0);
+    buildRealExpr(leftCases[1].initExpression(), square(P));
+    auto right = cases[1].initExpression().initCaseDistinction();
+    right.initVariables(1).set(0, "P");
+    auto rightCases = right.initCases(2);
+    interval(rightCases[0], 0, 5);
+    buildRealExpr(rightCases[0].initExpression(), Real(3) * P);
+    interval(rightCases[1], 5, 10);
+    buildRealExpr(rightCases[1].initExpression(), Real(4) - P);
+
+    AdvFunc interpreter(adv);
+    const size_t n = 101;
+    Eigen::VectorXd Ps = Eigen::VectorXd::LinSpaced(n, -10, 10);
+    Eigen::VectorXd Qs = Eigen::VectorXd::Zero(n);
+    std::vector<double> values(n);
+    interpreter.evaluateBatch(interpreter.costFunction(), Ps.data(), Qs.data(),
+                              n, values.data());
+    bool agree = true;
+    for (size_t i = 0; i < n; ++i) {
+      ValueMap vars{{"P", Ps[i]}};
+      double expected = interpreter.evaluate(adv.getCostFunction(), vars);
+      agree = agree && values[i] == expected &&
+              interpreter.evaluate(interpreter.costFunction(),
+                                   Eigen::Vector2d(Ps[i], 0)) == expected;
+    }
+    EXPECT(agree);
+
+    // a point outside of every case is still an error
+    double outside = 11;
+    EXPECT_THROWS_AS(interpreter.evaluateBatch(interpreter.costFunction(), &outside,
+                                               Qs.data(), 1, values.data()),
+                     EvaluationError);
+  }},
+
+  {CASE( "Gradient by forward-mode automatic differentiation" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    auto expr = adv.initCostFunction();
+
+    cv::PolyVar Pvar("P");
+    cv::PolyVar Qvar("Q");
+    cv::buildPolynomial(expr.initPolynomial(), (Pvar^2)+3*(Pvar|Qvar^3));
+    // P^2 + 3*P*Q^3
+
+    AdvFunc interpreter(adv);
+    Eigen::Vector2d gradient;
+    EXPECT(interpreter.evaluateWithGradient(interpreter.costFunction(),
+                                            Eigen::Vector2d(2, 3), gradient) == 166);
+    EXPECT(gradient(0) == 85);
+    EXPECT(gradient(1) == 162);
+
+    // compare with the tree-walking evaluator, on an expression with
+    // (almost) all types of operations
+    adv = message.initRoot<msg::Advertisement>();
+    expr = adv.initCostFunction();
+    using namespace cv;
+    Var P("P");
+    Var Q("Q");
+    buildRealExpr(expr, square(P) * Q + sin(P) * exp(Q / Real(10)) +
+                            pow(P, Real(3)) + max(P, Q) - min(P * Q, Real(2)) +
+                            sqrt(abs(Q) + Real(1)) + ln(square(P) + Real(1)) +
+                            pow(Real(2), Q) * log10(abs(P) + Real(1)));
+    AdvFunc newInterpreter(adv);
+
+    bool agree = true;
+    for (double p = -3.25; p <= 3; p += 0.5)
+      for (double q = -2.6; q <= 3; q += 0.5) {
+        ValueMap vars{{"P", p}, {"Q", q}};
+        double value = newInterpreter.evaluateWithGradient(
+            newInterpreter.costFunction(), Eigen::Vector2d(p, q), gradient);
+        Eigen::Vector2d expected(newInterpreter.evalPartialDerivative(expr, "P", vars),
+                                 newInterpreter.evalPartialDerivative(expr, "Q", vars));
+        agree = agree &&
+                std::abs(value - newInterpreter.evaluate(expr, vars)) < 1e-10 &&
+                (gradient - expected).norm() < 1e-10 * std::max(1.0, expected.norm());
+      }
+    EXPECT(agree);
+  }},
+
+  {CASE( "Hessian by second-order forward-mode automatic differentiation" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    auto expr = adv.initCostFunction();
+
+    cv::PolyVar Pvar("P");
+    cv::PolyVar Qvar("Q");
+    cv::buildPolynomial(expr.initPolynomial(), (Pvar^2)+3*(Pvar|Qvar^3));
+    // P^2 + 3*P*Q^3
+
+    AdvFunc interpreter(adv);
+    Eigen::Vector2d gradient;
+    Eigen::Matrix2d hessian;
+    EXPECT(interpreter.evaluateWithHessian(interpreter.costFunction(),
+                                           Eigen::Vector2d(2, 3), gradient,
+                                           hessian) == 166);
+    EXPECT(gradient == Eigen::Vector2d(85, 162));
+    EXPECT(hessian(0, 0) == 2);
+    EXPECT(hessian(0, 1) == 81);
+    EXPECT(hessian(1, 0) == 81);
+    EXPECT(hessian(1, 1) == 108);
+
+    // compare with central differences of the AD gradient
+    adv = message.initRoot<msg::Advertisement>();
+    expr = adv.initCostFunction();
+    using namespace cv;
+    Var P("P");
+    Var Q("Q");
+    buildRealExpr(expr, square(P) * Q + sin(P) * exp(Q / Real(10)) +
+                            pow(P, Real(3)) + pow(P, Q / Real(4)) +
+                            sqrt(Q + Real(4)) + ln(square(P) + Real(1)) +
+                            Real(1) / (P + Q + Real(10)) + square(sin(Q)) +
+                            pow(Real(2), Q) * log10(P + Real(5)));
+    AdvFunc newInterpreter(adv);
+
+    bool agree = true;
+    const double h = 1e-5;
+    for (double p = 0.25; p <= 3; p += 0.5)
+      for (double q = -2.5; q <= 3; q += 0.5) {
+        double value = newInterpreter.evaluateWithHessian(
+            newInterpreter.costFunction(), Eigen::Vector2d(p, q), gradient, hessian);
+        Eigen::Matrix2d expected;
+        for (int i = 0; i < 2; ++i) {
+          Eigen::Vector2d step = h * Eigen::Vector2d::Unit(i);
+          Eigen::Vector2d gPlus, gMinus;
+          newInterpreter.evaluateWithGradient(newInterpreter.costFunction(),
+                                              Eigen::Vector2d(p, q) + step, gPlus);
+          newInterpreter.evaluateWithGradient(newInterpreter.costFunction(),
+                                              Eigen::Vector2d(p, q) - step, gMinus);
+          expected.col(i) = (gPlus - gMinus) / (2 * h);
+        }
+        Eigen::Vector2d expectedGradient;
+        agree = agree &&
+                value == newInterpreter.evaluateWithGradient(
+                             newInterpreter.costFunction(), Eigen::Vector2d(p, q),
+                             expectedGradient) &&
+                gradient == expectedGradient && hessian == hessian.transpose() &&
+                (hessian - expected).norm() < 1e-5 * std::max(1.0, expected.norm());
+      }
+    EXPECT(agree);
+
+    // at a zero base: d^2/dP^2 P^2 = 2 and d^2/dQ^2 Q^1 = 0, while sqrt(Q)
+    // has no second derivative with respect to P
+    adv = message.initRoot<msg::Advertisement>();
+    buildRealExpr(adv.initCostFunction(), pow(P, Real(2)) + pow(Q, Real(1)));
+    AdvFunc zeroBase(adv);
+    zeroBase.evaluateWithHessian(zeroBase.costFunction(), Eigen::Vector2d(0, 0),
+                                 gradient, hessian);
+    EXPECT(gradient == Eigen::Vector2d(0, 1));
+    EXPECT(hessian == (Eigen::Matrix2d() << 2, 0, 0, 0).finished());
+    adv = message.initRoot<msg::Advertisement>();
+    buildRealExpr(adv.initCostFunction(), sqrt(Q));
+    AdvFunc root(adv);
+    root.evaluateWithHessian(root.costFunction(), Eigen::Vector2d(0, 0),
+                             gradient, hessian);
+    EXPECT(hessian(0, 0) == 0);
+    EXPECT(hessian(0, 1) == 0);
+    EXPECT(hessian(1, 0) == 0);
+  }},
+
+  {CASE( "Named subexpressions are evaluated once per evaluation" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+
+    // a_0 = P, a_k = a_(k-1) + a_(k-1), where the second operand is a
+    // reference; without memoization, the number of evaluations of a_0 (and
+    // hence the nesting depth) doubles with every k
+    const int levels = 20;
+    std::function<void(msg::RealExpr::Builder, int)> build =
+        [&](msg::RealExpr::Builder expr, int k) {
+          expr.setName(("a" + std::to_string(k)).c_str());
+          if (k == 0) {
+            expr.setVariable("P");
+            return;
+          }
+          auto sum = expr.initBinaryOperation();
+          sum.initOperation().setSum();
+          build(sum.initArgA(), k - 1);
+          sum.initArgB().setReference(("a" + std::to_string(k - 1)).c_str());
+        };
+    build(adv.initCostFunction(), levels);
+
+    AdvFunc interpreter(adv);
+    const double factor = 1 << levels;
+    for (double P : {1.0, 3.0, -0.5}) {
+      // (the memoized values must not leak into the next evaluation)
+      ValueMap vars{{"P", P}, {"Q", 0}};
+      EXPECT(interpreter.evaluate(adv.getCostFunction(), vars) == factor * P);
+      EXPECT(interpreter.evalPartialDerivative(adv.getCostFunction(), "P", vars) == factor);
+      EXPECT(interpreter.evaluate(interpreter.costFunction(), Eigen::Vector2d(P, 0)) ==
+             factor * P);
+
+      Eigen::Vector2d gradient;
+      EXPECT(interpreter.evaluateWithGradient(interpreter.costFunction(),
+                                              Eigen::Vector2d(P, 0), gradient) == factor * P);
+      EXPECT(gradient == Eigen::Vector2d(factor, 0));
+    }
+
+    std::vector<double> P{1.0, 3.0, -0.5}, Q(3, 0.0), values(3);
+    interpreter.evaluateBatch(interpreter.costFunction(), P.data(), Q.data(), 3,
+                              values.data());
+    EXPECT(values == std::vector<double>({factor, 3 * factor, -0.5 * factor}));
+  }},
+
+  {CASE( "Dangling and cyclic references are detected when linking" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    using namespace cv;
+    Var P("P");
+    Ref a("a");
+    Ref b("b");
+
+    // references are resolved once, also in expressions that are never
+    // evaluated
+    buildRealExpr(adv.initCostFunction(), name(a, P + Real(1)) * a + b);
+    EXPECT_THROWS_AS(AdvFunc{adv}, UnknownReference);
+
+    buildRealExpr(adv.initCostFunction(),
+                  name(a, P + b) * name(b, Real(2) * a));
+    EXPECT_THROWS_AS(AdvFunc{adv}, EvaluationError);
+
+    buildRealExpr(adv.initCostFunction(), P * name(a, P + a));
+    AdvFunc interpreter;
+    EXPECT_THROWS_AS(interpreter.setAdv(adv), EvaluationError);
+
+    // a set that refers to itself
+    buildRealExpr(adv.initCostFunction(), name(a, P + Real(1)) * a);
+    auto pqProfile = adv.initPQProfile();
+    pqProfile.setName("S");
+    auto intersection = pqProfile.initIntersection(2);
+    buildRealExpr(intersection[0].initBall().initRadius(), Real(1));
+    auto center = intersection[0].getBall().initCenter(2);
+    buildRealExpr(center[0], Real(0));
+    buildRealExpr(center[1], Real(0));
+    intersection[1].setReference("S");
+    EXPECT_THROWS_AS(AdvFunc{adv}, EvaluationError);
+
+    // ... and one that refers to a named set
+    intersection[1].setReference("T");
+    EXPECT_THROWS_AS(AdvFunc{adv}, UnknownReference);
+    adv.initBeliefFunction().setName("T");
+    adv.getBeliefFunction().initRectangle(2);
+    for (auto bounds : adv.getBeliefFunction().getRectangle()) {
+      buildRealExpr(bounds.initBoundA(), Real(-0.5));
+      buildRealExpr(bounds.initBoundB(), Real(2));
+    }
+    AdvFunc linked(adv);
+    ValueMap vars{{"P", 0.5}, {"Q", 0}};
+    EXPECT(linked.evaluate(adv.getCostFunction(), vars) == 1.5 * 1.5);
+    EXPECT(linked.testMembership(adv.getPQProfile(), {0.5, 0.5}, vars));
+    EXPECT(!linked.testMembership(adv.getPQProfile(), {-0.6, 0}, vars));
+    EXPECT(linked.testMembership(linked.pqProfile(), Eigen::Vector2d(0.5, 0.5),
+                                 Eigen::Vector2d(0.5, 0)));
+  }},
+
+  {CASE( "Polynomials in several variables, with their derivatives" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    auto expr = adv.initCostFunction();
+
+    cv::PolyVar X("X");
+    cv::PolyVar Y("Y");
+    cv::PolyVar Z("Z");
+    cv::buildPolynomial(expr.initPolynomial(),
+                        (X^3|Y) + 2*(Y^2|Z^4) + (-0.5)*(X|Z) + 7*(X^0));
+    // x^3 y + 2 y^2 z^4 - 0.5 x z + 7
+
+    AdvFunc interpreter(adv);
+    const int n = interpreter.variables().size();
+    const int sx = interpreter.slotOf("X");
+    const int sy = interpreter.slotOf("Y");
+    const int sz = interpreter.slotOf("Z");
+
+    bool agree = true;
+    for (double x : {-1.5, 0.0, 2.0})
+      for (double y : {-2.0, 0.5})
+        for (double z : {-1.0, 0.0, 1.5}) {
+          double value = x * x * x * y + 2 * y * y * std::pow(z, 4) - 0.5 * x * z + 7;
+          Eigen::Vector3d gradient(3 * x * x * y - 0.5 * z,
+                                   x * x * x + 4 * y * std::pow(z, 4),
+                                   8 * y * y * z * z * z - 0.5 * x);
+          Eigen::Matrix3d hessian;
+          hessian << 6 * x * y, 3 * x * x, -0.5,
+                     3 * x * x, 4 * std::pow(z, 4), 16 * y * z * z * z,
+                     -0.5, 16 * y * z * z * z, 24 * y * y * z * z;
+
+          ValueMap vars{{"X", x}, {"Y", y}, {"Z", z}};
+          agree = agree && interpreter.evaluate(expr, vars) == value &&
+                  interpreter.evalPartialDerivative(expr, "X", vars) == gradient(0) &&
+                  interpreter.evalPartialDerivative(expr, "Y", vars) == gradient(1) &&
+                  interpreter.evalPartialDerivative(expr, "Z", vars) == gradient(2);
+
+          std::vector<double> values(n, 0.0), g(n), H(n * n);
+          values[sx] = x;
+          values[sy] = y;
+          values[sz] = z;
+          agree = agree && interpreter.evaluate(interpreter.costFunction(),
+                                                values.data(), n) == value;
+          agree = agree && interpreter.evaluateWithHessian(interpreter.costFunction(),
+                                                           values.data(), n,
+                                                           g.data(), H.data()) == value;
+          int slots[] = {sx, sy, sz};
+          for (int i = 0; i < 3; ++i) {
+            agree = agree && g[slots[i]] == gradient(i);
+            for (int j = 0; j < 3; ++j)
+              agree = agree && H[slots[i] * n + slots[j]] == hessian(i, j);
+          }
+        }
+    EXPECT(agree);
+  }},
+
+  {CASE( "Simplified advertisements evaluate to the same values" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    using namespace cv;
+    Var P("P");
+    Var Q("Q");
+    Ref a("a");
+
+    buildRealExpr(adv.initCostFunction(),
+                  (Real(2) * Real(3)) * P * Real(1) + Real(0) +
+                      name(a, Real(4) + Real(1)) * Q + a + sqrt(Real(9)));
+    auto ball = adv.initPQProfile().initBall();
+    buildRealExpr(ball.initRadius(), Real(2) * Real(0.5) + Real(0) * P);
+    auto center = ball.initCenter(2);
+    buildRealExpr(center[0], Real(0.25) + Real(0.25));
+    buildRealExpr(center[1], Real(0) - Real(1));
+
+    ::capnp::MallocMessageBuilder simplifiedMessage;
+    simplifiedMessage.setRoot(adv.asReader());
+    auto simplified = simplifiedMessage.getRoot<msg::Advertisement>();
+    simplifyAdvertisement(simplified);
+
+    // 6P + a*Q + a + 3, with the named constant a = 5 preserved
+    auto cost = simplified.getCostFunction();
+    EXPECT(cost.which() == msg::RealExpr::LIST_OPERATION);
+    EXPECT(cost.getListOperation().getArgs().size() == 4);
+    EXPECT(cost.getListOperation().getArgs()[3].getReal() == 3.0);
+    EXPECT(simplified.getPQProfile().getBall().getCenter()[0].getReal() == 0.5);
+    EXPECT(simplified.getPQProfile().getBall().getCenter()[1].getReal() == -1.0);
+
+    AdvFunc original(adv);
+    AdvFunc folded(simplified);
+    bool agree = true;
+    for (double p : {-1.0, 0.5, 2.0})
+      for (double q : {-0.5, 1.5}) {
+        ValueMap vars{{"P", p}, {"Q", q}};
+        double value = 6 * p + 5 * q + 5 + 3;
+        agree = agree &&
+                original.evaluate(adv.getCostFunction(), vars) == value &&
+                folded.evaluate(simplified.getCostFunction(), vars) == value &&
+                original.evaluate(original.costFunction(),
+                                  Eigen::Vector2d(p, q)) == value &&
+                folded.evaluate(folded.costFunction(),
+                                Eigen::Vector2d(p, q)) == value;
+        Eigen::Vector2d point(p, q);
+        agree = agree &&
+                original.testMembership(original.pqProfile(), point,
+                                        Eigen::Vector2d(p, q)) ==
+                    folded.testMembership(folded.pqProfile(), point,
+                                          Eigen::Vector2d(p, q));
+      }
+    EXPECT(agree);
+
+    // (a fresh copy drops the objects that were replaced in place)
+    ::capnp::MallocMessageBuilder compactMessage;
+    compactMessage.setRoot(simplified.asReader());
+    EXPECT(::capnp::computeSerializedSizeInWords(compactMessage) <
+           ::capnp::computeSerializedSizeInWords(message));
+  }},
+
+  {CASE( "Interval evaluation encloses the values on a box" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+
+    // samples the expression on a grid in the box and checks that all values
+    // lie within the computed bounds
+    auto encloses = [](AdvFunc &interpreter, CompiledExpr expr,
+                       Eigen::Vector2d lo, Eigen::Vector2d hi) {
+      auto bounds = interpreter.evaluateInterval(expr, Eigen::AlignedBoxXd(lo, hi));
+      bool enclosed = true;
+      for (int i = 0; i <= 10; ++i)
+        for (int j = 0; j <= 10; ++j) {
+          Eigen::Vector2d PQ = lo + (hi - lo).cwiseProduct(Eigen::Vector2d(i, j) / 10.0);
+          double value = interpreter.evaluate(expr, PQ);
+          enclosed = enclosed && bounds.min()(0) <= value && value <= bounds.max()(0);
+        }
+      return enclosed;
+    };
+
+    using namespace cv;
+    Var P("P");
+    Var Q("Q");
+    buildRealExpr(adv.initCostFunction(),
+                  sin(Real(3) * P) * Q + sqrt(abs(P)) +
+                      pow(Q, Real(3)) / (Real(1) + square(P)) +
+                      exp(min(P, Q)) - ln(Real(2) + cos(Q)) +
+                      floor(P * Q) * max(P, Q));
+    AdvFunc interpreter(adv);
+    EXPECT(encloses(interpreter, interpreter.costFunction(), {-1.0, -2.0}, {1.0, 0.5}));
+    EXPECT(encloses(interpreter, interpreter.costFunction(), {0.2, 0.1}, {0.3, 0.2}));
+    EXPECT(encloses(interpreter, interpreter.costFunction(), {-5.0, 3.0}, {5.0, 4.0}));
+
+    // a point box gives (almost) the value at the point
+    auto point = interpreter.evaluateInterval(
+        interpreter.costFunction(), Eigen::AlignedBoxXd(Eigen::Vector2d(0.5, -1.0)));
+    double value = interpreter.evaluate(interpreter.costFunction(),
+                                        Eigen::Vector2d(0.5, -1.0));
+    EXPECT(point.max()(0) - point.min()(0) < 1e-12);
+    EXPECT(point.min()(0) <= value);
+    EXPECT(value <= point.max()(0));
+
+    // an unbound variable
+    buildRealExpr(adv.initCostFunction(), P + Var("X"));
+    AdvFunc unbound(adv);
+    EXPECT_THROWS_AS(unbound.evaluateInterval(unbound.costFunction(),
+                                              Eigen::AlignedBoxXd(Eigen::Vector2d(0.0, 0.0),
+                                                                  Eigen::Vector2d(1.0, 1.0))),
+                     UnknownVariable);
+
+    // polynomials, case distinctions and references
+    cv::PolyVar Pvar("P");
+    cv::PolyVar Qvar("Q");
+    cv::buildPolynomial(adv.initCostFunction().initPolynomial(),
+                        (Pvar^2) + 3*(Pvar|Qvar^3) + (-2)*(Qvar^2));
+    AdvFunc poly(adv);
+    EXPECT(encloses(poly, poly.costFunction(), {-2.0, -1.0}, {1.0, 2.0}));
+    auto bounds = poly.evaluateInterval(
+        poly.costFunction(), Eigen::AlignedBoxXd(Eigen::Vector2d(0.0, 0.0), Eigen::Vector2d(1.0, 0.0)));
+    EXPECT(bounds.min()(0) <= 0);
+    EXPECT(bounds.max()(0) >= 1);
+    EXPECT(bounds.max()(0) < 1 + 1e-12);
+
+    adv = message.initRoot<msg::Advertisement>();
+    _zenoneAdvertisement(adv, -8000, 0, 1000, 600, 0.5, 2.0, 0, 0);
+    AdvFunc zenone(adv);
+    auto lowerbound = zenone.compile(adv.getBeliefFunction().getRectangle()[0].getBoundA());
+    EXPECT(encloses(zenone, lowerbound, {-8000.0, 0.0}, {-7500.0, 0.0}));
+    EXPECT(encloses(zenone, lowerbound, {-6300.0, 0.0}, {-4100.0, 0.0}));
+    auto upperbound = zenone.compile(adv.getBeliefFunction().getRectangle()[0].getBoundB());
+    EXPECT(encloses(zenone, upperbound, {-16000.0, 0.0}, {16000.0, 0.0}));
+  }},
+
+  {CASE( "Exact projection onto a convex polygon" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+
+    // the triangle with vertices (0,0), (2,0) and (0,2)
+    Eigen::MatrixXd A(3, 2);
+    A << -1, 0,
+         0, -1,
+         1, 1;
+    Eigen::VectorXd b(3);
+    b << 0, 0, 2;
+    cv::buildConvexPolytope(A, b, adv.initPQProfile().initConvexPolytope());
+
+    AdvFunc interpreter(adv);
+    ValueMap vars;
+    auto project = [&](double P, double Q) {
+      return interpreter.project(adv.getPQProfile(), Eigen::Vector2d(P, Q), vars);
+    };
+    EXPECT(project(0.5, 0.5) == Eigen::Vector2d(0.5, 0.5)); // inside
+    EXPECT(project(-1, 1) == Eigen::Vector2d(0, 1));         // onto an edge
+    EXPECT(project(1, -3) == Eigen::Vector2d(1, 0));
+    EXPECT((project(2, 2) - Eigen::Vector2d(1, 1)).norm() < 1e-12);
+    EXPECT(project(-1, -1) == Eigen::Vector2d(0, 0));        // onto a vertex
+    EXPECT(project(5, -1) == Eigen::Vector2d(2, 0));
+    EXPECT(interpreter.project(adv.getPQProfile(), PointType{-1, 1}, vars) ==
+           PointType({0, 1}));
+
+    // a polygon with redundant constraints: the projection x of p is the
+    // point of the polygon with (p - x)^T (v - x) <= 0 for every vertex v
+    const int m = 12;
+    Eigen::MatrixXd A12(m, 2);
+    Eigen::VectorXd b12(m);
+    for (int i = 0; i < m; ++i) {
+      double angle = 2 * std::acos(-1.0) * i / m;
+      A12.row(i) << std::cos(angle), std::sin(angle);
+      b12(i) = 1 + 0.25 * (i % 3);
+    }
+    Vertices vertices;
+    EXPECT(convexPolygonVertices(A12, b12, vertices) == PolygonStatus::Bounded);
+    cv::buildConvexPolytope(A12, b12, adv.initPQProfile().initConvexPolytope());
+    AdvFunc polygon(adv);
+    bool optimal = true;
+    for (int k = 0; k < 200; ++k) {
+      Eigen::Vector2d p = 3 * Eigen::Vector2d::Random();
+      Eigen::Vector2d x = polygon.project(adv.getPQProfile(), p, vars), y;
+      optimal = optimal && projectConvexPolygon(A12, b12, p, y) &&
+                (x - y).norm() < 1e-12 &&
+                ((A12 * x - b12).array() <= 1e-9).all();
+      for (const auto &v : vertices)
+        optimal = optimal && (p - x).dot(v - x) <= 1e-9;
+    }
+    EXPECT(optimal);
+
+    // an unbounded polygon (a half-plane) and an empty one
+    Eigen::MatrixXd halfPlane(1, 2);
+    halfPlane << 1, 1;
+    Eigen::VectorXd bound(1);
+    bound << 0;
+    cv::buildConvexPolytope(halfPlane, bound, adv.initPQProfile().initConvexPolytope());
+    AdvFunc unbounded(adv);
+    EXPECT((unbounded.project(adv.getPQProfile(), Eigen::Vector2d(1, 1), vars) -
+            Eigen::Vector2d(0, 0)).norm() < 1e-12);
+
+    b << 0, 0, -1;
+    cv::buildConvexPolytope(A, b, adv.initPQProfile().initConvexPolytope());
+    AdvFunc empty(adv);
+    EXPECT_THROWS_AS(empty.project(adv.getPQProfile(), Eigen::Vector2d(1, 1), vars),
+                     EvaluationError);
+  }},
+
+  {CASE( "Exact geometry of a disk intersected with half-planes" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    ValueMap vars;
+
+    // battery: the disk of radius 33, intersected with the band -30 <= P <= 30
+    _BatteryAdvertisement(adv, -30, 30, 33, 1.0, 0.1, 0, 0);
+    AdvFunc battery(adv);
+    auto pqProfile = adv.getPQProfile();
+    EXPECT(battery.project(pqProfile, Eigen::Vector2d(40, 0), vars) ==
+           Eigen::Vector2d(30, 0));
+    double s = 33 / std::sqrt(2.0);
+    EXPECT((battery.project(pqProfile, Eigen::Vector2d(40, 40), vars) -
+            Eigen::Vector2d(s, s)).norm() < 1e-12);
+    // a point whose nearest point is the vertex (30,q)
+    Eigen::Vector2d vertex(30, std::sqrt(33.0 * 33.0 - 30.0 * 30.0));
+    Eigen::Vector2d point = vertex + Eigen::Vector2d(10, 0) + vertex / 3.3;
+    EXPECT((battery.project(pqProfile, point, vars) - vertex).norm() < 1e-12);
+    auto hull = battery.rectangularHull(pqProfile, vars);
+    EXPECT((hull.min() - Eigen::Vector2d(-30, -33)).norm() < 1e-12);
+    EXPECT((hull.max() - Eigen::Vector2d(30, 33)).norm() < 1e-12);
+
+    // the unit disk, intersected with P >= 0.5 and a (referenced) rectangle
+    auto intersection = adv.initPQProfile().initIntersection(3);
+    auto disk = intersection[0].initBall();
+    disk.initRadius().setReal(1);
+    auto center = disk.initCenter(2);
+    center[0].setReal(0);
+    center[1].setReal(0);
+    Eigen::MatrixXd A(1, 2);
+    A << -1, 0;
+    Eigen::VectorXd b(1);
+    b << -0.5;
+    cv::buildConvexPolytope(A, b, intersection[1].initConvexPolytope());
+    intersection[2].setReference("R");
+    adv.initBeliefFunction().setName("R");
+    auto rect = adv.getBeliefFunction().initRectangle(2);
+    for (auto bounds : rect) {
+      bounds.initBoundA().setReal(-10);
+      bounds.initBoundB().setReal(10);
+    }
+
+    AdvFunc cut(adv);
+    hull = cut.rectangularHull(adv.getPQProfile(), vars);
+    double h = std::sqrt(0.75);
+    EXPECT((hull.min() - Eigen::Vector2d(0.5, -h)).norm() < 1e-12);
+    EXPECT((hull.max() - Eigen::Vector2d(1, h)).norm() < 1e-12);
+    EXPECT((cut.project(adv.getPQProfile(), Eigen::Vector2d(0, 2), vars) -
+            Eigen::Vector2d(0.5, h)).norm() < 1e-12);
+
+    // its boundary (counterclockwise): the arc from (0.5,-h) to (0.5,h), and
+    // the chord back
+    auto boundary = cut.boundary(adv.getPQProfile(), vars);
+    EXPECT(boundary.size() == 2);
+    EXPECT((boundary[0].start - Eigen::Vector2d(0.5, -h)).norm() < 1e-12);
+    EXPECT(boundary[0].arc);
+    EXPECT((boundary[1].start - Eigen::Vector2d(0.5, h)).norm() < 1e-12);
+    EXPECT(!boundary[1].arc);
+
+    // a disk on its own is a single arc, other sets are not supported
+    EXPECT(cut.boundary(intersection[0], vars).size() == 1);
+    EXPECT(cut.boundary(intersection[0], vars)[0].arc);
+    EXPECT_THROWS_AS(cut.boundary(adv.getBeliefFunction(), vars), WhichError);
+  }},
+  {CASE( "Projection sessions start from the previous dual variables" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    ValueMap vars;
+
+    // the lens between the unit disks around (0,0) and (1,0)
+    auto lens = adv.initPQProfile().initIntersection(2);
+    for (int i = 0; i < 2; ++i) {
+      auto disk = lens[i].initBall();
+      disk.initRadius().setReal(1);
+      auto center = disk.initCenter(2);
+      center[0].setReal(i);
+      center[1].setReal(0);
+    }
+    AdvFunc interpreter(adv);
+    Eigen::Vector2d vertex(0.5, std::sqrt(0.75));
+
+    ProjectionOptions options;
+    options.threshold = 1e-10;
+    ProjectionSession session(interpreter, adv.getPQProfile(), options);
+    EXPECT((session.project(Eigen::Vector2d(0.5, 2), vars) - vertex).norm() < 1e-6);
+    EXPECT(session.stats().converged);
+    auto cold = session.stats().iterations;
+    EXPECT(cold > 1);
+
+    // a nearby point has the same projection, found in fewer iterations
+    EXPECT((session.project(Eigen::Vector2d(0.51, 2), vars) - vertex).norm() < 1e-6);
+    EXPECT(session.stats().iterations < cold);
+    EXPECT(session.stats().residual < options.threshold);
+    session.reset();
+    session.project(Eigen::Vector2d(0.51, 2), vars);
+    EXPECT(session.stats().iterations > 1);
+
+    // points in the set are their own projection
+    EXPECT(session.project(Eigen::Vector2d(0.5, 0), vars) == Eigen::Vector2d(0.5, 0));
+    EXPECT(session.stats().iterations == 0);
+
+    // the accelerated scheme finds the same projection
+    options.accelerate = true;
+    ProjectionSession accelerated(interpreter, adv.getPQProfile(), options);
+    EXPECT((accelerated.project(Eigen::Vector2d(0.5, 2), vars) - vertex).norm() < 1e-6);
+    EXPECT((accelerated.project(Eigen::Vector2d(3, 1), vars) -
+            interpreter.project(adv.getPQProfile(), Eigen::Vector2d(3, 1), vars))
+               .norm() < 1e-2);
+
+    // too few iterations
+    options.accelerate = false;
+    options.maxIterations = 1;
+    ProjectionSession truncated(interpreter, adv.getPQProfile(), options);
+    EXPECT_THROWS_AS(truncated.project(Eigen::Vector2d(0.5, 2), vars), NoConvergence);
+    EXPECT(!truncated.stats().converged);
+  }},
+  {CASE( "Constant polytopes are evaluated once, with the same results" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    using namespace cv;
+    Var X("X");
+
+    // the triangle with vertices (0,0), (2,0) and (0,2), with constant
+    // coefficients (the PQ profile), and with the bound X + 2 instead of 2
+    // (the belief function)
+    Eigen::MatrixXd A(3, 2);
+    A << -1, 0,
+         0, -1,
+         1, 1;
+    Eigen::VectorXd b(3);
+    b << 0, 0, 2;
+    cv::buildConvexPolytope(A, b, adv.initPQProfile().initConvexPolytope());
+    cv::buildConvexPolytope(A, b, adv.initBeliefFunction().initConvexPolytope());
+    buildRealExpr(adv.getBeliefFunction().getConvexPolytope().getB()[2], X + Real(2));
+
+    AdvFunc interpreter(adv);
+    ValueMap vars{{"X", 0}};
+    auto constant = adv.getPQProfile();
+    auto variable = adv.getBeliefFunction();
+
+    Eigen::MatrixXd points(5, 2);
+    points << 0.5, 0.5,
+              -1, 1,
+              2, 2,
+              5, -1,
+              1, 1;
+    for (auto i = 0; i < points.rows(); ++i) {
+      Eigen::Vector2d point = points.row(i).transpose();
+      PointType pt{point(0), point(1)};
+      EXPECT(interpreter.testMembership(constant, pt, vars) ==
+             interpreter.testMembership(variable, pt, vars));
+      EXPECT((interpreter.project(constant, point, vars) -
+              interpreter.project(variable, point, vars)).norm() < 1e-12);
+    }
+    auto hull = interpreter.rectangularHull(constant, vars);
+    EXPECT((hull.min() - Eigen::Vector2d(0, 0)).norm() < 1e-12);
+    EXPECT((hull.max() - Eigen::Vector2d(2, 2)).norm() < 1e-12);
+
+    // only the belief function depends on X
+    vars["X"] = 1;
+    EXPECT(!interpreter.testMembership(constant, PointType{1.4, 1.4}, vars));
+    EXPECT(interpreter.testMembership(variable, PointType{1.4, 1.4}, vars));
+    EXPECT(interpreter.rectangularHull(variable, vars).max()(0) > 2.9);
+
+    // an unbounded polygon has no hull, and a half-space in three dimensions
+    Eigen::MatrixXd halfPlane(1, 2);
+    halfPlane << 1, 1;
+    Eigen::VectorXd bound(1);
+    bound << 0;
+    cv::buildConvexPolytope(halfPlane, bound, adv.initPQProfile().initConvexPolytope());
+    Eigen::MatrixXd halfSpace(1, 3);
+    halfSpace << 1, 1, 1;
+    bound << 3;
+    cv::buildConvexPolytope(halfSpace, bound, adv.initBeliefFunction().initConvexPolytope());
+    AdvFunc unbounded(adv);
+    EXPECT_THROWS_AS(unbounded.rectangularHull(adv.getPQProfile(), vars),
+                     std::runtime_error);
+    auto projected = unbounded.project(adv.getBeliefFunction(), PointType{2, 2, 2}, vars);
+    EXPECT((Eigen::Vector3d(projected[0], projected[1], projected[2]) -
+            Eigen::Vector3d(1, 1, 1)).norm() < 1e-9);
+  }},
+  {CASE( "Every expression is labelled with the variables it depends on" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    using namespace cv;
+    Var P("P");
+    Var Q("Q");
+    Var X("X");
+    Ref a("a");
+
+    buildRealExpr(adv.initCostFunction(), name(a, P * P + Real(1)) * (a + Q));
+    auto rect = adv.initPQProfile().initRectangle(2);
+    for (auto bounds : rect) {
+      bounds.initBoundA().setReal(-1);
+      bounds.initBoundB().setReal(1);
+    }
+    auto ball = adv.initBeliefFunction().initBall();
+    auto center = ball.initCenter(2);
+    center[0].setReal(0);
+    center[1].setReal(0);
+    buildRealExpr(ball.initRadius(), sqrt(X));
+
+    AdvFunc interpreter(adv);
+    auto p = AdvFunc::variableBit(AdvFunc::P_SLOT);
+    auto q = AdvFunc::variableBit(AdvFunc::Q_SLOT);
+    auto x = AdvFunc::variableBit(interpreter.slotOf("X"));
+
+    auto cost = adv.asReader().getCostFunction().getBinaryOperation();
+    EXPECT(interpreter.dependencies(adv.getCostFunction()) == (p | q));
+    EXPECT(interpreter.dependencies(cost.getArgA()) == p);
+    EXPECT(interpreter.dependencies(cost.getArgB()) == (p | q));
+    EXPECT(interpreter.dependencies(cost.getArgB().getBinaryOperation().getArgA()) == p);
+    // (the reference to a)
+    EXPECT(interpreter.isConstant(adv.getPQProfile()));
+    EXPECT(interpreter.dependencies(adv.getBeliefFunction()) == x);
+
+    // the hull of the constant PQ profile is computed once; the hull of the
+    // belief function follows X
+    ValueMap vars{{"X", 4}};
+    auto hull = interpreter.rectangularHull(adv.getPQProfile(), vars);
+    EXPECT(interpreter.rectangularHull(adv.getPQProfile(), vars).isApprox(hull));
+    EXPECT(interpreter.rectangularHull(adv.getBeliefFunction(), vars).max()(0) == 2);
+    vars["X"] = 9;
+    EXPECT(interpreter.rectangularHull(adv.getBeliefFunction(), vars).max()(0) == 3);
+
+    // expressions from other messages are analyzed on demand
+    ::capnp::MallocMessageBuilder other;
+    auto expr = other.initRoot<msg::RealExpr>();
+    buildRealExpr(expr, Var("Y") * Real(2));
+    EXPECT(interpreter.dependencies(expr) == AdvFunc::variableBit(63));
+    buildRealExpr(expr, sin(Real(2)));
+    EXPECT(interpreter.isConstant(expr));
+  }},
+  {CASE( "Specialized expressions agree with full evaluation" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    cv::PolyVar Pvar("P");
+    cv::PolyVar Qvar("Q");
+    cv::buildPolynomial(adv.initCostFunction().initPolynomial(),
+                        (Pvar^2) + 3*(Pvar|Qvar^3) + (-2)*(Qvar^2));
+    AdvFunc poly(adv);
+
+    // with P bound, the polynomial is one in Q only
+    auto residual = poly.specialize(adv.getCostFunction(), {{"P", 2}});
+    bool agree = true;
+    for (double q = -3; q <= 3; q += 0.25)
+      agree = agree &&
+              std::abs(poly.evaluate(residual, ValueMap{{"Q", q}}) -
+                       poly.evaluate(poly.costFunction(), ValueMap{{"P", 2}, {"Q", q}})) < 1e-9;
+    EXPECT(agree);
+    auto constant = poly.specialize(adv.getCostFunction(), {{"P", 2}, {"Q", 1}});
+    EXPECT(poly.evaluate(constant, ValueMap{}) == 4 + 6 - 2);
+    EXPECT_THROWS_AS(poly.evaluate(residual, ValueMap{}), UnknownVariable);
+
+    // case distinctions on P, and references to expressions that depend on P
+    adv = message.initRoot<msg::Advertisement>();
+    _zenoneAdvertisement(adv, -8000, 0, 1000, 600, 0.5, 2.0, 0, 0);
+    AdvFunc zenone(adv);
+    auto belief = adv.getBeliefFunction().getRectangle();
+    auto close = [](double a, double b) {
+      return std::abs(a - b) <= 1e-9 * std::max(1.0, std::abs(b));
+    };
+    agree = true;
+    for (double p = -8000; p <= 0; p += 250) {
+      ValueMap vars{{"P", p}};
+      for (auto bounds : belief) {
+        auto lower = zenone.specialize(bounds.getBoundA(), vars);
+        auto upper = zenone.specialize(bounds.getBoundB(), vars);
+        agree = agree &&
+                close(zenone.evaluate(lower, ValueMap{}), zenone.evaluate(bounds.getBoundA(), vars)) &&
+                close(zenone.evaluate(upper, ValueMap{}), zenone.evaluate(bounds.getBoundB(), vars));
+      }
+    }
+    EXPECT(agree);
+
+    // binding another variable leaves the case distinction in place
+    auto lower = zenone.specialize(belief[0].getBoundA(), {{"Q", 1}});
+    EXPECT(zenone.evaluate(lower, ValueMap{{"P", -7000}}) ==
+           zenone.evaluate(belief[0].getBoundA(), ValueMap{{"P", -7000}}));
+    EXPECT_THROWS_AS(zenone.evaluate(lower, ValueMap{}), EvaluationError);
+  }},
+  {CASE( "Released specializations do not grow the program" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    _zenoneAdvertisement(adv, -8000, 0, 1000, 600, 0.5, 2.0, 0, 0);
+    AdvFunc zenone(adv);
+    auto upper = zenone.compile(adv.getBeliefFunction().getRectangle()[0].getBoundB());
+    auto program = zenone.model()->program.mark();
+
+    // sweep Q while P is fixed, for one P after another
+    auto bound = adv.getBeliefFunction().getRectangle()[1].getBoundA();
+    auto close = [](double a, double b) {
+      return std::abs(a - b) <= 1e-9 * std::max(1.0, std::abs(b));
+    };
+    bool agree = true;
+    for (double P = -8000; P <= 0; P += 250) {
+      zenone.releaseSpecializations();
+      auto lower = zenone.specialize(bound, {{"P", P}});
+      auto cost = zenone.specialize(adv.getCostFunction(), {{"P", P}});
+      for (double Q = -100; Q <= 100; Q += 50) {
+        ValueMap vars{{"P", P}, {"Q", Q}};
+        agree = agree &&
+                close(zenone.evaluate(lower, ValueMap{{"Q", Q}}), zenone.evaluate(bound, vars)) &&
+                close(zenone.evaluate(cost, ValueMap{{"Q", Q}}),
+                      zenone.evaluate(adv.getCostFunction(), vars));
+      }
+    }
+    EXPECT(agree);
+    zenone.releaseSpecializations();
+    auto released = zenone.model()->program.mark();
+    EXPECT(released.code == program.code);
+    EXPECT(released.constants == program.constants);
+    EXPECT(released.sets == program.sets);
+    EXPECT(released.references == program.references);
+    EXPECT(released.stackSize == program.stackSize);
+
+    // expressions compiled before the first specialization remain valid
+    EXPECT(zenone.evaluate(upper, ValueMap{{"P", -7000}}) ==
+           zenone.evaluate(adv.getBeliefFunction().getRectangle()[0].getBoundB(),
+                           ValueMap{{"P", -7000}}));
+  }},
+  {CASE( "Polygons are enumerated by their vertices, counterclockwise" )
+  {
+    // the triangle with vertices (0,0), (2,0) and (0,2), with a redundant
+    // constraint and one that is given twice
+    Eigen::MatrixXd A(5, 2);
+    A << -1, 0,
+         0, -1,
+         1, 1,
+         2, 2,
+         1, 0;
+    Eigen::VectorXd b(5);
+    b << 0, 0, 2, 5, 3;
+    Vertices vertices;
+    EXPECT(convexPolygonVertices(A, b, vertices) == PolygonStatus::Bounded);
+    EXPECT(vertices.size() == 3);
+    bool ccw = true;
+    for (size_t i = 0; i < vertices.size(); ++i) {
+      Eigen::Vector2d u = vertices[(i + 1) % 3] - vertices[i];
+      Eigen::Vector2d v = vertices[(i + 2) % 3] - vertices[(i + 1) % 3];
+      ccw = ccw && u(0) * v(1) - u(1) * v(0) > 0;
+    }
+    EXPECT(ccw);
+    auto box = computeAABBConvexPolytope(A, b);
+    EXPECT((box.min() - Eigen::Vector2d(0, 0)).norm() < 1e-9);
+    EXPECT((box.max() - Eigen::Vector2d(2, 2)).norm() < 1e-9);
+
+    // a single point
+    Eigen::MatrixXd square(4, 2);
+    square << 1, 0,
+              0, 1,
+              -1, 0,
+              0, -1;
+    Eigen::VectorXd point(4);
+    point << 1, 1, -1, -1;
+    EXPECT(convexPolygonVertices(square, point, vertices) == PolygonStatus::Bounded);
+    box = computeAABBConvexPolytope(square, point);
+    EXPECT((box.min() - Eigen::Vector2d(1, 1)).norm() < 1e-9);
+    EXPECT((box.max() - Eigen::Vector2d(1, 1)).norm() < 1e-9);
+
+    // a half-plane, and the empty strip 1 <= x <= 0
+    Eigen::MatrixXd halfplane = A.topRows(1);
+    EXPECT(convexPolygonVertices(halfplane, b.head(1), vertices) == PolygonStatus::Unbounded);
+    Eigen::MatrixXd strip(2, 2);
+    strip << 1, 0,
+             -1, 0;
+    EXPECT(convexPolygonVertices(strip, Eigen::Vector2d(0, -1), vertices) == PolygonStatus::Empty);
+    EXPECT_THROWS_AS(computeAABBConvexPolytope(halfplane, b.head(1)), std::runtime_error);
+    EXPECT(convexPolygonVertices(square, Eigen::Vector4d(-1, 1, 0, 1), vertices) == PolygonStatus::Empty);
+  }},
+  {CASE( "A Seidel LP context solves incrementally as constraints are added" )
+  {
+    // the triangle with vertices (0,0), (2,0) and (0,2)
+    Eigen::MatrixXd A(3, 2);
+    A << -1, 0,
+         0, -1,
+         1, 1;
+    SeidelLP lp;
+    lp.reserve(5);
+    lp.addConstraints(A, Eigen::Vector3d(0, 0, 2));
+    Eigen::VectorXd x;
+    EXPECT(lp.minimize(Eigen::Vector2d(-1, -0.5), x) == SeidelLP::Status::Minimum);
+    EXPECT((x - Eigen::Vector2d(2, 0)).norm() < 1e-9);
+
+    // cutting off the optimum: x <= 1 and y <= 1.5
+    lp.addConstraint(Eigen::Vector2d(1, 0), 1);
+    lp.addConstraint(Eigen::Vector2d(0, 1), 1.5);
+    EXPECT(lp.minimize(Eigen::Vector2d(-1, -0.5), x) == SeidelLP::Status::Minimum);
+    EXPECT((x - Eigen::Vector2d(1, 1)).norm() < 1e-9);
+    EXPECT(lp.size() == 5);
+    EXPECT(lp.minimize(Eigen::Vector2d(-0.5, -1), x) == SeidelLP::Status::Minimum);
+    EXPECT((x - Eigen::Vector2d(0.5, 1.5)).norm() < 1e-9);
+
+    lp.addConstraint(Eigen::Vector2d(-1, -1), -3); // (x + y >= 3)
+    EXPECT(lp.minimize(Eigen::Vector2d(-0.5, -1), x) == SeidelLP::Status::Infeasible);
+
+    lp.clear();
+    lp.addConstraint(Eigen::Vector2d(-1, 0), 0);
+    EXPECT(lp.minimize(Eigen::Vector2d(0, 1), x) == SeidelLP::Status::Unbounded);
+
+    // solve_lp2 minimizes over half-planes h_0 x + h_1 y + h_2 >= 0
+    auto sol = solve_lp2({1, 0, 0, 0, 1, 0, -1 / std::sqrt(2.0), -1 / std::sqrt(2.0), std::sqrt(2.0)}, {0, -1});
+    EXPECT(std::abs(sol[0]) < 1e-9);
+    EXPECT(std::abs(sol[1] - 2) < 1e-9);
+    EXPECT_THROWS_AS(solve_lp2({1, 0, 0}, {1, 1}), std::runtime_error);
+  }},
+  {CASE( "Bounding boxes of polytopes in more than two dimensions" )
+  {
+    // the simplex x, y, z >= 0, x + y + z <= 1
+    Eigen::MatrixXd simplex(4, 3);
+    simplex << -1, 0, 0,
+               0, -1, 0,
+               0, 0, -1,
+               1, 1, 1;
+    Eigen::VectorXd bound(4);
+    bound << 0, 0, 0, 1;
+    auto box = computeAABBConvexPolytope(simplex, bound);
+    EXPECT(box.dim() == 3);
+    EXPECT(box.min().norm() < 1e-9);
+    EXPECT((box.max() - Eigen::Vector3d::Ones()).norm() < 1e-9);
+    EXPECT_THROWS_AS(computeAABBConvexPolytope(simplex.topRows(3), bound.head(3)), std::runtime_error);
+
+    // three-phase setpoints (P1, Q1, ..., P3, Q3) in [-1, 1]^6 that sum to at
+    // most -5, as one polytope (the PQ profile) and as the intersection of two
+    // (the belief function)
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    Eigen::MatrixXd A(13, 6);
+    A << Eigen::MatrixXd::Identity(6, 6),
+         -Eigen::MatrixXd::Identity(6, 6),
+         Eigen::RowVectorXd::Ones(6);
+    Eigen::VectorXd b(13);
+    b << Eigen::VectorXd::Ones(12), -5;
+    cv::buildConvexPolytope(A, b, adv.initPQProfile().initConvexPolytope());
+    auto parts = adv.initBeliefFunction().initIntersection(2);
+    cv::buildConvexPolytope(A.topRows(12), b.head(12), parts[0].initConvexPolytope());
+    cv::buildConvexPolytope(A.bottomRows(1), b.tail(1), parts[1].initConvexPolytope());
+
+    AdvFunc interpreter(adv);
+    for (auto set : {adv.getPQProfile(), adv.getBeliefFunction()}) {
+      auto hull = interpreter.rectangularHull(set, ValueMap{});
+      EXPECT(hull.dim() == 6);
+      EXPECT((hull.min() + Eigen::VectorXd::Ones(6)).norm() < 1e-9);
+      EXPECT(hull.max().norm() < 1e-9);
+    }
+  }},
+  {CASE( "Support points, distances and projections by GJK" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    ValueMap vars;
+
+    // the triangle with vertices (0,0), (2,0) and (0,2) (constant, hence its
+    // vertices are cached), and the disk of radius 1 around (5,0)
+    Eigen::MatrixXd A(3, 2);
+    A << -1, 0,
+         0, -1,
+         1, 1;
+    cv::buildConvexPolytope(A, Eigen::Vector3d(0, 0, 2), adv.initPQProfile().initConvexPolytope());
+    auto disk = adv.initBeliefFunction().initBall();
+    disk.initRadius().setReal(1);
+    auto center = disk.initCenter(2);
+    center[0].setReal(5);
+    center[1].setReal(0);
+    AdvFunc interpreter(adv);
+    auto triangle = adv.getPQProfile();
+    auto ball = adv.getBeliefFunction();
+
+    auto s = interpreter.support(triangle, Eigen::Vector2d(1, -0.1), vars);
+    EXPECT((s.point - Eigen::Vector2d(2, 0)).norm() < 1e-9);
+    EXPECT(std::abs(s.value - 2) < 1e-9);
+    s = interpreter.support(ball, Eigen::Vector2d(3, 4), vars);
+    EXPECT((s.point - Eigen::Vector2d(5.6, 0.8)).norm() < 1e-12);
+    EXPECT(std::abs(s.value - 20) < 1e-12);
+
+    Eigen::VectorXd nearestA, nearestB;
+    EXPECT(std::abs(interpreter.distance(triangle, ball, vars, &nearestA, &nearestB) - 2) < 1e-6);
+    EXPECT((nearestA - Eigen::Vector2d(2, 0)).norm() < 1e-3);
+    EXPECT((nearestB - Eigen::Vector2d(4, 0)).norm() < 1e-3);
+    EXPECT(interpreter.distance(triangle, triangle, vars) == 0);
+    EXPECT((interpreter.closestPoint(triangle, Eigen::Vector2d(2, 2), vars) - Eigen::Vector2d(1, 1)).norm() < 1e-9);
+    EXPECT((interpreter.closestPoint(ball, Eigen::Vector2d(5, 3), vars) - Eigen::Vector2d(5, 1)).norm() < 1e-4);
+
+    // sets outside the advertisement: a rectangle, the simplex in three
+    // dimensions, a half-plane, and the unit disk cut by P >= 0.5
+    ::capnp::MallocMessageBuilder other;
+    auto sets = other.initRoot<msg::Advertisement>();
+    auto rect = sets.initPQProfile().initRectangle(2);
+    rect[0].initBoundA().setReal(1);
+    rect[0].initBoundB().setReal(0);
+    rect[1].initBoundA().setReal(-1);
+    rect[1].initBoundB().setReal(2);
+    s = interpreter.support(sets.getPQProfile(), Eigen::Vector2d(-1, 1), vars);
+    EXPECT(s.point == Eigen::Vector2d(0, 2));
+
+    Eigen::MatrixXd simplex(4, 3);
+    simplex << -1, 0, 0,
+               0, -1, 0,
+               0, 0, -1,
+               1, 1, 1;
+    cv::buildConvexPolytope(simplex, Eigen::Vector4d(0, 0, 0, 1), sets.initBeliefFunction().initConvexPolytope());
+    s = interpreter.support(sets.getBeliefFunction(), Eigen::Vector3d(1, 2, 3), vars);
+    EXPECT((s.point - Eigen::Vector3d(0, 0, 1)).norm() < 1e-9);
+    EXPECT((interpreter.closestPoint(sets.getBeliefFunction(), Eigen::Vector3d(1, 1, 1), vars) -
+            Eigen::Vector3d::Constant(1 / 3.0)).norm() < 1e-9);
+
+    auto cut = sets.initPQProfile().initIntersection(2);
+    cut[0].initBall().initRadius().setReal(1);
+    auto origin = cut[0].getBall().initCenter(2);
+    origin[0].setReal(0);
+    origin[1].setReal(0);
+    Eigen::MatrixXd halfPlane(1, 2);
+    halfPlane << -1, 0;
+    cv::buildConvexPolytope(halfPlane, Eigen::VectorXd::Constant(1, -0.5), cut[1].initConvexPolytope());
+    s = interpreter.support(sets.getPQProfile(), Eigen::Vector2d(0, 1), vars);
+    EXPECT((s.point - Eigen::Vector2d(0.5, std::sqrt(0.75))).norm() < 1e-9);
+    EXPECT_THROWS_AS(interpreter.support(cut[1], Eigen::Vector2d(1, 0), vars), EvaluationError);
+  }},
+  {CASE( "Evaluation contexts share the advertisement across threads" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto adv = message.initRoot<msg::Advertisement>();
+    using namespace cv;
+    Var X("X");
+
+    // a cost function with memoized references (as in the test above), and
+    // the triangle with vertices (0,0), (X,0) and (0,X) as belief function
+    std::function<void(msg::RealExpr::Builder, int)> build =
+        [&](msg::RealExpr::Builder expr, int k) {
+          expr.setName(("a" + std::to_string(k)).c_str());
+          if (k == 0) {
+            buildRealExpr(expr, X * Var("P") + Var("Q"));
+            return;
+          }
+          auto sum = expr.initBinaryOperation();
+          sum.initOperation().setSum();
+          build(sum.initArgA(), k - 1);
+          sum.initArgB().setReference(("a" + std::to_string(k - 1)).c_str());
+        };
+    build(adv.initCostFunction(), 8);
+    Eigen::MatrixXd A(3, 2);
+    A << -1, 0,
+         0, -1,
+         1, 1;
+    cv::buildConvexPolytope(A, Eigen::Vector3d(0, 0, 1), adv.initBeliefFunction().initConvexPolytope());
+    buildRealExpr(adv.getBeliefFunction().getConvexPolytope().getB()[2], X);
+
+    AdvFunc interpreter(adv);
+    const int threads = 4, steps = 200;
+    auto run = [&](AdvFunc &context, int t) {
+      std::vector<double> results;
+      for (int i = 0; i < steps; ++i) {
+        double x = 1 + 0.01 * (i + steps * t);
+        ValueMap vars{{"X", x}, {"P", x}, {"Q", -x}};
+        results.push_back(context.evaluate(adv.getCostFunction(), vars));
+        results.push_back(context.evaluate(context.costFunction(), vars));
+        Eigen::VectorXd projected =
+            context.project(adv.getBeliefFunction(), Eigen::Vector2d(x, x), vars);
+        results.push_back(projected(0));
+        results.push_back(projected(1));
+        results.push_back(context.rectangularHull(adv.getBeliefFunction(), vars).max()(0));
+      }
+      return results;
+    };
+
+    std::vector<std::vector<double>> concurrent(threads);
+    std::vector<AdvFunc> contexts;
+    for (int t = 0; t < threads; ++t)
+      contexts.push_back(interpreter.context());
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+      workers.emplace_back([&, t] { concurrent[t] = run(contexts[t], t); });
+    for (auto &worker : workers)
+      worker.join();
+
+    for (int t = 0; t < threads; ++t) {
+      EXPECT(contexts[t].model() == interpreter.model());
+      EXPECT(concurrent[t] == run(interpreter, t));
+    }
+
+    // compiling on a context does not modify the model of the others
+    auto context = interpreter.context();
+    auto pq = context.compile(adv.getBeliefFunction());
+    EXPECT(context.model() != interpreter.model());
+    EXPECT(interpreter.model()->program.sets.size() <
+           context.model()->program.sets.size());
+    EXPECT(context.testMembership(pq, PointType{0.1, 0.1}, ValueMap{{"X", 1}}));
+  }},
+  {CASE( "A fleet of advertisements is evaluated in parallel" )
+  {
+    ::capnp::MallocMessageBuilder message;
+    auto root = message.initRoot<msg::Message>();
+    FleetEvaluator fleet(4, 8);
+    const uint32_t agents = 100;
+    for (uint32_t id = 0; id < agents; ++id) {
+      root.setAgentId(id);
+      double k = id;
+      _BatteryAdvertisement(root.initAdvertisement(), -10 - k, 10 + k, 15 + k,
+                            1, 0.1 * (id % 7), 0.5 * k, 1);
+      fleet.update(root.asReader());
+    }
+    EXPECT(fleet.size() == agents);
+
+    std::vector<AgentQuery> queries;
+    for (uint32_t id = 0; id <= agents; ++id)
+      queries.push_back(AgentQuery{id, 20.0 - id, 2.0});
+    // (the last agent is unknown)
+    for (int cycle = 0; cycle < 3; ++cycle) {
+      const auto &results = fleet.evaluate(queries);
+      EXPECT(results.size() == queries.size());
+      for (uint32_t id = 0; id < agents; ++id) {
+        const auto &result = results[id];
+        EXPECT(result.agentId == id);
+        EXPECT(result.valid);
+
+        // the same queries with an AdvFunc of its own
+        ::capnp::MallocMessageBuilder single;
+        auto adv = single.initRoot<msg::Advertisement>();
+        double k = id;
+        _BatteryAdvertisement(adv, -10 - k, 10 + k, 15 + k, 1, 0.1 * (id % 7),
+                              0.5 * k, 1);
+        AdvFunc interpreter(adv);
+        Eigen::Vector2d setpoint(20.0 - id, 2.0), gradient;
+        ValueMap vars{{"P", setpoint(0)}, {"Q", setpoint(1)}};
+        EXPECT(result.cost == interpreter.evaluateWithGradient(
+                                  interpreter.costFunction(), setpoint, gradient));
+        EXPECT(result.gradient == Eigen::VectorXd(gradient));
+        EXPECT(result.projection ==
+               Eigen::VectorXd(interpreter.project(adv.getPQProfile(), setpoint, ValueMap{})));
+        auto hull = interpreter.rectangularHull(adv.getBeliefFunction(), vars);
+        EXPECT(result.beliefHull.min() == hull.min());
+        EXPECT(result.beliefHull.max() == hull.max());
+      }
+      EXPECT(!results[agents].valid);
+    }
+
+    const auto &stats = fleet.stats();
+    EXPECT(stats.agents == agents + 1);
+    EXPECT(stats.tasks == 13);
+    EXPECT(stats.median <= stats.p90);
+    EXPECT(stats.p90 <= stats.p99);
+    EXPECT(stats.p99 <= stats.max);
+    EXPECT(stats.max <= stats.duration);
+    EXPECT(fleet.cyclePercentile(0.5) <= fleet.cyclePercentile(1));
+
+    // one agent at many setpoints, in all batches at once
+    std::vector<AgentQuery> sweep;
+    for (int k = 0; k < 64; ++k)
+      sweep.push_back(AgentQuery{7, -20.0 + 0.625 * k, 0.5 * (k % 5)});
+    ::capnp::MallocMessageBuilder single;
+    auto adv = single.initRoot<msg::Advertisement>();
+    _BatteryAdvertisement(adv, -17, 17, 22, 1, 0, 3.5, 1); // (agent 7)
+    AdvFunc interpreter(adv);
+    for (int cycle = 0; cycle < 3; ++cycle) {
+      const auto &results = fleet.evaluate(sweep);
+      bool agree = fleet.stats().tasks == 8;
+      for (size_t k = 0; k < sweep.size(); ++k) {
+        Eigen::Vector2d setpoint(sweep[k].P, sweep[k].Q), gradient;
+        double cost = interpreter.evaluateWithGradient(interpreter.costFunction(),
+                                                       setpoint, gradient);
+        agree = agree && results[k].valid && results[k].agentId == 7 &&
+                results[k].cost == cost &&
+                results[k].gradient == Eigen::VectorXd(gradient) &&
+                results[k].projection ==
+                    Eigen::VectorXd(interpreter.project(adv.getPQProfile(),
+                                                        setpoint, ValueMap{}));
+      }
+      EXPECT(agree);
+    }
+
+    // all agents, at their implemented setpoints
+    fleet.remove(0);
+    const auto &all = fleet.evaluate();
+    EXPECT(all.size() == agents - 1);
+    EXPECT(all.front().agentId == 1);
+    EXPECT(all.front().projection == Eigen::VectorXd(Eigen::Vector2d(0.5, 1)));
+  }},
+  {CASE( "Advertisements of the same structure are evaluated as one fleet" )
+  {
+    const size_t batteries = 150, pvs = 70;
+    std::vector<std::unique_ptr<::capnp::MallocMessageBuilder>> messages;
+    std::vector<msg::Advertisement::Reader> advs;
+    auto next = [&]() {
+      messages.emplace_back(new ::capnp::MallocMessageBuilder());
+      return messages.back()->initRoot<msg::Advertisement>();
+    };
+    for (size_t i = 0; i < batteries; ++i) {
+      double k = i;
+      auto adv = next();
+      _BatteryAdvertisement(adv, -10 - k, 10 + k, 15 + k, 1 + k,
+                            (i == 7) ? 0 : 0.1 * (1 + i % 3), 0, 0);
+      // (without quadratic cost, the cost function has another structure)
+      advs.push_back(adv.asReader());
+    }
+    for (size_t i = 0; i < pvs; ++i) {
+      double k = i;
+      auto adv = next();
+      _PVAdvertisement(adv, 20 + k, 15 + k, 1, 0.2 + 0.01 * k, 1 + 0.1 * k,
+                       0.5, 10, 0);
+      advs.push_back(adv.asReader());
+    }
+    // a cost whose literals are neutral elements in the first advertisement
+    // (which must not be folded away)
+    using namespace cv;
+    for (double a : {1.0, 2.0}) {
+      auto adv = next();
+      buildRealExpr(adv.initCostFunction(), Real(a) * Var("P") + Real(a - 1));
+      advs.push_back(adv.asReader());
+    }
+
+    auto battery = structureOf(advs[0]);
+    EXPECT(battery.signature == structureOf(advs[1]).signature);
+    EXPECT(battery.hash == structureOf(advs[1]).hash);
+    EXPECT(battery.literals != structureOf(advs[1]).literals);
+    EXPECT(battery.signature != structureOf(advs[7]).signature);
+    EXPECT(battery.signature != structureOf(advs[batteries]).signature);
+
+    HomogeneousFleet fleet;
+    for (auto adv : advs)
+      fleet.add(adv);
+    auto n = advs.size();
+    EXPECT(fleet.size() == n);
+    EXPECT(fleet.shapes() == 4);
+    EXPECT(fleet.shapeOf(0) == fleet.shapeOf(batteries - 1));
+
+    std::vector<double> P(n), Q(n), cost(n);
+    std::unique_ptr<bool[]> member(new bool[n]);
+    for (size_t i = 0; i < n; ++i) {
+      P[i] = 16.0 * std::sin(0.7 * i);
+      Q[i] = 9.0 * std::cos(1.3 * i);
+    }
+    fleet.evaluateCost(P.data(), Q.data(), cost.data());
+    for (size_t i = 0; i < n; ++i) {
+      AdvFunc interpreter(advs[i]);
+      ValueMap vars{{"P", P[i]}, {"Q", Q[i]}};
+      EXPECT(std::abs(cost[i] - interpreter.evaluate(advs[i].getCostFunction(), vars)) <
+             1e-12 * (1 + std::abs(cost[i])));
+    }
+    EXPECT(cost[n - 2] == P[n - 2]);
+    EXPECT(cost[n - 1] == 2 * P[n - 1] + 1);
+
+    // the PQ profiles (of the resources, the last two advertisements have none)
+    messages.resize(n - 2);
+    advs.resize(n - 2);
+    HomogeneousFleet resources;
+    for (auto adv : advs)
+      resources.add(adv);
+    resources.testPQProfile(P.data(), Q.data(), member.get());
+    size_t inside = 0;
+    for (size_t i = 0; i < n - 2; ++i) {
+      AdvFunc interpreter(advs[i]);
+      EXPECT(member[i] == interpreter.testMembership(advs[i].getPQProfile(),
+                                                     PointType{P[i], Q[i]}, ValueMap{}));
+      inside += member[i];
+    }
+    EXPECT(inside > 0);
+    EXPECT(inside < n - 2);
+
+    // an advertisement that changes its literals stays in its shape, one that
+    // changes its structure moves
+    auto adv = next();
+    _BatteryAdvertisement(adv, -1, 1, 2, 0.5, 0.5, 0, 0);
+    resources.update(0, adv);
+    resources.update(1, advs[batteries]);
+    EXPECT(resources.shapeOf(0) == resources.shapeOf(2));
+    EXPECT(resources.shapeOf(1) == resources.shapeOf(batteries));
+    resources.evaluateCost(P.data(), Q.data(), cost.data());
+    EXPECT(std::abs(cost[0] - AdvFunc(adv).evaluate(adv.asReader().getCostFunction(),
+                                                    {{"P", P[0]}, {"Q", Q[0]}})) < 1e-12);
+    EXPECT(std::abs(cost[1] - AdvFunc(advs[batteries]).evaluate(
+                                  advs[batteries].getCostFunction(),
+                                  {{"P", P[1]}, {"Q", Q[1]}})) < 1e-12);
+  }},
+  {CASE( "Advertisements of a known structure reuse the compiled program" )
+  {
+    AdvCache cache(2);
+    std::vector<std::unique_ptr<::capnp::MallocMessageBuilder>> messages;
+    auto battery = [&](double Pmax, double Pimp) {
+      messages.emplace_back(new ::capnp::MallocMessageBuilder());
+      auto adv = messages.back()->initRoot<msg::Advertisement>();
+      _BatteryAdvertisement(adv, -Pmax, Pmax, 1.5 * Pmax, 1, 0.2, Pimp, 0);
+      return adv.asReader();
+    };
+
+    for (double Pmax : {10.0, 20.0, 5.0}) {
+      auto adv = battery(Pmax, 0.5 * Pmax);
+      AdvFunc fresh(adv);
+      auto interpreter = cache.interpreter(adv);
+      EXPECT(interpreter.model()->adv.getImplementedSetpoint()[0] == 0.5 * Pmax);
+      // the polytope of the PQ profile is cached with the new literals
+      const auto &polytopes = interpreter.model()->constantPolytopes;
+      const auto &expected = fresh.model()->constantPolytopes;
+      EXPECT(polytopes.size() == 1u);
+      EXPECT(expected.size() == 1u);
+      EXPECT(polytopes.begin()->first == expected.begin()->first);
+      EXPECT(polytopes.begin()->second.b == expected.begin()->second.b);
+      for (double P : {-30.0, -7.0, 0.0, 4.0, 12.0, 25.0}) {
+        ValueMap vars{{"P", P}, {"Q", 3.0}};
+        Eigen::Vector2d point(P, 3);
+        EXPECT(std::abs(interpreter.evaluate(interpreter.costFunction(), vars) -
+                        fresh.evaluate(fresh.costFunction(), vars)) < 1e-12);
+        EXPECT(std::abs(interpreter.evaluate(adv.getCostFunction(), vars) -
+                        fresh.evaluate(adv.getCostFunction(), vars)) < 1e-12);
+        EXPECT(interpreter.testMembership(interpreter.pqProfile(), PointType{P, 3}, vars) ==
+               fresh.testMembership(fresh.pqProfile(), PointType{P, 3}, vars));
+        EXPECT((interpreter.project(adv.getPQProfile(), point, vars) -
+                fresh.project(adv.getPQProfile(), point, vars)).norm() < 1e-9);
+        auto hull = interpreter.rectangularHull(adv.getBeliefFunction(), vars);
+        EXPECT((hull.max() - fresh.rectangularHull(adv.getBeliefFunction(), vars).max())
+                   .norm() < 1e-12);
+      }
+    }
+    EXPECT(cache.misses() == 1);
+    EXPECT(cache.hits() == 2);
+
+    // another structure is compiled, and the least recently used one evicted
+    ::capnp::MallocMessageBuilder pv, load;
+    _PVAdvertisement(pv.initRoot<msg::Advertisement>(), 20, 15, 1, 0.3, 1, 0.5, 10, 0);
+    _uncontrollableLoad(load.initRoot<msg::Advertisement>(), -5, 1, 10, 1, 1, 1, 1, -5, 1);
+    auto pvModel = cache.model(pv.getRoot<msg::Advertisement>());
+    EXPECT(cache.misses() == 2);
+    EXPECT(cache.size() == 2);
+    cache.model(pv.getRoot<msg::Advertisement>());
+    cache.model(load.getRoot<msg::Advertisement>());
+    EXPECT(cache.misses() == 3);
+    EXPECT(cache.size() == 2);
+    cache.model(battery(8, 1));
+    EXPECT(cache.misses() == 4);
+    EXPECT(pvModel->parametric);
+    EXPECT(!pvModel->bindings.empty());
+
+    // rebinding drops the specialized expressions, which have the old
+    // literals folded into them
+    ::capnp::MallocMessageBuilder other;
+    auto cheaper = other.initRoot<msg::Advertisement>();
+    _BatteryAdvertisement(cheaper, -10, 10, 15, 2, 0.5, 5, 0);
+    auto interpreter = cache.interpreter(battery(10, 5));
+    auto compiled = interpreter.model()->program.mark();
+    auto cost = interpreter.specialize(interpreter.model()->adv.getCostFunction(),
+                                       {{"P", 4.0}});
+    interpreter.evaluate(cost, ValueMap{{"Q", 3.0}});
+    interpreter.rebind(cheaper, structureOf(cheaper));
+    EXPECT(!interpreter.model()->specialized);
+    EXPECT(interpreter.model()->program.mark().code == compiled.code);
+    EXPECT(interpreter.model()->program.mark().constants == compiled.constants);
+    AdvFunc fresh(cheaper);
+    cost = interpreter.specialize(cheaper.getCostFunction(), {{"P", 4.0}});
+    EXPECT(std::abs(interpreter.evaluate(cost, ValueMap{{"Q", 3.0}}) -
+                    fresh.evaluate(cheaper.getCostFunction(),
+                                   ValueMap{{"P", 4.0}, {"Q", 3.0}})) < 1e-12);
+    EXPECT(std::abs(interpreter.evaluate(interpreter.costFunction(), ValueMap{{"P", 4.0}, {"Q", 3.0}}) -
+                    fresh.evaluate(fresh.costFunction(), ValueMap{{"P", 4.0}, {"Q", 3.0}})) < 1e-12);
+  }},
+  {CASE( "The latest advertisements are published while they are read" )
+  {
+    AdvertisementTable table(16, 4);
+    auto publish = [&](uint32_t agentId, double Pmax) {
+      ::capnp::MallocMessageBuilder message;
+      auto adv = message.initRoot<msg::Advertisement>();
+      _BatteryAdvertisement(adv, -Pmax, Pmax, 1.5 * Pmax, 1, 0.2, 0.5 * Pmax, 0);
+      table.publish(agentId, adv.asReader());
+      // (the table keeps a copy)
+    };
+
+    {
+      AdvertisementTable::Reader reader(table);
+      AdvertisementTable::Reader::Section section(reader);
+      EXPECT(reader.find(7) == nullptr);
+    }
+    publish(7, 10);
+    publish(7, 20);
+    EXPECT(!table.remove(3));
+    {
+      AdvertisementTable::Reader reader(table);
+      AdvertisementTable::Reader::Section section(reader);
+      auto published = reader.find(7);
+      EXPECT(published != nullptr);
+      EXPECT(published->version == 2u);
+      EXPECT(published->adv.getImplementedSetpoint()[0] == 10);
+      EXPECT(table.remove(7));
+      // (still readable in the section)
+      EXPECT(published->adv.getImplementedSetpoint()[0] == 10);
+      EXPECT(table.reclaim() == 1u);
+      EXPECT(reader.find(7) == nullptr);
+    }
+    EXPECT(table.reclaim() == 0u);
+
+    // every advertisement a reader finds is consistent with its model, and
+    // the versions of an agent never go back
+    const uint32_t agents = 8;
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::atomic<int> found(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; ++r)
+      readers.emplace_back([&]() {
+        AdvertisementTable::Reader reader(table);
+        std::vector<uint64_t> versions(agents, 0);
+        while (!done.load()) {
+          AdvertisementTable::Reader::Section section(reader);
+          for (uint32_t agentId = 0; agentId < agents; ++agentId) {
+            auto published = reader.find(agentId);
+            if (!published)
+              continue;
+            ++found;
+            AdvFunc context(published->model);
+            double Pmax = 2 * published->adv.getImplementedSetpoint()[0];
+            ValueMap vars;
+            if (published->agentId != agentId ||
+                published->version < versions[agentId] ||
+                !context.testMembership(context.pqProfile(), PointType{Pmax - 1, 0}, vars) ||
+                context.testMembership(context.pqProfile(), PointType{Pmax + 1, 0}, vars))
+              ++errors;
+            versions[agentId] = published->version;
+          }
+        }
+      });
+    for (int k = 0; k < 200; ++k)
+      for (uint32_t agentId = 0; agentId < agents; ++agentId)
+        publish(agentId, 10 + k + agentId);
+    done.store(true);
+    for (auto &thread : readers)
+      thread.join();
+    EXPECT(errors.load() == 0);
+    EXPECT(found.load() > 0);
+    EXPECT(table.reclaim() == 0u);
+  }},
 };
 
 int main( int argc, char * argv[] )
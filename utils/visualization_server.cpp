@@ -69,7 +69,7 @@ public:
 
   template <typename DerivedA, typename DerivedB>
   Eigen::MatrixXd
-  evalFunOnPQDomain(msg::RealExpr::Reader pqFun, msg::SetExpr::Reader pqDomain, 
+  evalFunOnPQDomain(CompiledExpr pqFun, CompiledSet pqDomain, 
                     AdvFunc &interpreter,
                     const Eigen::MatrixBase<DerivedA> &evalPointsP,
                     const Eigen::MatrixBase<DerivedB> &evalPointsQ)
@@ -87,25 +87,45 @@ public:
     //  if not, we set the corresponding entry in the result-matrix to "NaN"
     //  if the point lies in the domain, then we evaluate the function on this
     //  point and store the function value in the result-matrix
+    //
+    // Both steps use the batch evaluation of the interpreter; the function is
+    // only evaluated on the grid points inside the domain.
 
     auto dimP = evalPointsP.size();
     auto dimQ = evalPointsQ.size();
-
-    Eigen::MatrixXd result(dimP, dimQ);
+    auto n = dimP * dimQ;
 
     double nan = std::numeric_limits<double>::quiet_NaN();
+    Eigen::MatrixXd result = Eigen::MatrixXd::Constant(dimP, dimQ, nan);
 
-    ValueMap dummy;
-    for (auto i = 0; i < dimP; ++i)
-      for (auto j = 0; j < dimQ; ++j) {
-        auto isMember = interpreter.testMembership(
-            pqDomain, {evalPointsP(i), evalPointsQ(j)}, dummy);
-        if (isMember)
-          result(i, j) = interpreter.evaluate(
-              pqFun, {{"P", evalPointsP(i)}, {"Q", evalPointsQ(j)}});
-        else
-          result(i, j) = nan;
-      }
+    // the grid points, in the (column-major) order of result
+    Eigen::VectorXd gridP(n), gridQ(n);
+    for (auto j = 0; j < dimQ; ++j) {
+      gridP.segment(j * dimP, dimP) = evalPointsP;
+      gridQ.segment(j * dimP, dimP).setConstant(evalPointsQ(j));
+    }
+
+    Eigen::Array<bool, Eigen::Dynamic, 1> inDomain(n);
+    interpreter.testMembershipBatch(pqDomain, gridP.data(), gridQ.data(), n,
+                                    inDomain.data());
+
+    // gather the grid points that lie in the domain
+    std::vector<Eigen::VectorXd::Index> indices;
+    for (Eigen::VectorXd::Index k = 0; k < n; ++k)
+      if (inDomain(k))
+        indices.push_back(k);
+
+    Eigen::VectorXd domainP(indices.size()), domainQ(indices.size()),
+        values(indices.size());
+    for (size_t k = 0; k < indices.size(); ++k) {
+      domainP(k) = gridP(indices[k]);
+      domainQ(k) = gridQ(indices[k]);
+    }
+    interpreter.evaluateBatch(pqFun, domainP.data(), domainQ.data(),
+                              indices.size(), values.data());
+
+    for (size_t k = 0; k < indices.size(); ++k)
+      result(indices[k]) = values(k);
     return result;
   }
 
@@ -219,7 +239,8 @@ public:
 
     // rasterize cost function on given grid
     Eigen::MatrixXd rasterizedCF(
-        evalFunOnPQDomain(adv.getCostFunction(), pqProf, interpreter, p, q));
+        evalFunOnPQDomain(interpreter.costFunction(), interpreter.pqProfile(),
+                          interpreter, p, q));
 
     // apply runlength compression to the elements NaN and zero (it is expected
     // that there will be many 'burst' patters of both elements, hence runlength